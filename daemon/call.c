@@ -44,13 +44,13 @@
 #include "main.h"
 #include "graphite.h"
 #include "codec.h"
+#include "thread_stats.h"
 
 
 /* also serves as array index for callstream->peers[] */
 struct iterator_helper {
 	GSList			*del_timeout;
 	GSList			*del_scheduled;
-	GHashTable		*addr_sfd;
 };
 struct xmlrpc_helper {
 	enum xmlrpc_format fmt;
@@ -122,11 +122,28 @@ const int num_transport_protocols = G_N_ELEMENTS(transport_protocols);
 struct stats rtpe_statsps;
 struct stats rtpe_stats;
 
-rwlock_t rtpe_callhash_lock;
-GHashTable *rtpe_callhash;
+/* the call hash is split into shards by call-id, each with its own lock */
+#define CALL_HASH_SHARDS	64
+
+struct call_hash_shard {
+	rwlock_t		lock;
+	GHashTable		*calls;
+};
+
+static struct call_hash_shard __call_hash[CALL_HASH_SHARDS];
+atomic64 rtpe_callhash_size;
+
+/* timed out calls waiting for call_timer() to notify the b2b about them in one go */
+static mutex_t __timed_out_lock = MUTEX_STATIC_INIT;
+static GSList *__timed_out;
 
 /* ********** */
 
+INLINE struct call_hash_shard *call_hash_shard(const str *callid) {
+	guint h = str_hash(callid);
+	return &__call_hash[(h ^ (h >> 16)) & (CALL_HASH_SHARDS - 1)];
+}
+
 static void __monologue_destroy(struct call_monologue *monologue);
 static int monologue_destroy(struct call_monologue *ml);
 static struct timeval add_ongoing_calls_dur_in_interval(struct timeval *interval_start,
@@ -171,11 +188,23 @@ out:
 }
 
 
+/* keeps track of the earliest upcoming deadline */
+INLINE void call_timer_next(time_t *next, time_t t) {
+	if (t <= rtpe_now.tv_sec)
+		return;
+	if (!*next || t < *next)
+		*next = t;
+}
 
-/* called with hashlock held */
-static void call_timer_iterator(gpointer data, gpointer user_data) {
-	struct call *c = data;
-	struct iterator_helper *hlp = user_data;
+/* called with call->master_lock held in W or R. makes sure the call's timeouts are
+ * checked no later than at the given time */
+void call_timer_schedule(struct call *c, time_t when) {
+	poller_timer_advance_ms(rtpe_poller, &c->timeout_timer, when * 1000LL);
+}
+
+/* checks the call for expired timeouts and schedules the next check for the earliest
+ * upcoming deadline. calls to be deleted are added to the helper's lists. */
+static void call_timer_iterator(struct call *c, struct iterator_helper *hlp) {
 	GList *it;
 	unsigned int check;
 	int good = 0;
@@ -185,13 +214,19 @@ static void call_timer_iterator(gpointer data, gpointer user_data) {
 	struct call_monologue *ml;
 	enum call_stream_state css;
 	atomic64 *timestamp;
+	time_t next = 0, stream_next = 0, t;
 
 	rwlock_lock_r(&c->master_lock);
 	log_info_call(c);
 
+	if (c->destroyed)
+		goto out_unlocked;
+
 	rwlock_lock_r(&rtpe_config.config_lock);
 
 	// final timeout applicable to all calls (own and foreign)
+	if (rtpe_config.final_timeout)
+		call_timer_next(&next, c->created.tv_sec + rtpe_config.final_timeout);
 	if (rtpe_config.final_timeout && rtpe_now.tv_sec >= (c->created.tv_sec + rtpe_config.final_timeout)) {
 		ilog(LOG_INFO, "Closing call due to final timeout");
 		tmp_t_reason = FINAL_TIMEOUT;
@@ -206,17 +241,21 @@ static void call_timer_iterator(gpointer data, gpointer user_data) {
 
 	// other timeouts not applicable to foreign calls
 	if (IS_FOREIGN_CALL(c)) {
-		goto out;
+		goto schedule;
 	}
 
 	if (c->deleted && rtpe_now.tv_sec >= c->deleted
 			&& c->last_signal <= c->deleted)
 		goto delete;
+	if (c->deleted && c->last_signal <= c->deleted)
+		call_timer_next(&next, c->deleted);
 
 	if (c->ml_deleted && rtpe_now.tv_sec >= c->ml_deleted) {
 		if (call_timer_delete_monologues(c))
 			goto delete;
 	}
+	if (c->ml_deleted)
+		call_timer_next(&next, c->ml_deleted);
 
 	if (!c->streams.head)
 		goto drop;
@@ -239,14 +278,7 @@ static void call_timer_iterator(gpointer data, gpointer user_data) {
 		if (css == CSS_ICE)
 			timestamp = &ps->media->ice_agent->last_activity;
 
-		if (g_hash_table_contains(hlp->addr_sfd, &sfd->socket.local))
-			goto next;
-		g_hash_table_insert(hlp->addr_sfd, &sfd->socket.local, obj_get(sfd));
-
 no_sfd:
-		if (good)
-			goto next;
-
 		check = rtpe_config.timeout;
 		tmp_t_reason = TIMEOUT;
 		if (!MEDIA_ISSET(ps->media, RECV) || !sfd) {
@@ -258,19 +290,26 @@ no_sfd:
 			tmp_t_reason = OFFER_TIMEOUT;
 		}
 
-		if (rtpe_now.tv_sec - atomic64_get(timestamp) < check)
+		/* the call times out once the last of its streams does */
+		t = atomic64_get(timestamp) + check;
+		if (rtpe_now.tv_sec < t) {
 			good = 1;
+			if (t > stream_next)
+				stream_next = t;
+		}
 
 next:
 		;
 	}
 
 	if (good || IS_FOREIGN_CALL(c)) {
-		goto out;
+		if (good)
+			call_timer_next(&next, stream_next);
+		goto schedule;
 	}
 
 	if (c->ml_deleted)
-		goto out;
+		goto schedule;
 
 	for (it = c->monologues.head; it; it = it->next) {
 		ml = it->data;
@@ -288,8 +327,18 @@ delete:
 	hlp->del_scheduled = g_slist_prepend(hlp->del_scheduled, obj_get(c));
 	goto out;
 
+schedule:
+	/* state changes caused by media (e.g. ICE) aren't tracked, so don't wait
+	 * longer than the regular timeout before checking again */
+	if (rtpe_config.timeout && (!next || next > rtpe_now.tv_sec + rtpe_config.timeout))
+		next = rtpe_now.tv_sec + rtpe_config.timeout;
+	/* the lock may have been released by call_timer_delete_monologues() */
+	if (next && !c->destroyed)
+		poller_timer_arm_ms(rtpe_poller, &c->timeout_timer, next * 1000LL);
+
 out:
 	rwlock_unlock_r(&rtpe_config.config_lock);
+out_unlocked:
 	rwlock_unlock_r(&c->master_lock);
 	log_info_clear();
 }
@@ -467,6 +516,30 @@ destroy:
 }
 
 
+/* timer callback, run from the poller's timer thread */
+static void call_timeout(void *p) {
+	struct call *c = p;
+	struct iterator_helper hlp;
+
+	ZERO(hlp);
+
+	call_timer_iterator(c, &hlp);
+
+	kill_calls_timer(hlp.del_scheduled, NULL);
+
+	if (!rtpe_config.b2b_url) {
+		kill_calls_timer(hlp.del_timeout, NULL);
+		return;
+	}
+	if (!hlp.del_timeout)
+		return;
+
+	mutex_lock(&__timed_out_lock);
+	__timed_out = g_slist_concat(hlp.del_timeout, __timed_out);
+	mutex_unlock(&__timed_out_lock);
+}
+
+
 #define DS(x) do {							\
 		u_int64_t ks_val, d;					\
 		ks_val = atomic64_get(&ps->kernel_stats.x);	\
@@ -475,7 +548,7 @@ destroy:
 		else							\
 			d = ke->stats.x - ks_val;			\
 		atomic64_add(&ps->stats.x, d);			\
-		atomic64_add(&rtpe_statsps.x, d);			\
+		thread_stats_add(x, d);					\
 	} while (0)
 
 static void update_requests_per_second_stats(struct requests_ps *request, u_int64_t new_val) {
@@ -495,165 +568,163 @@ static void update_requests_per_second_stats(struct requests_ps *request, u_int6
 	mutex_unlock(&request->lock);
 }
 
-static void call_timer(void *ptr) {
-	struct iterator_helper hlp;
-	GList *i, *l, *calls = NULL;
-	struct rtpengine_list_entry *ke;
+/* called once a second for each kernel forwarding target */
+static void call_timer_kernel_stats(const struct rtpengine_stats_entry *ke, void *ptr) {
 	struct packet_stream *ps, *sink;
-	struct stats tmpstats;
 	int j, update;
 	struct stream_fd *sfd;
 	struct rtp_stats *rs;
 	unsigned int pt;
 	endpoint_t ep;
-	u_int64_t offers, answers, deletes;
 
-	ZERO(hlp);
-	hlp.addr_sfd = g_hash_table_new(g_endpoint_hash, g_endpoint_eq);
+	kernel2endpoint(&ep, &ke->local);
+	sfd = kernel_stream_fd_get(&ep);
+	if (!sfd)
+		return;
 
-	/* obtain the call list and make a copy from it so not to hold the lock */
-	rwlock_lock_r(&rtpe_callhash_lock);
-	l = g_hash_table_get_values(rtpe_callhash);
-	if (l) {
-		calls = g_list_copy(l);
-		g_list_free(l);
-		g_list_foreach(calls, call_obj_get, NULL);
-	}
-	rwlock_unlock_r(&rtpe_callhash_lock);
+	rwlock_lock_r(&sfd->call->master_lock);
 
-	if (calls) {
-		g_list_foreach(calls, call_timer_iterator, &hlp);
-		g_list_free_full(calls, call_obj_put);
+	ps = sfd->stream;
+	if (!ps || ps->selected_sfd != sfd) {
+		rwlock_unlock_r(&sfd->call->master_lock);
+		goto out;
 	}
-	atomic64_local_copy_zero_struct(&tmpstats, &rtpe_statsps, bytes);
-	atomic64_local_copy_zero_struct(&tmpstats, &rtpe_statsps, packets);
-	atomic64_local_copy_zero_struct(&tmpstats, &rtpe_statsps, errors);
 
-	atomic64_set(&rtpe_stats.bytes, atomic64_get_na(&tmpstats.bytes));
-	atomic64_set(&rtpe_stats.packets, atomic64_get_na(&tmpstats.packets));
-	atomic64_set(&rtpe_stats.errors, atomic64_get_na(&tmpstats.errors));
+	DS(packets);
+	DS(bytes);
+	DS(errors);
 
-	/* update statistics regarding requests per second */
-	offers = atomic64_get_set(&rtpe_statsps.offers, 0);
-	update_requests_per_second_stats(&rtpe_totalstats_interval.offers_ps, offers);
 
-	answers = atomic64_get_set(&rtpe_statsps.answers, 0);
-	update_requests_per_second_stats(&rtpe_totalstats_interval.answers_ps,	answers);
+	if (ke->stats.packets != atomic64_get(&ps->kernel_stats.packets))
+		atomic64_set(&ps->last_packet, rtpe_now.tv_sec);
 
-	deletes = atomic64_get_set(&rtpe_statsps.deletes, 0);
-	update_requests_per_second_stats(&rtpe_totalstats_interval.deletes_ps,	deletes);
+	/* consent checks answered by the kernel count as ICE activity */
+	if (ke->stats.stun != atomic64_get(&ps->kernel_stun)) {
+		atomic64_set(&ps->kernel_stun, ke->stats.stun);
+		if (ps->media->ice_agent)
+			atomic64_set(&ps->media->ice_agent->last_activity, rtpe_now.tv_sec);
+	}
 
-	i = kernel_list();
-	while (i) {
-		ke = i->data;
+	ps->stats.in_tos_tclass = ke->stats.in_tos;
 
-		kernel2endpoint(&ep, &ke->target.local);
-		sfd = g_hash_table_lookup(hlp.addr_sfd, &ep);
-		if (!sfd)
-			goto next;
+#if (RE_HAS_MEASUREDELAY)
+	/* XXX fix atomicity */
+	ps->stats.delay_min = ke->stats.delay_min;
+	ps->stats.delay_avg = ke->stats.delay_avg;
+	ps->stats.delay_max = ke->stats.delay_max;
+#endif
 
-		rwlock_lock_r(&sfd->call->master_lock);
+	atomic64_set(&ps->kernel_stats.bytes, ke->stats.bytes);
+	atomic64_set(&ps->kernel_stats.packets, ke->stats.packets);
+	atomic64_set(&ps->kernel_stats.errors, ke->stats.errors);
 
-		ps = sfd->stream;
-		if (!ps || ps->selected_sfd != sfd) {
-			rwlock_unlock_r(&sfd->call->master_lock);
-			goto next;
-		}
+	for (j = 0; j < ke->num_payload_types; j++) {
+		pt = ke->payload_types[j];
+		rs = g_hash_table_lookup(ps->rtp_stats, &pt);
+		if (!rs)
+			continue;
+		if (ke->rtp_stats[j].packets > atomic64_get(&rs->packets))
+			atomic64_add(&rs->packets,
+					ke->rtp_stats[j].packets - atomic64_get(&rs->packets));
+		if (ke->rtp_stats[j].bytes > atomic64_get(&rs->bytes))
+			atomic64_add(&rs->bytes,
+					ke->rtp_stats[j].bytes - atomic64_get(&rs->bytes));
+		atomic64_set(&rs->kernel_packets, ke->rtp_stats[j].packets);
+		atomic64_set(&rs->kernel_bytes, ke->rtp_stats[j].bytes);
+	}
 
-		DS(packets);
-		DS(bytes);
-		DS(errors);
+	update = 0;
 
+	sink = packet_stream_sink(ps);
 
-		if (ke->stats.packets != atomic64_get(&ps->kernel_stats.packets))
-			atomic64_set(&ps->last_packet, rtpe_now.tv_sec);
+	/* XXX this only works if the kernel module actually gets to see the packets. */
+	if (sink) {
+		mutex_lock(&sink->out_lock);
+		if (sink->crypto.params.crypto_suite && sink->ssrc_out
+				&& ntohl(ke->ssrc) == sink->ssrc_out->parent->h.ssrc
+				&& ke->encrypt_last_index - sink->ssrc_out->srtp_index > 0x4000)
+		{
+			sink->ssrc_out->srtp_index = ke->encrypt_last_index;
+			update = 1;
+		}
+		/* the kernel hands out SRTCP indexes too if it forwards RTCP */
+		if (ke->rtcp_fwd && sink->crypto.params.crypto_suite && sink->ssrc_out
+				&& ntohl(ke->ssrc) == sink->ssrc_out->parent->h.ssrc
+				&& ke->encrypt_rtcp_index > sink->ssrc_out->srtcp_index)
+		{
+			sink->ssrc_out->srtcp_index = ke->encrypt_rtcp_index;
+			update = 1;
+		}
+		mutex_unlock(&sink->out_lock);
+	}
 
-		ps->stats.in_tos_tclass = ke->stats.in_tos;
+	mutex_lock(&ps->in_lock);
+	if (sfd->crypto.params.crypto_suite && ps->ssrc_in
+			&& ntohl(ke->ssrc) == ps->ssrc_in->parent->h.ssrc
+			&& ke->decrypt_last_index - ps->ssrc_in->srtp_index > 0x4000)
+	{
+		ps->ssrc_in->srtp_index = ke->decrypt_last_index;
+		update = 1;
+	}
+	mutex_unlock(&ps->in_lock);
 
-#if (RE_HAS_MEASUREDELAY)
-		/* XXX fix atomicity */
-		ps->stats.delay_min = ke->stats.delay_min;
-		ps->stats.delay_avg = ke->stats.delay_avg;
-		ps->stats.delay_max = ke->stats.delay_max;
-#endif
+	rwlock_unlock_r(&sfd->call->master_lock);
 
-		atomic64_set(&ps->kernel_stats.bytes, ke->stats.bytes);
-		atomic64_set(&ps->kernel_stats.packets, ke->stats.packets);
-		atomic64_set(&ps->kernel_stats.errors, ke->stats.errors);
+	if (update) {
+		redis_update_onekey(ps->call, rtpe_redis_write);
+	}
 
-		for (j = 0; j < ke->target.num_payload_types; j++) {
-			pt = ke->target.payload_types[j];
-			rs = g_hash_table_lookup(ps->rtp_stats, &pt);
-			if (!rs)
-				continue;
-			if (ke->rtp_stats[j].packets > atomic64_get(&rs->packets))
-				atomic64_add(&rs->packets,
-						ke->rtp_stats[j].packets - atomic64_get(&rs->packets));
-			if (ke->rtp_stats[j].bytes > atomic64_get(&rs->bytes))
-				atomic64_add(&rs->bytes,
-						ke->rtp_stats[j].bytes - atomic64_get(&rs->bytes));
-			atomic64_set(&rs->kernel_packets, ke->rtp_stats[j].packets);
-			atomic64_set(&rs->kernel_bytes, ke->rtp_stats[j].bytes);
-		}
+out:
+	obj_put(sfd);
+}
 
-		update = 0;
+static void call_timer(void *ptr) {
+	static struct thread_stats last_stats;
+	struct thread_stats cur_stats;
+	u_int64_t offers, answers, deletes;
+	GSList *list;
 
-		sink = packet_stream_sink(ps);
+	thread_stats_sum(&cur_stats);
 
-		/* XXX this only works if the kernel module actually gets to see the packets. */
-		if (sink) {
-			mutex_lock(&sink->out_lock);
-			if (sink->crypto.params.crypto_suite && sink->ssrc_out
-					&& ntohl(ke->target.ssrc) == sink->ssrc_out->parent->h.ssrc
-					&& ke->target.encrypt.last_index - sink->ssrc_out->srtp_index > 0x4000)
-			{
-				sink->ssrc_out->srtp_index = ke->target.encrypt.last_index;
-				update = 1;
-			}
-			mutex_unlock(&sink->out_lock);
-		}
+	atomic64_set(&rtpe_stats.bytes,
+			atomic64_get_na(&cur_stats.bytes) - atomic64_get_na(&last_stats.bytes));
+	atomic64_set(&rtpe_stats.packets,
+			atomic64_get_na(&cur_stats.packets) - atomic64_get_na(&last_stats.packets));
+	atomic64_set(&rtpe_stats.errors,
+			atomic64_get_na(&cur_stats.errors) - atomic64_get_na(&last_stats.errors));
+	last_stats = cur_stats;
 
-		mutex_lock(&ps->in_lock);
-		if (sfd->crypto.params.crypto_suite && ps->ssrc_in
-				&& ntohl(ke->target.ssrc) == ps->ssrc_in->parent->h.ssrc
-				&& ke->target.decrypt.last_index - ps->ssrc_in->srtp_index > 0x4000)
-		{
-			ps->ssrc_in->srtp_index = ke->target.decrypt.last_index;
-			update = 1;
-		}
-		mutex_unlock(&ps->in_lock);
+	/* update statistics regarding requests per second */
+	offers = atomic64_get_set(&rtpe_statsps.offers, 0);
+	update_requests_per_second_stats(&rtpe_totalstats_interval.offers_ps, offers);
 
-		rwlock_unlock_r(&sfd->call->master_lock);
+	answers = atomic64_get_set(&rtpe_statsps.answers, 0);
+	update_requests_per_second_stats(&rtpe_totalstats_interval.answers_ps,	answers);
 
-		if (update) {
-				redis_update_onekey(ps->call, rtpe_redis_write);
-		}
+	deletes = atomic64_get_set(&rtpe_statsps.deletes, 0);
+	update_requests_per_second_stats(&rtpe_totalstats_interval.deletes_ps,	deletes);
 
-next:
-		g_hash_table_remove(hlp.addr_sfd, &ep);
-		g_slice_free1(sizeof(*ke), ke);
-		i = g_list_delete_link(i, i);
-		if (sfd)
-			obj_put(sfd);
-	}
+	kernel_stats_foreach(call_timer_kernel_stats, NULL);
 
-	l = g_hash_table_get_values(hlp.addr_sfd);
-	for (i = l; i; i = i->next)
-		obj_put((struct stream_fd *) i->data);
-	g_list_free(l);
-	g_hash_table_destroy(hlp.addr_sfd);
+	mutex_lock(&__timed_out_lock);
+	list = __timed_out;
+	__timed_out = NULL;
+	mutex_unlock(&__timed_out_lock);
 
-	kill_calls_timer(hlp.del_scheduled, NULL);
-	kill_calls_timer(hlp.del_timeout, rtpe_config.b2b_url);
+	kill_calls_timer(list, rtpe_config.b2b_url);
 }
 #undef DS
 
 
 int call_init() {
-	rtpe_callhash = g_hash_table_new(str_hash, str_equal);
-	if (!rtpe_callhash)
-		return -1;
-	rwlock_init(&rtpe_callhash_lock);
+	int i;
+
+	for (i = 0; i < CALL_HASH_SHARDS; i++) {
+		__call_hash[i].calls = g_hash_table_new(str_hash, str_equal);
+		if (!__call_hash[i].calls)
+			return -1;
+		rwlock_init(&__call_hash[i].lock);
+	}
 
 	poller_add_timer(rtpe_poller, call_timer, NULL);
 
@@ -1773,19 +1844,16 @@ void add_total_calls_duration_in_interval(struct timeval *interval_tv) {
 static struct timeval add_ongoing_calls_dur_in_interval(struct timeval *interval_start,
 		struct timeval *interval_duration)
 {
-	GHashTableIter iter;
-	gpointer key, value;
+	GQueue calls = G_QUEUE_INIT;
 	struct timeval call_duration, res = {0};
 	struct call *call;
 	struct call_monologue *ml;
 
-	rwlock_lock_r(&rtpe_callhash_lock);
-	g_hash_table_iter_init(&iter, rtpe_callhash);
+	call_get_all_calls(&calls);
 
-	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		call = (struct call*) value;
+	while ((call = g_queue_pop_head(&calls))) {
 		if (!call->monologues.head || IS_FOREIGN_CALL(call))
-			continue;
+			goto next;
 		ml = call->monologues.head->data;
 		if (timercmp(interval_start, &ml->started, >)) {
 			timeval_add(&res, &res, interval_duration);
@@ -1793,8 +1861,10 @@ static struct timeval add_ongoing_calls_dur_in_interval(struct timeval *interval
 			timeval_subtract(&call_duration, &rtpe_now, &ml->started);
 			timeval_add(&res, &res, &call_duration);
 		}
+next:
+		obj_put(call);
 	}
-	rwlock_unlock_r(&rtpe_callhash_lock);
+
 	return res;
 }
 
@@ -1808,16 +1878,20 @@ void call_destroy(struct call *c) {
 	struct call_media *md;
 	GList *k, *o;
 	const struct rtp_payload_type *rtp_pt;
+	struct call_hash_shard *sh;
 
 	if (!c) {
 		return;
 	}
 
-	rwlock_lock_w(&rtpe_callhash_lock);
-	ret = (g_hash_table_lookup(rtpe_callhash, &c->callid) == c);
-	if (ret)
-		g_hash_table_remove(rtpe_callhash, &c->callid);
-	rwlock_unlock_w(&rtpe_callhash_lock);
+	sh = call_hash_shard(&c->callid);
+	rwlock_lock_w(&sh->lock);
+	ret = (g_hash_table_lookup(sh->calls, &c->callid) == c);
+	if (ret) {
+		g_hash_table_remove(sh->calls, &c->callid);
+		atomic64_dec(&rtpe_callhash_size);
+	}
+	rwlock_unlock_w(&sh->lock);
 
 	// if call not found in callhash => previously deleted
 	if (!ret)
@@ -1835,6 +1909,9 @@ void call_destroy(struct call *c) {
 	rwlock_lock_w(&c->master_lock);
 	/* at this point, no more packet streams can be added */
 
+	c->destroyed = 1;
+	poller_timer_disarm(rtpe_poller, &c->timeout_timer);
+
 	if (!IS_OWN_CALL(c))
 		goto no_stats_output;
 
@@ -1943,7 +2020,7 @@ no_stats_output:
 
 	while (c->stream_fds.head) {
 		sfd = g_queue_pop_head(&c->stream_fds);
-		poller_del_item(rtpe_poller, sfd->socket.fd);
+		poller_del_item(sfd->poller, sfd->socket.fd);
 		obj_put(sfd);
 	}
 
@@ -2067,6 +2144,7 @@ static struct call *call_create(const str *callid) {
 	c->dtls_cert = dtls_cert();
 	c->tos = rtpe_config.default_tos;
 	c->ssrc_hash = create_ssrc_hash_call();
+	poller_timer_init(&c->timeout_timer, call_timeout, &c->obj);
 
 	return c;
 }
@@ -2074,22 +2152,24 @@ static struct call *call_create(const str *callid) {
 /* returns call with master_lock held in W */
 struct call *call_get_or_create(const str *callid, enum call_type type) {
 	struct call *c;
+	struct call_hash_shard *sh = call_hash_shard(callid);
 
 restart:
-	rwlock_lock_r(&rtpe_callhash_lock);
-	c = g_hash_table_lookup(rtpe_callhash, callid);
+	rwlock_lock_r(&sh->lock);
+	c = g_hash_table_lookup(sh->calls, callid);
 	if (!c) {
-		rwlock_unlock_r(&rtpe_callhash_lock);
+		rwlock_unlock_r(&sh->lock);
 		/* completely new call-id, create call */
 		c = call_create(callid);
-		rwlock_lock_w(&rtpe_callhash_lock);
-		if (g_hash_table_lookup(rtpe_callhash, callid)) {
+		rwlock_lock_w(&sh->lock);
+		if (g_hash_table_lookup(sh->calls, callid)) {
 			/* preempted */
-			rwlock_unlock_w(&rtpe_callhash_lock);
+			rwlock_unlock_w(&sh->lock);
 			obj_put(c);
 			goto restart;
 		}
-		g_hash_table_insert(rtpe_callhash, &c->callid, obj_get(c));
+		g_hash_table_insert(sh->calls, &c->callid, obj_get(c));
+		atomic64_inc(&rtpe_callhash_size);
 
 		if (type == CT_FOREIGN_CALL)  /* foreign call*/
 					c->foreign_call = 1;
@@ -2097,12 +2177,14 @@ restart:
 		statistics_update_foreignown_inc(c);
 
 		rwlock_lock_w(&c->master_lock);
-		rwlock_unlock_w(&rtpe_callhash_lock);
+		rwlock_unlock_w(&sh->lock);
+
+		call_timer_schedule(c, rtpe_now.tv_sec + 1);
 	}
 	else {
 		obj_hold(c);
 		rwlock_lock_w(&c->master_lock);
-		rwlock_unlock_r(&rtpe_callhash_lock);
+		rwlock_unlock_r(&sh->lock);
 	}
 
 	log_info_call(c);
@@ -2112,17 +2194,18 @@ restart:
 /* returns call with master_lock held in W, or NULL if not found */
 struct call *call_get(const str *callid) {
 	struct call *ret;
+	struct call_hash_shard *sh = call_hash_shard(callid);
 
-	rwlock_lock_r(&rtpe_callhash_lock);
-	ret = g_hash_table_lookup(rtpe_callhash, callid);
+	rwlock_lock_r(&sh->lock);
+	ret = g_hash_table_lookup(sh->calls, callid);
 	if (!ret) {
-		rwlock_unlock_r(&rtpe_callhash_lock);
+		rwlock_unlock_r(&sh->lock);
 		return NULL;
 	}
 
 	rwlock_lock_w(&ret->master_lock);
 	obj_hold(ret);
-	rwlock_unlock_r(&rtpe_callhash_lock);
+	rwlock_unlock_r(&sh->lock);
 
 	log_info_call(ret);
 	return ret;
@@ -2470,6 +2553,7 @@ do_delete:
 		ml->deleted = rtpe_now.tv_sec + delete_delay;
 		if (!c->ml_deleted || c->ml_deleted > ml->deleted)
 			c->ml_deleted = ml->deleted;
+		call_timer_schedule(c, ml->deleted);
 	}
 	else {
 		ilog(LOG_INFO, "Deleting call branch '"STR_FORMAT"' (via-branch '"STR_FORMAT"')",
@@ -2483,6 +2567,7 @@ del_all:
 	if (delete_delay > 0) {
 		ilog(LOG_INFO, "Scheduling deletion of entire call in %d seconds", delete_delay);
 		c->deleted = rtpe_now.tv_sec + delete_delay;
+		call_timer_schedule(c, c->deleted);
 		rwlock_unlock_w(&c->master_lock);
 	}
 	else {
@@ -2516,11 +2601,32 @@ static void call_get_all_calls_interator(void *key, void *val, void *ptr) {
 	g_queue_push_tail(q, obj_get_o(val));
 }
 
+/* returns a snapshot of all calls, each with a reference held. only one shard of the
+ * call hash is locked at a time, and only while the references are taken */
 void call_get_all_calls(GQueue *q) {
-	rwlock_lock_r(&rtpe_callhash_lock);
-	g_hash_table_foreach(rtpe_callhash, call_get_all_calls_interator, q);
-	rwlock_unlock_r(&rtpe_callhash_lock);
+	int i;
 
+	for (i = 0; i < CALL_HASH_SHARDS; i++) {
+		rwlock_lock_r(&__call_hash[i].lock);
+		g_hash_table_foreach(__call_hash[i].calls, call_get_all_calls_interator, q);
+		rwlock_unlock_r(&__call_hash[i].lock);
+	}
+}
+
+/* same as above, but stops once `limit` calls have been collected, without touching
+ * the remaining shards */
+void call_get_some_calls(GQueue *q, unsigned int limit) {
+	GHashTableIter iter;
+	gpointer val;
+	int i;
+
+	for (i = 0; i < CALL_HASH_SHARDS && q->length < limit; i++) {
+		rwlock_lock_r(&__call_hash[i].lock);
+		g_hash_table_iter_init(&iter, __call_hash[i].calls);
+		while (q->length < limit && g_hash_table_iter_next(&iter, NULL, &val))
+			g_queue_push_tail(q, obj_get_o(val));
+		rwlock_unlock_r(&__call_hash[i].lock);
+	}
 }
 
 
@@ -732,8 +732,7 @@ static enum load_limit_reasons call_offer_session_limit(void) {
 
 	rwlock_lock_r(&rtpe_config.config_lock);
 	if (rtpe_config.max_sessions>=0) {
-		rwlock_lock_r(&rtpe_callhash_lock);
-		if (g_hash_table_size(rtpe_callhash) -
+		if (atomic64_get(&rtpe_callhash_size) -
 				atomic64_get(&rtpe_stats.foreign_sessions) >= rtpe_config.max_sessions)
 		{
 			/* foreign calls can't get rejected
@@ -744,7 +743,6 @@ static enum load_limit_reasons call_offer_session_limit(void) {
 
 			ret = LOAD_LIMIT_MAX_SESSIONS;
 		}
-		rwlock_unlock_r(&rtpe_callhash_lock);
 	}
 
 	if (!ret && rtpe_config.load_limit) {
@@ -1259,17 +1257,15 @@ stats:
 }
 
 static void ng_list_calls(bencode_item_t *output, long long int limit) {
-	GHashTableIter iter;
-	gpointer key, value;
+	GQueue calls = G_QUEUE_INIT;
+	struct call *call;
 
-	rwlock_lock_r(&rtpe_callhash_lock);
+	call_get_some_calls(&calls, MIN(limit, G_MAXUINT));
 
-	g_hash_table_iter_init (&iter, rtpe_callhash);
-	while (limit-- && g_hash_table_iter_next (&iter, &key, &value)) {
-		bencode_list_add_str_dup(output, key);
+	while ((call = g_queue_pop_head(&calls))) {
+		bencode_list_add_str_dup(output, &call->callid);
+		obj_put(call);
 	}
-
-	rwlock_unlock_r(&rtpe_callhash_lock);
 }
 
 
@@ -24,6 +24,8 @@
 #include "str.h"
 #include "statistics.h"
 #include "main.h"
+#include "codec.h"
+#include "thread_stats.h"
 
 #include "rtpengine_config.h"
 
@@ -155,42 +157,25 @@ static void destroy_own_foreign_calls(unsigned int foreign_call, unsigned int ui
 	struct call *c = NULL;
 	struct call_monologue *ml = NULL;
 	GQueue call_list = G_QUEUE_INIT;
-	GHashTableIter iter;
-	gpointer key, value;
 	GList *i;
 
-	// lock read
-	rwlock_lock_r(&rtpe_callhash_lock);
-
-	g_hash_table_iter_init(&iter, rtpe_callhash);
-	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		c = (struct call*)value;
-		if (!c) {
-			continue;
-		}
+	// get references to all calls
+	call_get_all_calls(&call_list);
 
+	// destroy calls
+	while ((c = g_queue_pop_head(&call_list))) {
 		// match foreign_call flag
 		if ((foreign_call != UNDEFINED) && !(foreign_call == IS_FOREIGN_CALL(c))) {
+			obj_put(c);
 			continue;
 		}
 
 		// match uint_keyspace_db, if some given
 		if ((uint_keyspace_db != UNDEFINED) && !(uint_keyspace_db == c->redis_hosted_db)) {
+			obj_put(c);
 			continue;
 		}
-		
-		// increase ref counter
-		obj_get(c);
-
-		// save call reference
-		g_queue_push_tail(&call_list, c);
-	}
-
-	// unlock read
-	rwlock_unlock_r(&rtpe_callhash_lock);
 
-	// destroy calls
-	while ((c = g_queue_pop_head(&call_list))) {
 		if (!c->ml_deleted) {
 			for (i = c->monologues.head; i; i = i->next) {
 				ml = i->data;
@@ -435,6 +420,7 @@ static void cli_incoming_list_totals(str *instr, struct streambuf *replybuffer)
 	streambuf_printf(replybuffer, " Total relayed packet errors                     :"UINT64F"\n",atomic64_get(&rtpe_totalstats.total_relayed_errors));
 	streambuf_printf(replybuffer, " Total number of streams with no relayed packets :"UINT64F"\n", atomic64_get(&rtpe_totalstats.total_nopacket_relayed_sess));
 	streambuf_printf(replybuffer, " Total number of 1-way streams                   :"UINT64F"\n",atomic64_get(&rtpe_totalstats.total_oneway_stream_sess));
+	streambuf_printf(replybuffer, " Total recorded packets dropped                  :"UINT64F"\n",atomic64_get(&rtpe_totalstats.total_recording_dropped_packets));
 	streambuf_printf(replybuffer, " Average call duration                           :%ld.%06ld\n\n",avg.tv_sec,avg.tv_usec);
 
 	mutex_lock(&rtpe_totalstats_lastinterval_lock);
@@ -478,6 +464,31 @@ static void cli_incoming_list_totals(str *instr, struct streambuf *replybuffer)
 			(unsigned long long)deletes_ps.ps_max,
 			(unsigned long long)deletes_ps.ps_avg);
 
+	if (rtpe_redis_write) {
+		struct redis_write_stats ws;
+		redis_get_write_stats(&ws, rtpe_redis_write, 0);
+		streambuf_printf(replybuffer, "\nRedis write statistics:\n");
+		streambuf_printf(replybuffer, " Calls waiting to be written                     :%u\n", ws.queue_len);
+		streambuf_printf(replybuffer, " Total update requests                           :"UINT64F"\n", ws.updates);
+		streambuf_printf(replybuffer, " Total coalesced update requests                 :"UINT64F"\n", ws.coalesced);
+		streambuf_printf(replybuffer, " Total calls written                             :"UINT64F"\n", ws.writes);
+		streambuf_printf(replybuffer, " Max/Avg write latency                           :"UINT64F"/"UINT64F" us\n",
+				ws.latency_max_us, ws.latency_avg_us);
+	}
+
+#ifdef WITH_TRANSCODING
+	struct thread_stats ts;
+	thread_stats_sum(&ts);
+	streambuf_printf(replybuffer, "\nTranscoder statistics:\n");
+	streambuf_printf(replybuffer, " Buffers reused from pool                        :"UINT64F"\n",
+			atomic64_get_na(&ts.codec_buffer_hits));
+	streambuf_printf(replybuffer, " Buffers newly allocated                         :"UINT64F"\n",
+			atomic64_get_na(&ts.codec_buffer_misses));
+	if (rtpe_config.transcode_threads > 0)
+		streambuf_printf(replybuffer, " Packets dropped by full transcoding queues      :"UINT64F"\n",
+				atomic64_get_na(&ts.transcode_drops));
+#endif
+
 	streambuf_printf(replybuffer, "\n\n");
 
 	streambuf_printf(replybuffer, "Control statistics:\n\n");
@@ -510,11 +521,10 @@ static void cli_incoming_list_totals(str *instr, struct streambuf *replybuffer)
 }
 
 static void cli_incoming_list_numsessions(str *instr, struct streambuf *replybuffer) {
-       rwlock_lock_r(&rtpe_callhash_lock);
-       streambuf_printf(replybuffer, "Current sessions own: "UINT64F"\n", g_hash_table_size(rtpe_callhash) - atomic64_get(&rtpe_stats.foreign_sessions));
+       u_int64_t total = atomic64_get(&rtpe_callhash_size);
+       streambuf_printf(replybuffer, "Current sessions own: "UINT64F"\n", total - atomic64_get(&rtpe_stats.foreign_sessions));
        streambuf_printf(replybuffer, "Current sessions foreign: "UINT64F"\n", atomic64_get(&rtpe_stats.foreign_sessions));
-       streambuf_printf(replybuffer, "Current sessions total: %i\n", g_hash_table_size(rtpe_callhash));
-       rwlock_unlock_r(&rtpe_callhash_lock);
+       streambuf_printf(replybuffer, "Current sessions total: "UINT64F"\n", total);
 }
 
 static void cli_incoming_list_maxsessions(str *instr, struct streambuf *replybuffer) {
@@ -696,8 +706,7 @@ static void cli_incoming_list_callid(str *instr, struct streambuf *replybuffer)
 }
 
 static void cli_incoming_list_sessions(str *instr, struct streambuf *replybuffer) {
-	GHashTableIter iter;
-	gpointer key, value;
+	GQueue calls = G_QUEUE_INIT;
 	str *ptrkey;
 	struct call *call;
 	int found_own = 0, found_foreign = 0;
@@ -711,43 +720,39 @@ static void cli_incoming_list_sessions(str *instr, struct streambuf *replybuffer
 		return;
 	}
 
-	rwlock_lock_r(&rtpe_callhash_lock);
+	call_get_all_calls(&calls);
 
-	if (g_hash_table_size(rtpe_callhash)==0) {
+	if (!calls.length) {
 		streambuf_printf(replybuffer, "No sessions on this media relay.\n");
-		rwlock_unlock_r(&rtpe_callhash_lock);
 		return;
 	}
 
-	g_hash_table_iter_init (&iter, rtpe_callhash);
-	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		ptrkey = (str*)key;
-		call = (struct call*)value;
+	while ((call = g_queue_pop_head(&calls))) {
+		ptrkey = &call->callid;
 
 		if (str_cmp(instr, LIST_ALL) == 0) {
-			if (!call) {
-				continue;
-			}
+			;
 		} else if (str_cmp(instr, LIST_OWN) == 0) {
-			if (!call || IS_FOREIGN_CALL(call)) {
-				continue;
+			if (IS_FOREIGN_CALL(call)) {
+				goto next;
 			} else {
 				found_own = 1;
 			}
 		} else if (str_cmp(instr, LIST_FOREIGN) == 0) {
-			if (!call || !IS_FOREIGN_CALL(call)) {
-				continue;
+			if (!IS_FOREIGN_CALL(call)) {
+				goto next;
 			} else {
 				found_foreign = 1;
 			}
 		} else {
 			// expect callid parameter
-			break;
+			goto next;
 		}
 
 		streambuf_printf(replybuffer, "callid: %60s | deletionmark:%4s | created:%12i | proxy:%s | redis_keyspace:%i | foreign:%s\n", ptrkey->s, call->ml_deleted?"yes":"no", (int)call->created.tv_sec, call->created_from, call->redis_hosted_db, IS_FOREIGN_CALL(call)?"yes":"no");
+next:
+		obj_put(call);
 	}
-	rwlock_unlock_r(&rtpe_callhash_lock);
 
 	if (str_cmp(instr, LIST_ALL) == 0) {
 		;
@@ -9,10 +9,22 @@
 #include "codeclib.h"
 #include "ssrc.h"
 #include "rtcp.h"
+#include "thread_stats.h"
 
 
 
 
+#define CODEC_BUFFER_POOL_SIZE 64 // per thread
+
+
+/* output packet together with its buffer, recycled through a per-thread free list */
+struct codec_buffer {
+	struct codec_packet packet; // must be first
+	struct codec_buffer *next;
+	char buf[RTP_BUFFER_SIZE];
+};
+
+
 static codec_handler_func handler_func_passthrough;
 
 static struct rtp_payload_type *__rtp_payload_type_copy(const struct rtp_payload_type *pt);
@@ -26,6 +38,9 @@ static struct codec_handler codec_handler_stub = {
 	.passthrough = 1,
 };
 
+static __thread struct codec_buffer *codec_buffer_pool;
+static __thread unsigned int codec_buffer_pool_len;
+
 
 
 #ifdef WITH_TRANSCODING
@@ -49,7 +64,8 @@ struct codec_ssrc_handler {
 struct transcode_packet {
 	seq_packet_t p; // must be first
 	unsigned long ts;
-	str *payload;
+	str payload;
+	char buf[0]; // payload data follows
 };
 
 
@@ -431,6 +447,7 @@ void codec_add_raw_packet(struct media_packet *mp) {
 	struct codec_packet *p = g_slice_alloc(sizeof(*p));
 	p->s = mp->raw;
 	p->free_func = NULL;
+	p->pooled = 0;
 	if (mp->rtp)
 		mp->ssrc_out->payload_type = mp->rtp->m_pt & 0x7f;
 	g_queue_push_tail(&mp->packets_out, p);
@@ -444,8 +461,58 @@ static int handler_func_passthrough(struct codec_handler *h, struct call_media *
 
 
 
+/* returns a packet with a buffer of at least `len` bytes, preceded by RTP_BUFFER_HEAD_ROOM.
+ * buffers are taken from the current thread's pool and returned to the pool of whichever
+ * thread frees them. */
+struct codec_packet *codec_packet_new(unsigned int len) {
+	struct codec_buffer *b;
+	struct codec_packet *p;
+
+	if (G_UNLIKELY(len > RTP_BUFFER_SIZE - RTP_BUFFER_HEAD_ROOM)) {
+		thread_stats_inc(codec_buffer_misses);
+		p = g_slice_alloc(sizeof(*p));
+		p->s.s = malloc(len);
+		p->s.len = len;
+		p->free_func = free;
+		p->pooled = 0;
+		return p;
+	}
+
+	b = codec_buffer_pool;
+	if (G_LIKELY(b)) {
+		codec_buffer_pool = b->next;
+		codec_buffer_pool_len--;
+		thread_stats_inc(codec_buffer_hits);
+	}
+	else {
+		b = malloc(sizeof(*b));
+		thread_stats_inc(codec_buffer_misses);
+	}
+
+	p = &b->packet;
+	p->s.s = b->buf + RTP_BUFFER_HEAD_ROOM;
+	p->s.len = len;
+	p->free_func = NULL;
+	p->pooled = 1;
+	return p;
+}
+
+static void codec_buffer_put(struct codec_buffer *b) {
+	if (codec_buffer_pool_len >= CODEC_BUFFER_POOL_SIZE) {
+		free(b);
+		return;
+	}
+	b->next = codec_buffer_pool;
+	codec_buffer_pool = b;
+	codec_buffer_pool_len++;
+}
+
 void codec_packet_free(void *pp) {
 	struct codec_packet *p = pp;
+	if (p->pooled) {
+		codec_buffer_put((struct codec_buffer *) p);
+		return;
+	}
 	if (p->free_func)
 		p->free_func(p->s.s);
 	g_slice_free1(sizeof(*p), p);
@@ -558,8 +625,7 @@ static int handler_func_passthrough_ssrc(struct codec_handler *h, struct call_me
 
 
 static void __transcode_packet_free(struct transcode_packet *p) {
-	free(p->payload);
-	g_slice_free1(sizeof(*p), p);
+	g_slice_free1(sizeof(*p) + p->payload.len + 1, p);
 }
 
 static struct ssrc_entry *__ssrc_handler_new(void *p) {
@@ -654,7 +720,8 @@ static int __packet_encoded(encoder_t *enc, void *u1, void *u2) {
 		payload_len += 16; // extra room for certain protocols, e.g. AMR framing
 		unsigned int pkt_len = sizeof(struct rtp_header) + payload_len + RTP_BUFFER_TAIL_ROOM;
 		// prepare our buffers
-		char *buf = malloc(pkt_len);
+		struct codec_packet *p = codec_packet_new(pkt_len);
+		char *buf = p->s.s;
 		struct rtp_header *rh = (void *) buf;
 		char *payload = buf + sizeof(struct rtp_header);
 		// tell our packetizer how much we want
@@ -668,7 +735,7 @@ static int __packet_encoded(encoder_t *enc, void *u1, void *u2) {
 
 		if (G_UNLIKELY(ret == -1)) {
 			// nothing
-			free(buf);
+			codec_packet_free(p);
 			break;
 		}
 
@@ -683,11 +750,8 @@ static int __packet_encoded(encoder_t *enc, void *u1, void *u2) {
 		rh->ssrc = htonl(mp->ssrc_in->ssrc_map_out);
 
 		// add to output queue
-		struct codec_packet *p = g_slice_alloc(sizeof(*p));
-		p->s.s = buf;
 		p->s.len = inout.len + sizeof(struct rtp_header);
 		mp->ssrc_out->payload_type = ch->handler->dest_pt.payload_type;
-		p->free_func = free;
 		g_queue_push_tail(&mp->packets_out, p);
 
 		atomic64_inc(&mp->ssrc_out->packets);
@@ -739,10 +803,12 @@ static int handler_func_transcode(struct codec_handler *h, struct call_media *me
 	atomic64_inc(&mp->ssrc_in->packets);
 	atomic64_add(&mp->ssrc_in->octets, mp->payload.len);
 
-	struct transcode_packet *packet = g_slice_alloc0(sizeof(*packet));
+	struct transcode_packet *packet = g_slice_alloc(sizeof(*packet) + mp->payload.len + 1);
 	packet->p.seq = ntohs(mp->rtp->seq_num);
-	packet->payload = str_dup(&mp->payload);
 	packet->ts = ntohl(mp->rtp->timestamp);
+	memcpy(packet->buf, mp->payload.s, mp->payload.len);
+	packet->buf[mp->payload.len] = '\0';
+	str_init_len(&packet->payload, packet->buf, mp->payload.len);
 
 	mutex_lock(&ch->lock);
 
@@ -769,7 +835,7 @@ static int handler_func_transcode(struct codec_handler *h, struct call_media *me
 		ilog(LOG_DEBUG, "Decoding RTP packet: seq %u, TS %lu",
 				packet->p.seq, packet->ts);
 
-		if (decoder_input_data(ch->decoder, packet->payload, packet->ts, __packet_decoded, ch, mp))
+		if (decoder_input_data(ch->decoder, &packet->payload, packet->ts, __packet_decoded, ch, mp))
 			ilog(LOG_WARN, "Decoder error while processing RTP packet");
 		__transcode_packet_free(packet);
 	}
@@ -30,6 +30,7 @@ struct codec_handler {
 struct codec_packet {
 	str s;
 	void (*free_func)(void *);
+	int pooled; // buffer and packet were taken from the packet buffer pool
 };
 
 
@@ -37,6 +38,7 @@ struct codec_handler *codec_handler_get(struct call_media *, int payload_type);
 void codec_handlers_free(struct call_media *);
 
 void codec_add_raw_packet(struct media_packet *mp);
+struct codec_packet *codec_packet_new(unsigned int len);
 void codec_packet_free(void *);
 
 void codec_rtp_payload_types(struct call_media *media, struct call_media *other_media,
@@ -306,54 +306,69 @@ const struct crypto_suite *crypto_find_suite(const str *s) {
 
 
 
+/* number of key stream blocks generated per EVP call */
+#define AES_CTR_BATCH 32
+
+/* out := in XOR key stream. "in" and "out" MAY point to the same buffer */
+INLINE void xor_key_stream(unsigned char *out, const unsigned char *in, const unsigned char *ks,
+		unsigned int len)
+{
+	unsigned int i;
+	u_int64_t a, b;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&a, in + i, 8);
+		memcpy(&b, ks + i, 8);
+		a ^= b;
+		memcpy(out + i, &a, 8);
+	}
+	for (; i < len; i++)
+		out[i] = in[i] ^ ks[i];
+}
+
 /* rfc 3711 section 4.1 and 4.1.1
- * "in" and "out" MAY point to the same buffer */
+ * "in" and "out" MAY point to the same buffer.
+ * the counter blocks for up to AES_CTR_BATCH blocks are laid out first and then encrypted
+ * in ECB mode with a single EVP call, which lets the cipher implementation process
+ * several blocks in parallel */
 static void aes_ctr(unsigned char *out, str *in, EVP_CIPHER_CTX *ecc, const unsigned char *iv) {
 	unsigned char ivx[16];
-	unsigned char key_block[16];
-	unsigned char *p, *q;
-	unsigned int left;
+	unsigned char ctr_blocks[AES_CTR_BATCH * 16];
+	unsigned char key_stream[AES_CTR_BATCH * 16];
+	const unsigned char *p;
+	unsigned int left, blocks, len, k;
 	int outlen, i;
-	u_int64_t *pi, *qi, *ki;
 
 	if (!ecc)
 		return;
 
 	memcpy(ivx, iv, 16);
-	pi = (void *) in->s;
-	qi = (void *) out;
-	ki = (void *) key_block;
+	p = (void *) in->s;
 	left = in->len;
 
 	while (left) {
-		EVP_EncryptUpdate(ecc, key_block, &outlen, ivx, 16);
-		assert(outlen == 16);
-
-		if (G_UNLIKELY(left < 16)) {
-			p = (void *) pi;
-			q = (void *) qi;
-			for (i = 0; i < 16; i++) {
-				*q++ = *p++ ^ key_block[i];
-				left--;
-				if (!left)
-					goto done;
+		blocks = (left + 15) / 16;
+		if (blocks > AES_CTR_BATCH)
+			blocks = AES_CTR_BATCH;
+
+		for (k = 0; k < blocks; k++) {
+			memcpy(&ctr_blocks[k * 16], ivx, 16);
+			for (i = 15; i >= 0; i--) {
+				ivx[i]++;
+				if (G_LIKELY(ivx[i]))
+					break;
 			}
-			abort();
 		}
 
-		*qi++ = *pi++ ^ ki[0];
-		*qi++ = *pi++ ^ ki[1];
-		left -= 16;
+		EVP_EncryptUpdate(ecc, key_stream, &outlen, ctr_blocks, blocks * 16);
+		assert(outlen == blocks * 16);
 
-		for (i = 15; i >= 0; i--) {
-			ivx[i]++;
-			if (G_LIKELY(ivx[i]))
-				break;
-		}
+		len = MIN(left, blocks * 16);
+		xor_key_stream(out, p, key_stream, len);
+		out += len;
+		p += len;
+		left -= len;
 	}
-
-done:
-	;
 }
 
 static void aes_ctr_no_ctx(unsigned char *out, str *in, const unsigned char *key, const EVP_CIPHER *ciph,
@@ -582,30 +597,55 @@ static int aes_f8_encrypt_rtcp(struct crypto_context *c, struct rtcp_packet *r,
 
 	return 0;
 }
-/* rfc 3711, sections 4.2 and 4.2.1 */
-static int hmac_sha1_rtp(struct crypto_context *c, char *out, str *in, u_int64_t index) {
-	unsigned char hmac[20];
-	u_int32_t roc;
-	HMAC_CTX *hc;
+/* the HMAC context is keyed once on first use after the session keys were derived.
+ * re-initialising it without a key restores the precomputed inner and outer hash
+ * states, which saves the key schedule for every packet */
+static HMAC_CTX *hmac_sha1_ctx(struct crypto_context *c, unsigned int key_len) {
+	HMAC_CTX *hc = c->session_hmac_ctx;
+
+	if (G_LIKELY(hc)) {
+		HMAC_Init_ex(hc, NULL, 0, NULL, NULL);
+		return hc;
+	}
 
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L
 	hc = HMAC_CTX_new();
 #else
-	HMAC_CTX hc_s;
-	HMAC_CTX_init(&hc_s);
-	hc = &hc_s;
+	hc = g_slice_alloc(sizeof(HMAC_CTX));
+	HMAC_CTX_init(hc);
 #endif
+	HMAC_Init_ex(hc, c->session_auth_key, key_len, EVP_sha1(), NULL);
+	c->session_hmac_ctx = hc;
+
+	return hc;
+}
+
+static void hmac_sha1_cleanup(struct crypto_context *c) {
+	HMAC_CTX *hc = c->session_hmac_ctx;
+
+	if (!hc)
+		return;
 
-	HMAC_Init_ex(hc, c->session_auth_key, c->params.crypto_suite->srtp_auth_key_len, EVP_sha1(), NULL);
-	HMAC_Update(hc, (unsigned char *) in->s, in->len);
-	roc = htonl((index & 0xffffffff0000ULL) >> 16);
-	HMAC_Update(hc, (unsigned char *) &roc, sizeof(roc));
-	HMAC_Final(hc, hmac, NULL);
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L
 	HMAC_CTX_free(hc);
 #else
 	HMAC_CTX_cleanup(hc);
+	g_slice_free1(sizeof(HMAC_CTX), hc);
 #endif
+	c->session_hmac_ctx = NULL;
+}
+
+/* rfc 3711, sections 4.2 and 4.2.1 */
+static int hmac_sha1_rtp(struct crypto_context *c, char *out, str *in, u_int64_t index) {
+	unsigned char hmac[20];
+	u_int32_t roc;
+	HMAC_CTX *hc;
+
+	hc = hmac_sha1_ctx(c, c->params.crypto_suite->srtp_auth_key_len);
+	HMAC_Update(hc, (unsigned char *) in->s, in->len);
+	roc = htonl((index & 0xffffffff0000ULL) >> 16);
+	HMAC_Update(hc, (unsigned char *) &roc, sizeof(roc));
+	HMAC_Final(hc, hmac, NULL);
 
 	assert(sizeof(hmac) >= c->params.crypto_suite->srtp_auth_tag);
 	memcpy(out, hmac, c->params.crypto_suite->srtp_auth_tag);
@@ -616,9 +656,11 @@ static int hmac_sha1_rtp(struct crypto_context *c, char *out, str *in, u_int64_t
 /* rfc 3711, sections 4.2 and 4.2.1 */
 static int hmac_sha1_rtcp(struct crypto_context *c, char *out, str *in) {
 	unsigned char hmac[20];
+	HMAC_CTX *hc;
 
-	HMAC(EVP_sha1(), c->session_auth_key, c->params.crypto_suite->srtcp_auth_key_len,
-			(unsigned char *) in->s, in->len, hmac, NULL);
+	hc = hmac_sha1_ctx(c, c->params.crypto_suite->srtcp_auth_key_len);
+	HMAC_Update(hc, (unsigned char *) in->s, in->len);
+	HMAC_Final(hc, hmac, NULL);
 
 	assert(sizeof(hmac) >= c->params.crypto_suite->srtcp_auth_tag);
 	memcpy(out, hmac, c->params.crypto_suite->srtcp_auth_tag);
@@ -689,6 +731,8 @@ static int evp_session_key_cleanup(struct crypto_context *c) {
 		c->session_key_ctx[i] = NULL;
 	}
 
+	hmac_sha1_cleanup(c);
+
 	return 0;
 }
 
@@ -22,6 +22,7 @@
 #include "socket.h"
 #include "statistics.h"
 #include "main.h"
+#include "redis.h"
 
 struct timeval rtpe_latest_graphite_interval_start;
 
@@ -146,17 +147,15 @@ int send_graphite_data(struct totalstats *sent_data) {
 	ts->answers_ps = clear_requests_per_second(&rtpe_totalstats_interval.answers_ps);
 	ts->deletes_ps = clear_requests_per_second(&rtpe_totalstats_interval.deletes_ps);
 
-	rwlock_lock_r(&rtpe_callhash_lock);
 	mutex_lock(&rtpe_totalstats_interval.managed_sess_lock);
 	ts->managed_sess_max = rtpe_totalstats_interval.managed_sess_max;
 	ts->managed_sess_min = rtpe_totalstats_interval.managed_sess_min;
-        ts->total_sessions = g_hash_table_size(rtpe_callhash);
+        ts->total_sessions = atomic64_get(&rtpe_callhash_size);
         ts->foreign_sessions = atomic64_get(&rtpe_stats.foreign_sessions);
 	ts->own_sessions = ts->total_sessions - ts->foreign_sessions;
 	rtpe_totalstats_interval.managed_sess_max = ts->own_sessions;;
 	rtpe_totalstats_interval.managed_sess_min = ts->own_sessions;
 	mutex_unlock(&rtpe_totalstats_interval.managed_sess_lock);
-	rwlock_unlock_r(&rtpe_callhash_lock);
 
 	// compute average offer/answer/delete time
 	timeval_divide(&ts->offer.time_avg, &ts->offer.time_avg, ts->offer.count);
@@ -248,6 +247,17 @@ int send_graphite_data(struct totalstats *sent_data) {
 	if (graphite_prefix!=NULL) { rc = sprintf(ptr,"%s",graphite_prefix); ptr += rc; }
 	rc = sprintf(ptr,"deletes_ps_avg %llu %llu\n",(unsigned long long)ts->deletes_ps.ps_avg,(unsigned long long)rtpe_now.tv_sec); ptr += rc;
 
+	if (rtpe_redis_write) {
+		struct redis_write_stats ws;
+		redis_get_write_stats(&ws, rtpe_redis_write, 1);
+		if (graphite_prefix!=NULL) { rc = sprintf(ptr,"%s",graphite_prefix); ptr += rc; }
+		rc = sprintf(ptr,"redis_write_queue %u %llu\n",ws.queue_len,(unsigned long long)rtpe_now.tv_sec); ptr += rc;
+		if (graphite_prefix!=NULL) { rc = sprintf(ptr,"%s",graphite_prefix); ptr += rc; }
+		rc = sprintf(ptr,"redis_write_latency_max "UINT64F" %llu\n",ws.latency_max_us,(unsigned long long)rtpe_now.tv_sec); ptr += rc;
+		if (graphite_prefix!=NULL) { rc = sprintf(ptr,"%s",graphite_prefix); ptr += rc; }
+		rc = sprintf(ptr,"redis_write_latency_avg "UINT64F" %llu\n",ws.latency_avg_us,(unsigned long long)rtpe_now.tv_sec); ptr += rc;
+	}
+
 	ilog(LOG_DEBUG, "min_sessions:%llu max_sessions:%llu, call_dur_per_interval:%llu.%06llu at time %llu\n",
 			(unsigned long long) ts->managed_sess_min,
 			(unsigned long long) ts->managed_sess_max,
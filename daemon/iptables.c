@@ -52,9 +52,25 @@ struct ipv6_ipt_entry {
 };
 
 
+struct xt_change {
+	int add;
+	int af;
+	union {
+		struct ipv4_ipt_entry v4;
+		struct ipv6_ipt_entry v6;
+	} u;
+	struct ipt_matches *matches;
+};
+
+
 static mutex_t __xt_lock;
 static int __xt_lock_fd = -1;
 
+// rule changes are queued here and applied in batches by iptables_loop()
+static mutex_t xt_queue_lock = MUTEX_STATIC_INIT;
+static cond_t xt_queue_cond = COND_STATIC_INIT;
+static GQueue xt_queue = G_QUEUE_INIT;
+
 
 
 static void xt_lock(void) {
@@ -124,184 +140,166 @@ static void ip6_fill_entry(struct ipv6_ipt_entry *entry, const socket_t *local_s
 	entry->entry.next_offset = entry->entry.target_offset + entry->matches.target.target.u.user.target_size;
 }
 
-static const char *ip4tables_add_rule(const socket_t *local_sock, const str *comment) {
-	struct xtc_handle *h;
-	struct ipv4_ipt_entry entry;
-	const char *err;
-
-	xt_lock();
-
-	err = "could not initialize iptables";
-	h = iptc_init("filter");
-	if (!h)
-		goto err2;
-
-	ip4_fill_entry(&entry, local_sock, comment);
-
-	err = "failed to append iptables entry";
-	if (!iptc_append_entry(rtpe_config.iptables_chain, &entry.entry, h))
-		goto err;
-	err = "failed to commit iptables changes";
-	if (!iptc_commit(h))
-		goto err;
-
-	err = NULL;
+// match everything except the comment
+#define xt_fill_del_mask(mask) do { \
+		memset(&(mask), 0, sizeof(mask)); \
+		memset(&(mask).entry, 0xff, sizeof((mask).entry)); \
+		memset(&(mask).matches.udp_match, 0xff, sizeof((mask).matches.udp_match)); \
+		memset(&(mask).matches.udp, 0xff, sizeof((mask).matches.udp)); \
+		memset(&(mask).matches.comment_match, 0xff, sizeof((mask).matches.comment_match)); \
+		memset(&(mask).matches.target, 0xff, sizeof((mask).matches.target)); \
+	} while (0)
+
+static const char *ip4tables_apply(struct xtc_handle *h, struct xt_change *c) {
+	struct ipv4_ipt_entry mask;
+
+	if (c->add) {
+		if (!iptc_append_entry(rtpe_config.iptables_chain, &c->u.v4.entry, h))
+			return "failed to append iptables entry";
+		return NULL;
+	}
 
-err:
-	iptc_free(h);
-err2:
-	xt_unlock();
-	return err;
+	xt_fill_del_mask(mask);
+	if (!iptc_delete_entry(rtpe_config.iptables_chain, &c->u.v4.entry, (unsigned char *) &mask, h))
+		return "failed to delete iptables entry";
+	return NULL;
 }
 
-static const char *ip6tables_add_rule(const socket_t *local_sock, const str *comment) {
-	struct xtc_handle *h;
-	struct ipv6_ipt_entry entry;
-	const char *err;
+static const char *ip6tables_apply(struct xtc_handle *h, struct xt_change *c) {
+	struct ipv6_ipt_entry mask;
 
-	xt_lock();
-
-	err = "could not initialize ip6tables";
-	h = ip6tc_init("filter");
-	if (!h)
-		goto err2;
-
-	ip6_fill_entry(&entry, local_sock, comment);
-
-	err = "failed to append ip6tables entry";
-	if (!ip6tc_append_entry(rtpe_config.iptables_chain, &entry.entry, h))
-		goto err;
-	err = "failed to commit ip6tables changes";
-	if (!ip6tc_commit(h))
-		goto err;
-
-	err = NULL;
+	if (c->add) {
+		if (!ip6tc_append_entry(rtpe_config.iptables_chain, &c->u.v6.entry, h))
+			return "failed to append ip6tables entry";
+		return NULL;
+	}
 
-err:
-	ip6tc_free(h);
-err2:
-	xt_unlock();
-	return err;
+	xt_fill_del_mask(mask);
+	if (!ip6tc_delete_entry(rtpe_config.iptables_chain, &c->u.v6.entry, (unsigned char *) &mask, h))
+		return "failed to delete ip6tables entry";
+	return NULL;
 }
 
-static const char *ip4tables_del_rule(const socket_t *local_sock) {
-	struct xtc_handle *h;
-	struct ipv4_ipt_entry entry, mask;
-	const char *err;
-
-	xt_lock();
-
-	err = "could not initialize iptables";
-	h = iptc_init("filter");
-	if (!h)
-		goto err2;
-
-	ip4_fill_entry(&entry, local_sock, NULL);
-
-	// match everything except the comment
-	memset(&mask, 0, sizeof(mask));
-	memset(&mask.entry, 0xff, sizeof(mask.entry));
-	memset(&mask.matches.udp_match, 0xff, sizeof(mask.matches.udp_match));
-	memset(&mask.matches.udp, 0xff, sizeof(mask.matches.udp));
-	memset(&mask.matches.comment_match, 0xff, sizeof(mask.matches.comment_match));
-	memset(&mask.matches.target, 0xff, sizeof(mask.matches.target));
-
-	err = "failed to delete iptables entry";
-	if (!iptc_delete_entry(rtpe_config.iptables_chain, &entry.entry, (unsigned char *) &mask, h))
-		goto err;
-	err = "failed to commit iptables changes";
-	if (!iptc_commit(h))
-		goto err;
-
-	err = NULL;
+static void xt_change_error(struct xt_change *c, const char *err) {
+	if (c->add)
+		ilog(LOG_ERROR, "Error adding iptables rule (for '%s'): %s (%s)",
+				c->matches->comment.comment, err, strerror(errno));
+	else
+		ilog(LOG_ERROR, "Error deleting iptables rule: %s (%s)",
+				err, strerror(errno));
+}
 
-err:
-	iptc_free(h);
-err2:
-	xt_unlock();
-	return err;
+static void xt_change_free(void *p) {
+	g_slice_free1(sizeof(struct xt_change), p);
 }
 
-static const char *ip6tables_del_rule(const socket_t *local_sock) {
-	struct xtc_handle *h;
-	struct ipv6_ipt_entry entry, mask;
+// applies all queued changes with a single init and commit per address family
+static void xt_apply_batch(GQueue *q) {
+	struct xtc_handle *h4 = NULL, *h6 = NULL;
+	int init4 = 0, init6 = 0;
+	unsigned int num4 = 0, num6 = 0;
 	const char *err;
+	GList *l;
 
 	xt_lock();
 
-	err = "could not initialize ip6tables";
-	h = ip6tc_init("filter");
-	if (!h)
-		goto err2;
+	for (l = q->head; l; l = l->next) {
+		struct xt_change *c = l->data;
+
+		switch (c->af) {
+			case AF_INET:
+				if (!init4) {
+					init4 = 1;
+					h4 = iptc_init("filter");
+				}
+				err = "could not initialize iptables";
+				if (h4)
+					err = ip4tables_apply(h4, c);
+				if (!err)
+					num4++;
+				break;
+			case AF_INET6:
+				if (!init6) {
+					init6 = 1;
+					h6 = ip6tc_init("filter");
+				}
+				err = "could not initialize ip6tables";
+				if (h6)
+					err = ip6tables_apply(h6, c);
+				if (!err)
+					num6++;
+				break;
+			default:
+				err = "unsupported socket family";
+				break;
+		}
+
+		if (err)
+			xt_change_error(c, err);
+	}
 
-	ip6_fill_entry(&entry, local_sock, NULL);
+	if (h4) {
+		if (num4 && !iptc_commit(h4))
+			ilog(LOG_ERROR, "Failed to commit %u iptables changes (%s)", num4, strerror(errno));
+		iptc_free(h4);
+	}
+	if (h6) {
+		if (num6 && !ip6tc_commit(h6))
+			ilog(LOG_ERROR, "Failed to commit %u ip6tables changes (%s)", num6, strerror(errno));
+		ip6tc_free(h6);
+	}
 
-	// match everything except the comment
-	memset(&mask, 0, sizeof(mask));
-	memset(&mask.entry, 0xff, sizeof(mask.entry));
-	memset(&mask.matches.udp_match, 0xff, sizeof(mask.matches.udp_match));
-	memset(&mask.matches.udp, 0xff, sizeof(mask.matches.udp));
-	memset(&mask.matches.comment_match, 0xff, sizeof(mask.matches.comment_match));
-	memset(&mask.matches.target, 0xff, sizeof(mask.matches.target));
+	xt_unlock();
 
-	err = "failed to delete ip6tables entry";
-	if (!ip6tc_delete_entry(rtpe_config.iptables_chain, &entry.entry, (unsigned char *) &mask, h))
-		goto err;
-	err = "failed to commit ip6tables changes";
-	if (!ip6tc_commit(h))
-		goto err;
+	ilog(LOG_DEBUG, "Applied %u iptables and %u ip6tables changes", num4, num6);
 
-	err = NULL;
+	g_queue_clear_full(q, xt_change_free);
+}
 
-err:
-	ip6tc_free(h);
-err2:
-	xt_unlock();
-	return err;
+static void xt_queue_push(struct xt_change *c) {
+	mutex_lock(&xt_queue_lock);
+	g_queue_push_tail(&xt_queue, c);
+	cond_signal(&xt_queue_cond);
+	mutex_unlock(&xt_queue_lock);
 }
 
-static int __iptables_add_rule(const socket_t *local_sock, const str *comment) {
-	const char *err;
+static struct xt_change *xt_change_new(const socket_t *local_sock, const str *comment, int add) {
+	struct xt_change *c;
+
+	c = g_slice_alloc(sizeof(*c));
+	c->add = add;
+	c->af = local_sock->family->af;
 
-	switch (local_sock->family->af) {
+	switch (c->af) {
 		case AF_INET:
-			err = ip4tables_add_rule(local_sock, comment);
+			ip4_fill_entry(&c->u.v4, local_sock, comment);
+			c->matches = &c->u.v4.matches;
 			break;
 		case AF_INET6:
-			err = ip6tables_add_rule(local_sock, comment);
+			ip6_fill_entry(&c->u.v6, local_sock, comment);
+			c->matches = &c->u.v6.matches;
 			break;
 		default:
-			err = "unsupported socket family";
-			break;
-	};
+			xt_change_error(c, "unsupported socket family");
+			xt_change_free(c);
+			return NULL;
+	}
 
-	if (err)
-		ilog(LOG_ERROR, "Error adding iptables rule (for '" STR_FORMAT "'): %s (%s)",
-				STR_FMT(comment), err, strerror(errno));
+	return c;
+}
 
+static int __iptables_add_rule(const socket_t *local_sock, const str *comment) {
+	struct xt_change *c = xt_change_new(local_sock, comment, 1);
+	if (c)
+		xt_queue_push(c);
 	return 0;
 }
 
 
 static int __iptables_del_rule(const socket_t *local_sock) {
-	const char *err;
-
-	switch (local_sock->family->af) {
-		case AF_INET:
-			err = ip4tables_del_rule(local_sock);
-			break;
-		case AF_INET6:
-			err = ip6tables_del_rule(local_sock);
-			break;
-		default:
-			err = "unsupported socket family";
-			break;
-	};
-
-	if (err)
-		ilog(LOG_ERROR, "Error deleting iptables rule: %s (%s)",
-				err, strerror(errno));
-
+	struct xt_change *c = xt_change_new(local_sock, NULL, 0);
+	if (c)
+		xt_queue_push(c);
 	return 0;
 }
 
@@ -312,6 +310,38 @@ static int __iptables_stub(void) {
 }
 
 
+void iptables_loop(void *p) {
+#ifdef WITH_IPTABLES_OPTION
+	GQueue batch = G_QUEUE_INIT;
+	struct timeval tv;
+
+	mutex_lock(&xt_queue_lock);
+
+	while (1) {
+		// take over everything that has been queued up while the last batch was being committed
+		batch = xt_queue;
+		g_queue_init(&xt_queue);
+
+		if (batch.length) {
+			mutex_unlock(&xt_queue_lock);
+			xt_apply_batch(&batch);
+			mutex_lock(&xt_queue_lock);
+			continue;
+		}
+
+		if (rtpe_shutdown)
+			break;
+
+		gettimeofday(&tv, NULL);
+		timeval_add_usec(&tv, 1000000);
+		cond_timedwait(&xt_queue_cond, &xt_queue_lock, &tv);
+	}
+
+	mutex_unlock(&xt_queue_lock);
+#endif
+}
+
+
 void iptables_init(void) {
 	if (rtpe_config.iptables_chain && !rtpe_config.iptables_chain[0])
 		rtpe_config.iptables_chain = NULL;
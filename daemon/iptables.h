@@ -7,6 +7,7 @@
 
 
 void iptables_init(void);
+void iptables_loop(void *);
 extern int (*iptables_add_rule)(const socket_t *local_sock, const str *comment);
 extern int (*iptables_del_rule)(const socket_t *local_sock);
 
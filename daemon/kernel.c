@@ -18,6 +18,7 @@
 
 
 #define PREFIX "/proc/rtpengine"
+#define KERNEL_STATS_BATCH 256
 
 
 
@@ -159,34 +160,38 @@ int kernel_del_stream(const struct re_address *a) {
 	return -1;
 }
 
-GList *kernel_list() {
+/* reads the stats of all forwarding targets in batches and calls "func" for each */
+void kernel_stats_foreach(kernel_stats_func *func, void *ptr) {
 	char str[64];
 	int fd;
-	struct rtpengine_list_entry *buf;
-	GList *li = NULL;
-	int ret;
+	struct rtpengine_stats_entry *buf;
+	ssize_t ret;
+	unsigned int i, num;
 
 	if (!kernel.is_open)
-		return NULL;
+		return;
 
-	sprintf(str, PREFIX "/%u/blist", kernel.table);
+	sprintf(str, PREFIX "/%u/stats", kernel.table);
 	fd = open(str, O_RDONLY);
 	if (fd == -1)
-		return NULL;
+		return;
 
+	buf = g_new(struct rtpengine_stats_entry, KERNEL_STATS_BATCH);
 
 	for (;;) {
-		buf = g_slice_alloc(sizeof(*buf));
-		ret = read(fd, buf, sizeof(*buf));
-		if (ret != sizeof(*buf))
+		ret = read(fd, buf, sizeof(*buf) * KERNEL_STATS_BATCH);
+		if (ret <= 0)
+			break;
+		num = ret / sizeof(*buf);
+		for (i = 0; i < num; i++)
+			func(&buf[i], ptr);
+		// a short read means we're done
+		if (num < KERNEL_STATS_BATCH)
 			break;
-		li = g_list_prepend(li, buf);
 	}
 
-	g_slice_free1(sizeof(*buf), buf);
+	g_free(buf);
 	close(fd);
-
-	return li;
 }
 
 unsigned int kernel_add_call(const char *id) {
@@ -17,6 +17,7 @@
 
 struct rtpengine_target_info;
 struct re_address;
+struct rtpengine_stats_entry;
 
 
 
@@ -28,13 +29,15 @@ struct kernel_interface {
 };
 extern struct kernel_interface kernel;
 
+typedef void kernel_stats_func(const struct rtpengine_stats_entry *, void *);
+
 
 
 int kernel_setup_table(unsigned int);
 
 int kernel_add_stream(struct rtpengine_target_info *, int);
 int kernel_del_stream(const struct re_address *);
-GList *kernel_list();
+void kernel_stats_foreach(kernel_stats_func *, void *);
 
 unsigned int kernel_add_call(const char *id);
 int kernel_del_call(unsigned int);
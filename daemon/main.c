@@ -44,6 +44,8 @@
 
 
 struct poller *rtpe_poller;
+struct poller **rtpe_media_pollers;
+unsigned int rtpe_num_media_pollers;
 struct rtpengine_config initial_rtpe_config;
 
 struct rtpengine_config rtpe_config = {
@@ -245,6 +247,7 @@ static void options(int *argc, char ***argv) {
 	char *log_facility_cdr_s = NULL;
 	char *log_facility_rtcp_s = NULL;
 	char *log_format = NULL;
+	char *redis_format = NULL;
 	int sip_source = 0;
 	char *homerp = NULL;
 	char *homerproto = NULL;
@@ -256,6 +259,8 @@ static void options(int *argc, char ***argv) {
 	GOptionEntry e[] = {
 		{ "table",	't', 0, G_OPTION_ARG_INT,	&rtpe_config.kernel_table,		"Kernel table to use",		"INT"		},
 		{ "no-fallback",'F', 0, G_OPTION_ARG_NONE,	&rtpe_config.no_fallback,	"Only start when kernel module is available", NULL },
+		{ "kernel-rtcp", 0, 0, G_OPTION_ARG_NONE,	&rtpe_config.kernel_rtcp,	"Forward muxed RTCP in the kernel module", NULL },
+		{ "kernel-stun", 0, 0, G_OPTION_ARG_NONE,	&rtpe_config.kernel_stun,	"Answer ICE consent checks in the kernel module", NULL },
 		{ "interface",	'i', 0, G_OPTION_ARG_STRING_ARRAY,&if_a,	"Local interface for RTP",	"[NAME/]IP[!IP]"},
 		{ "subscribe-keyspace", 'k', 0, G_OPTION_ARG_STRING_ARRAY,&ks_a,	"Subscription keyspace list",	"INT INT ..."},
 		{ "listen-tcp",	'l', 0, G_OPTION_ARG_STRING,	&listenps,	"TCP port to listen on",	"[IP:]PORT"	},
@@ -277,6 +282,7 @@ static void options(int *argc, char ***argv) {
 		{ "redis-write",'w', 0, G_OPTION_ARG_STRING,    &redisps_write, "Connect to Redis write database",      "[PW@]IP:PORT/INT"       },
 		{ "redis-num-threads", 0, 0, G_OPTION_ARG_INT, &rtpe_config.redis_num_threads, "Number of Redis restore threads",      "INT"       },
 		{ "redis-expires", 0, 0, G_OPTION_ARG_INT, &rtpe_config.redis_expires_secs, "Expire time in seconds for redis keys",      "INT"       },
+		{ "redis-format", 0, 0, G_OPTION_ARG_STRING, &redis_format, "Encoding of call data written to redis", "json|bin" },
 		{ "no-redis-required", 'q', 0, G_OPTION_ARG_NONE, &rtpe_config.no_redis_required, "Start no matter of redis connection state", NULL },
 		{ "redis-allowed-errors", 0, 0, G_OPTION_ARG_INT, &rtpe_config.redis_allowed_errors, "Number of allowed errors before redis is temporarily disabled", "INT" },
 		{ "redis-disable-time", 0, 0, G_OPTION_ARG_INT, &rtpe_config.redis_disable_time, "Number of seconds redis communication is disabled because of errors", "INT" },
@@ -288,6 +294,9 @@ static void options(int *argc, char ***argv) {
 		{ "log-format",	0, 0,	G_OPTION_ARG_STRING,	&log_format,	"Log prefix format",		"default|parsable"},
 		{ "xmlrpc-format",'x', 0, G_OPTION_ARG_INT,	&rtpe_config.fmt,	"XMLRPC timeout request format to use. 0: SEMS DI, 1: call-id only",	"INT"	},
 		{ "num-threads",  0, 0, G_OPTION_ARG_INT,	&rtpe_config.num_threads,	"Number of worker threads to create",	"INT"	},
+		{ "poller-per-thread", 0, 0, G_OPTION_ARG_NONE,	&rtpe_config.poller_per_thread,	"Use a separate media poller for each worker thread",	NULL	},
+		{ "socket-pool", 0, 0, G_OPTION_ARG_INT,	&rtpe_config.socket_pool,	"Number of pre-bound RTP/RTCP port pairs to keep per interface",	"INT"	},
+		{ "transcode-threads", 0, 0, G_OPTION_ARG_INT,	&rtpe_config.transcode_threads,	"Number of dedicated transcoding worker threads",	"INT"	},
 		{ "delete-delay",  'd', 0, G_OPTION_ARG_INT,    &rtpe_config.delete_delay,  "Delay for deleting a session from memory.",    "INT"   },
 		{ "sip-source",  0,  0, G_OPTION_ARG_NONE,	&sip_source,	"Use SIP source address by default",	NULL	},
 		{ "dtls-passive", 0, 0, G_OPTION_ARG_NONE,	&dtls_passive_def,"Always prefer DTLS passive role",	NULL	},
@@ -436,6 +445,15 @@ static void options(int *argc, char ***argv) {
 			die("Invalid --log-format option");
 	}
 
+	if (redis_format) {
+		if (!strcmp(redis_format, "json"))
+			rtpe_config.redis_format = RF_JSON;
+		else if (!strcmp(redis_format, "bin"))
+			rtpe_config.redis_format = RF_BIN;
+		else
+			die("Invalid --redis-format option");
+	}
+
 	if (!sip_source)
 		trust_address_def = 1;
 
@@ -471,6 +489,7 @@ void fill_initial_rtpe_cfg(struct rtpengine_config* ini_rtpe_cfg) {
 	ini_rtpe_cfg->final_timeout = rtpe_config.final_timeout;
 	ini_rtpe_cfg->delete_delay = rtpe_config.delete_delay;
 	ini_rtpe_cfg->redis_expires_secs = rtpe_config.redis_expires_secs;
+	ini_rtpe_cfg->redis_format = rtpe_config.redis_format;
 	ini_rtpe_cfg->default_tos = rtpe_config.default_tos;
 	ini_rtpe_cfg->control_tos = rtpe_config.control_tos;
 	ini_rtpe_cfg->graphite_interval = rtpe_config.graphite_interval;
@@ -478,12 +497,17 @@ void fill_initial_rtpe_cfg(struct rtpengine_config* ini_rtpe_cfg) {
 	ini_rtpe_cfg->homer_protocol = rtpe_config.homer_protocol;
 	ini_rtpe_cfg->homer_id = rtpe_config.homer_id;
 	ini_rtpe_cfg->no_fallback = rtpe_config.no_fallback;
+	ini_rtpe_cfg->kernel_rtcp = rtpe_config.kernel_rtcp;
+	ini_rtpe_cfg->kernel_stun = rtpe_config.kernel_stun;
 	ini_rtpe_cfg->port_min = rtpe_config.port_min;
 	ini_rtpe_cfg->port_max = rtpe_config.port_max;
 	ini_rtpe_cfg->redis_db = rtpe_config.redis_db;
 	ini_rtpe_cfg->redis_write_db = rtpe_config.redis_write_db;
 	ini_rtpe_cfg->no_redis_required = rtpe_config.no_redis_required;
 	ini_rtpe_cfg->num_threads = rtpe_config.num_threads;
+	ini_rtpe_cfg->poller_per_thread = rtpe_config.poller_per_thread;
+	ini_rtpe_cfg->socket_pool = rtpe_config.socket_pool;
+	ini_rtpe_cfg->transcode_threads = rtpe_config.transcode_threads;
 	ini_rtpe_cfg->fmt = rtpe_config.fmt;
 	ini_rtpe_cfg->log_format = rtpe_config.log_format;
 	ini_rtpe_cfg->redis_allowed_errors = rtpe_config.redis_allowed_errors;
@@ -595,6 +619,7 @@ static void create_everything(void) {
 	struct timeval tmp_tv;
 	struct timeval redis_start, redis_stop;
 	double redis_diff = 0;
+	unsigned int u;
 
 	if (rtpe_config.kernel_table < 0)
 		goto no_kernel;
@@ -613,6 +638,27 @@ no_kernel:
 
 	dtls_timer(rtpe_poller);
 
+	if (rtpe_config.num_threads < 1) {
+#ifdef _SC_NPROCESSORS_ONLN
+		rtpe_config.num_threads = sysconf( _SC_NPROCESSORS_ONLN ) + 3;
+#endif
+		if (rtpe_config.num_threads <= 1)
+			rtpe_config.num_threads = 4;
+	}
+
+	if (rtpe_config.poller_per_thread) {
+		rtpe_num_media_pollers = rtpe_config.num_threads;
+		rtpe_media_pollers = malloc(sizeof(*rtpe_media_pollers) * rtpe_num_media_pollers);
+		for (u = 0; u < rtpe_num_media_pollers; u++) {
+			rtpe_media_pollers[u] = poller_new();
+			if (!rtpe_media_pollers[u])
+				die("poller creation failed");
+		}
+	}
+
+	if (rtpe_config.transcode_threads > 0)
+		transcode_workers_init();
+
 	if (call_init())
 		abort();
 
@@ -713,6 +759,8 @@ no_kernel:
 
 int main(int argc, char **argv) {
 	int idx=0;
+	int num_poller_threads;
+	unsigned int u;
 
 	early_init();
 	options(&argc, &argv);
@@ -729,23 +777,38 @@ int main(int argc, char **argv) {
 	if (!is_addr_unspecified(&rtpe_config.redis_ep.address))
 		thread_create_detach(redis_notify_loop, NULL);
 
+	if (rtpe_redis_write)
+		thread_create_detach(redis_write_loop, rtpe_redis_write);
+
 	if (!is_addr_unspecified(&rtpe_config.graphite_ep.address))
 		thread_create_detach(graphite_loop, NULL);
 
 	thread_create_detach(ice_thread_run, NULL);
 
-	if (rtpe_config.num_threads < 1) {
-#ifdef _SC_NPROCESSORS_ONLN
-		rtpe_config.num_threads = sysconf( _SC_NPROCESSORS_ONLN ) + 3;
-#endif
-		if (rtpe_config.num_threads <= 1)
-			rtpe_config.num_threads = 4;
-	}
+	if (rtpe_config.socket_pool > 0)
+		thread_create_detach(socket_pool_loop, NULL);
+
+	if (rtpe_config.iptables_chain)
+		thread_create_detach(iptables_loop, NULL);
+
+	if (selected_recording_method && selected_recording_method->writer_loop)
+		thread_create_detach(selected_recording_method->writer_loop, NULL);
 
-	for (;idx<rtpe_config.num_threads;++idx) {
+	for (u = 0; u < rtpe_config.transcode_threads; u++)
+		thread_create_detach(transcode_worker_loop, GUINT_TO_POINTER(u));
+
+	// with per-thread media pollers, the shared poller only carries control sockets
+	num_poller_threads = rtpe_config.num_threads;
+	if (rtpe_num_media_pollers)
+		num_poller_threads = MIN(num_poller_threads, 2);
+
+	for (;idx<num_poller_threads;++idx) {
 		thread_create_detach(poller_loop, rtpe_poller);
 	}
 
+	for (u = 0; u < rtpe_num_media_pollers; u++)
+		thread_create_detach(poller_loop, rtpe_media_pollers[u]);
+
 	while (!rtpe_shutdown) {
 		usleep(100000);
 		threads_join_all(0);
@@ -17,6 +17,12 @@ enum log_format {
 
 	__LF_LAST
 };
+enum redis_format {
+	RF_JSON = 0,
+	RF_BIN,
+
+	__RF_LAST
+};
 
 struct rtpengine_config {
 	/* everything below protected by config_lock */
@@ -33,6 +39,7 @@ struct rtpengine_config {
 	int			delete_delay;
 	GQueue		        redis_subscribed_keyspaces;
 	int			redis_expires_secs;
+	enum redis_format	redis_format;
 	char			*b2b_url;
 	int			default_tos;
 	int			control_tos;
@@ -52,6 +59,8 @@ struct rtpengine_config {
 	int			homer_protocol;
 	int			homer_id;
 	int			no_fallback;
+	int			kernel_rtcp;
+	int			kernel_stun;
 	int			port_min;
 	int			port_max;
 	int			redis_db;
@@ -64,6 +73,9 @@ struct rtpengine_config {
 	char			*redis_auth;
 	char			*redis_write_auth;
 	int			num_threads;
+	int			poller_per_thread;
+	int			socket_pool;
+	int			transcode_threads;
 	char			*spooldir;
 	char			*rec_method;
 	char			*rec_format;
@@ -75,6 +87,8 @@ struct rtpengine_config {
 
 struct poller;
 extern struct poller *rtpe_poller; // main global poller instance XXX convert to struct instead of pointer?
+extern struct poller **rtpe_media_pollers; // one per worker thread if poller_per_thread is set, NULL otherwise
+extern unsigned int rtpe_num_media_pollers;
 
 
 extern struct rtpengine_config rtpe_config;
@@ -4,6 +4,9 @@
 #include <glib.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 #include "str.h"
 #include "ice.h"
 #include "socket.h"
@@ -25,6 +28,7 @@
 #include "iptables.h"
 #include "main.h"
 #include "codec.h"
+#include "thread_stats.h"
 
 
 #ifndef PORT_RANDOM_MIN
@@ -36,6 +40,14 @@
 #define MAX_RECV_ITERS 50
 #endif
 
+#ifndef MAX_RECV_BATCH
+#define MAX_RECV_BATCH SOCKET_MMSG_MAX
+#endif
+
+#ifndef MAX_SEND_BATCH
+#define MAX_SEND_BATCH SOCKET_MMSG_MAX
+#endif
+
 
 typedef int (*rewrite_func)(str *, struct packet_stream *, struct stream_fd *, const endpoint_t *,
 		const struct timeval *, struct ssrc_ctx *);
@@ -57,9 +69,29 @@ struct intf_rr {
 	GQueue logical_intfs;
 	struct logical_intf *singular; // set iff only one is present in the list - no lock needed
 };
+struct send_batch_entry {
+	socket_t *sock; // output socket
+	struct packet_stream *stream; // stream the packet was received on, for error stats
+	struct codec_packet *packet;
+};
+// output packets collected while processing one receive batch, sent out in one go
+struct send_batch {
+	unsigned int num;
+	struct send_batch_entry entries[MAX_SEND_BATCH];
+	struct socket_mmsg mm[MAX_SEND_BATCH];
+};
+// decode/encode jobs for one transcoding worker thread
+#define TRANSCODE_QUEUE_MAX 1000 // jobs, further packets are dropped while the worker is behind
+struct transcode_worker {
+	mutex_t lock;
+	cond_t cond;
+	GQueue jobs;
+	unsigned int cpu;
+};
 struct packet_handler_ctx {
 	// inputs:
 	str s; // raw input packet
+	struct send_batch *send_batch; // where to queue output packets
 
 	struct packet_stream *sink; // where to send output packets to (forward destination)
 	rewrite_func decrypt_func, encrypt_func; // handlers for decrypt/encrypt
@@ -285,6 +317,9 @@ static GHashTable *__intf_spec_addr_type_hash; // addr + type -> struct intf_spe
 static GHashTable *__local_intf_addr_type_hash; // addr + type -> GList of struct local_intf
 static GQueue __preferred_lists_for_family[__SF_LAST];
 
+static mutex_t __kernel_sfds_lock = MUTEX_STATIC_INIT;
+static GHashTable *__kernel_sfds; // local endpoint -> struct stream_fd, for streams forwarded in the kernel
+
 
 
 /* checks for free no_ports on a local interface */
@@ -294,7 +329,8 @@ static int has_free_ports_loc(struct local_intf *loc, unsigned int num_ports) {
 		return 0;
 	}
 
-	if (num_ports > g_atomic_int_get(&loc->spec->port_pool.free_ports)) {
+	if (num_ports > g_atomic_int_get(&loc->spec->port_pool.free_ports)
+			+ g_atomic_int_get(&loc->spec->port_pool.sock_pool_ports)) {
 		ilog(LOG_ERR, "Didn't found %d ports available for %.*s/%s",
 			num_ports, loc->logical->name.len, loc->logical->name.s,
 			sockaddr_print_buf(&loc->spec->local_address.addr));
@@ -569,6 +605,9 @@ static void __interface_append(struct intf_config *ifa, sockfamily_t *fam) {
 		spec->port_pool.min = ifa->port_min;
 		spec->port_pool.max = ifa->port_max;
 		spec->port_pool.free_ports = spec->port_pool.max - spec->port_pool.min + 1;
+		mutex_init(&spec->port_pool.sock_pool_lock);
+		g_queue_init(&spec->port_pool.sock_pool);
+		spec->port_pool.sock_pool_single = g_hash_table_new(g_direct_hash, g_direct_equal);
 		g_hash_table_insert(__intf_spec_addr_type_hash, &spec->local_address, spec);
 	}
 
@@ -596,6 +635,7 @@ void interfaces_init(GQueue *interfaces) {
 	__logical_intf_name_family_rr_hash = g_hash_table_new(__name_family_hash, __name_family_eq);
 	__intf_spec_addr_type_hash = g_hash_table_new(__addr_type_hash, __addr_type_eq);
 	__local_intf_addr_type_hash = g_hash_table_new(__addr_type_hash, __addr_type_eq);
+	__kernel_sfds = g_hash_table_new(g_endpoint_hash, g_endpoint_eq);
 
 	for (i = 0; i < G_N_ELEMENTS(__preferred_lists_for_family); i++)
 		g_queue_init(&__preferred_lists_for_family[i]);
@@ -687,9 +727,14 @@ static int get_port(socket_t *r, unsigned int port, struct intf_spec *spec, cons
 	return 0;
 }
 
+static int sock_pool_recycle(socket_t *r, struct intf_spec *spec);
+
 static void release_port(socket_t *r, struct intf_spec *spec) {
 	unsigned int port = r->local.port;
 
+	if (rtpe_config.socket_pool > 0 && !sock_pool_recycle(r, spec))
+		return;
+
 	__C_DBG("trying to release port %u", port);
 
 	iptables_del_rule(r);
@@ -709,8 +754,8 @@ static void free_port(socket_t *r, struct intf_spec *spec) {
 
 
 
-/* puts list of socket_t into "out" */
-int __get_consecutive_ports(GQueue *out, unsigned int num_ports, unsigned int wanted_start_port,
+/* opens and binds new sockets, puts list of socket_t into "out" */
+static int __open_consecutive_ports(GQueue *out, unsigned int num_ports, unsigned int wanted_start_port,
 		struct intf_spec *spec, const str *label)
 {
 	int i, cycle = 0;
@@ -792,6 +837,235 @@ fail:
 	return -1;
 }
 
+
+
+/* Socket pool: with --socket-pool=N, up to N consecutive RTP/RTCP port pairs per
+ * interface are kept open, bound and configured, so that handing out the ports
+ * for a new media section doesn't involve any syscalls. The pool is refilled by
+ * socket_pool_loop(). Released sockets are put back into the pool once both
+ * sockets of a pair have been released. */
+
+static mutex_t sock_pool_wait_lock = MUTEX_STATIC_INIT;
+static cond_t sock_pool_cond = COND_STATIC_INIT;
+
+static void sock_pool_wakeup(void) {
+	mutex_lock(&sock_pool_wait_lock);
+	cond_signal(&sock_pool_cond);
+	mutex_unlock(&sock_pool_wait_lock);
+}
+
+static void sock_pool_drain(socket_t *r) {
+	char buf[1];
+
+	// discard anything still queued from the previous user of this port
+	while (recv(r->fd, buf, sizeof(buf), MSG_DONTWAIT | MSG_TRUNC) >= 0)
+		;
+}
+
+static int sock_pool_get(GQueue *out, struct intf_spec *spec) {
+	struct port_pool *pp = &spec->port_pool;
+	socket_t *rtp, *rtcp;
+
+	mutex_lock(&pp->sock_pool_lock);
+	rtp = g_queue_pop_head(&pp->sock_pool);
+	rtcp = g_queue_pop_head(&pp->sock_pool);
+	mutex_unlock(&pp->sock_pool_lock);
+
+	if (!rtp) {
+		sock_pool_wakeup();
+		return -1;
+	}
+
+	// pooled sockets keep receiving while they wait to be used
+	sock_pool_drain(rtp);
+	sock_pool_drain(rtcp);
+
+	g_queue_push_tail(out, rtp);
+	g_queue_push_tail(out, rtcp);
+
+	// refill once we've dropped below half
+	if (g_atomic_int_add(&pp->sock_pool_ports, -2) - 2 < rtpe_config.socket_pool)
+		sock_pool_wakeup();
+
+	__C_DBG("Using pooled ports %u/%u on interface %s", rtp->local.port, rtcp->local.port,
+			sockaddr_print_buf(&spec->local_address.addr));
+	return 0;
+}
+
+// takes the socket bound to the given port out of the pool, for when a specific port is requested
+static socket_t *sock_pool_take(struct intf_spec *spec, unsigned int port) {
+	struct port_pool *pp = &spec->port_pool;
+	socket_t *ret = NULL, *partner;
+	GList *l;
+
+	mutex_lock(&pp->sock_pool_lock);
+
+	ret = g_hash_table_lookup(pp->sock_pool_single, GUINT_TO_POINTER(port));
+	if (ret) {
+		g_hash_table_remove(pp->sock_pool_single, GUINT_TO_POINTER(port));
+		goto out;
+	}
+
+	for (l = pp->sock_pool.head; l; l = l->next) {
+		ret = l->data;
+		if (ret->local.port == port)
+			break;
+	}
+	if (!l) {
+		ret = NULL;
+		goto out;
+	}
+
+	// break up the pair, the other half waits for this one to be released again
+	partner = (ret->local.port & 1) ? l->prev->data : l->next->data;
+	g_queue_remove(&pp->sock_pool, ret);
+	g_queue_remove(&pp->sock_pool, partner);
+	g_hash_table_insert(pp->sock_pool_single, GUINT_TO_POINTER(partner->local.port), partner);
+	g_atomic_int_add(&pp->sock_pool_ports, -2);
+
+out:
+	mutex_unlock(&pp->sock_pool_lock);
+	return ret;
+}
+
+static void sock_pool_free(socket_t *r, struct intf_spec *spec) {
+	unsigned int port = r->local.port;
+
+	iptables_del_rule(r);
+
+	if (close_socket(r) == 0) {
+		bit_array_clear(spec->port_pool.ports_used, port);
+		g_atomic_int_inc(&spec->port_pool.free_ports);
+	}
+	g_slice_free1(sizeof(*r), r);
+}
+
+// returns 0 if the socket was taken over by the pool
+static int sock_pool_recycle(socket_t *r, struct intf_spec *spec) {
+	struct port_pool *pp = &spec->port_pool;
+	unsigned int port = r->local.port;
+	socket_t *sk, *partner;
+
+	if (r->fd == -1)
+		return -1;
+
+	mutex_lock(&pp->sock_pool_lock);
+
+	partner = g_hash_table_lookup(pp->sock_pool_single, GUINT_TO_POINTER(port ^ 1));
+	if (!partner) {
+		// can only wait for the other half of the pair if it's in use
+		if (!bit_array_isset(pp->ports_used, port ^ 1))
+			goto release;
+	}
+	else if (g_queue_get_length(&pp->sock_pool) >= rtpe_config.socket_pool * 2)
+		goto release;
+
+	sock_pool_drain(r);
+	sk = g_slice_alloc(sizeof(*sk));
+	*sk = *r;
+
+	if (!partner) {
+		g_hash_table_insert(pp->sock_pool_single, GUINT_TO_POINTER(port), sk);
+		mutex_unlock(&pp->sock_pool_lock);
+		return 0;
+	}
+
+	g_hash_table_remove(pp->sock_pool_single, GUINT_TO_POINTER(port ^ 1));
+	if ((port & 1)) {
+		g_queue_push_tail(&pp->sock_pool, partner);
+		g_queue_push_tail(&pp->sock_pool, sk);
+	}
+	else {
+		g_queue_push_tail(&pp->sock_pool, sk);
+		g_queue_push_tail(&pp->sock_pool, partner);
+	}
+	g_atomic_int_add(&pp->sock_pool_ports, 2);
+	mutex_unlock(&pp->sock_pool_lock);
+	return 0;
+
+release:
+	if (partner)
+		g_hash_table_remove(pp->sock_pool_single, GUINT_TO_POINTER(port ^ 1));
+	mutex_unlock(&pp->sock_pool_lock);
+	if (partner)
+		sock_pool_free(partner, spec);
+	return -1;
+}
+
+static void sock_pool_fill(struct intf_spec *spec) {
+	static const str label = STR_CONST_INIT("socket pool");
+	struct port_pool *pp = &spec->port_pool;
+	GQueue q = G_QUEUE_INIT;
+	socket_t *rtp, *rtcp;
+
+	while (!rtpe_shutdown && g_atomic_int_get(&pp->sock_pool_ports) < rtpe_config.socket_pool * 2) {
+		// leave some room for ports requested explicitly
+		if (g_atomic_int_get(&pp->free_ports) < 4)
+			break;
+		if (__open_consecutive_ports(&q, 2, 0, spec, &label))
+			break;
+
+		rtp = g_queue_pop_head(&q);
+		rtcp = g_queue_pop_head(&q);
+
+		mutex_lock(&pp->sock_pool_lock);
+		g_queue_push_tail(&pp->sock_pool, rtp);
+		g_queue_push_tail(&pp->sock_pool, rtcp);
+		mutex_unlock(&pp->sock_pool_lock);
+		g_atomic_int_add(&pp->sock_pool_ports, 2);
+	}
+}
+
+void socket_pool_loop(void *p) {
+	GList *specs, *l;
+	struct timeval tv;
+
+	// the list of interfaces is static after startup
+	specs = g_hash_table_get_values(__intf_spec_addr_type_hash);
+
+	mutex_lock(&sock_pool_wait_lock);
+
+	while (!rtpe_shutdown) {
+		mutex_unlock(&sock_pool_wait_lock);
+		for (l = specs; l; l = l->next)
+			sock_pool_fill(l->data);
+		mutex_lock(&sock_pool_wait_lock);
+
+		gettimeofday(&tv, NULL);
+		timeval_add_usec(&tv, 1000000);
+		cond_timedwait(&sock_pool_cond, &sock_pool_wait_lock, &tv);
+	}
+
+	mutex_unlock(&sock_pool_wait_lock);
+	g_list_free(specs);
+}
+
+/* puts list of socket_t into "out" */
+int __get_consecutive_ports(GQueue *out, unsigned int num_ports, unsigned int wanted_start_port,
+		struct intf_spec *spec, const str *label)
+{
+	socket_t *sk;
+
+	if (rtpe_config.socket_pool <= 0)
+		goto open;
+
+	if (!wanted_start_port && num_ports == 2) {
+		if (!sock_pool_get(out, spec))
+			return 0;
+	}
+	else if (wanted_start_port && num_ports == 1) {
+		sk = sock_pool_take(spec, wanted_start_port);
+		if (sk) {
+			sock_pool_drain(sk);
+			g_queue_push_tail(out, sk);
+			return 0;
+		}
+	}
+
+open:
+	return __open_consecutive_ports(out, num_ports, wanted_start_port, spec, label);
+}
+
 /* puts a list of "struct intf_list" into "out", containing socket_t list */
 int get_consecutive_ports(GQueue *out, unsigned int num_ports, const struct logical_intf *log,
 		const str *label)
@@ -908,6 +1182,8 @@ static int __k_srtp_crypt(struct rtpengine_srtp *s, struct crypto_context *c, st
 		.mki_len	= c->params.mki_len,
 		.last_index	= ssrc_ctx ? ssrc_ctx->srtp_index : 0,
 		.auth_tag_len	= c->params.crypto_suite->srtp_auth_tag,
+		.rtcp_index	= ssrc_ctx ? ssrc_ctx->srtcp_index : 0,
+		.rtcp_auth_tag_len = c->params.crypto_suite->srtcp_auth_tag,
 	};
 	if (c->params.mki_len)
 		memcpy(s->mki, c->params.mki, c->params.mki_len);
@@ -920,6 +1196,8 @@ static int __k_srtp_crypt(struct rtpengine_srtp *s, struct crypto_context *c, st
 		s->cipher = REC_NULL;
 	if (c->params.session_params.unauthenticated_srtp)
 		s->auth_tag_len = 0;
+	if (c->params.session_params.unencrypted_srtcp)
+		s->rtcp_unencrypted = 1;
 
 	return 0;
 }
@@ -945,12 +1223,41 @@ static int __rtp_stats_pt_sort(const void *ap, const void *bp) {
 }
 
 
+/* lets the kernel module answer consent checks once ICE has settled on a pair */
+static void __kernel_ice_info(struct rtpengine_target_info *reti, struct packet_stream *stream) {
+	struct ice_agent *ag = stream->media->ice_agent;
+	struct rtpengine_ice_info *ice = &reti->ice;
+
+	if (!rtpe_config.kernel_stun || !ag)
+		return;
+	if (!AGENT_ISSET(ag, COMPLETED))
+		return;
+	if (!ag->ufrag[1].len || ag->ufrag[1].len > sizeof(ice->ufrag))
+		return;
+	if (!ag->pwd[1].len || ag->pwd[1].len > sizeof(ice->pwd))
+		return;
+
+	mutex_lock(&stream->out_lock);
+	__re_address_translate_ep(&ice->remote, &stream->endpoint);
+	mutex_unlock(&stream->out_lock);
+
+	memcpy(ice->ufrag, ag->ufrag[1].s, ag->ufrag[1].len);
+	ice->ufrag_len = ag->ufrag[1].len;
+	memcpy(ice->pwd, ag->pwd[1].s, ag->pwd[1].len);
+	ice->pwd_len = ag->pwd[1].len;
+	ice->controlling = AGENT_ISSET(ag, CONTROLLING) ? 1 : 0;
+	reti->stun_reply = 1;
+}
+
 /* called with in_lock held */
 void kernelize(struct packet_stream *stream) {
 	struct rtpengine_target_info reti;
 	struct call *call = stream->call;
 	struct packet_stream *sink = NULL;
+	struct stream_fd *sfd;
+	struct rtpengine_output_info *output;
 	const char *nk_warn_msg;
+	unsigned int u;
 
 	if (PS_ISSET(stream, KERNELIZED))
 		return;
@@ -996,6 +1303,8 @@ void kernelize(struct packet_stream *stream) {
 			reti.src_mismatch = MSM_PROPAGATE;
 	}
 
+	__kernel_ice_info(&reti, stream);
+
 	mutex_lock(&sink->out_lock);
 
 	__re_address_translate_ep(&reti.local, &stream->selected_sfd->socket.local);
@@ -1004,29 +1313,37 @@ void kernelize(struct packet_stream *stream) {
 	reti.dtls = MEDIA_ISSET(stream->media, DTLS);
 	reti.stun = stream->media->ice_agent ? 1 : 0;
 
-	__re_address_translate_ep(&reti.dst_addr, &sink->endpoint);
-	__re_address_translate_ep(&reti.src_addr, &sink->selected_sfd->socket.local);
+	// a stream currently has only a single sink, which becomes the first output
+	output = &reti.outputs[reti.num_outputs++];
+	__re_address_translate_ep(&output->dst_addr, &sink->endpoint);
+	__re_address_translate_ep(&output->src_addr, &sink->selected_sfd->socket.local);
 	if (stream->ssrc_in) {
 		reti.ssrc = htonl(stream->ssrc_in->parent->h.ssrc);
 		if (MEDIA_ISSET(stream->media, TRANSCODE)) {
-			reti.ssrc_out = htonl(stream->ssrc_in->ssrc_map_out);
+			output->ssrc_out = htonl(stream->ssrc_in->ssrc_map_out);
 			reti.transcoding = 1;
 		}
 	}
+	// RTCP of transcoded streams must be seen by the codec handlers
+	if (reti.rtcp_mux && rtpe_config.kernel_rtcp && !reti.transcoding)
+		reti.rtcp_fwd = 1;
 
 	stream->handler->in->kernel(&reti.decrypt, stream);
-	stream->handler->out->kernel(&reti.encrypt, sink);
+	stream->handler->out->kernel(&output->encrypt, sink);
 
 	mutex_unlock(&sink->out_lock);
 
 	nk_warn_msg = "encryption cipher or HMAC not supported by kernel module";
-	if (!reti.encrypt.cipher || !reti.encrypt.hmac)
-		goto no_kernel_warn;
+	for (u = 0; u < reti.num_outputs; u++) {
+		if (!reti.outputs[u].encrypt.cipher || !reti.outputs[u].encrypt.hmac)
+			goto no_kernel_warn;
+	}
 	nk_warn_msg = "decryption cipher or HMAC not supported by kernel module";
 	if (!reti.decrypt.cipher || !reti.decrypt.hmac)
 		goto no_kernel_warn;
 
 	ZERO(stream->kernel_stats);
+	atomic64_set(&stream->kernel_stun, 0);
 
 	if (stream->media->protocol && stream->media->protocol->rtp) {
 		GList *values, *l;
@@ -1057,6 +1374,17 @@ void kernelize(struct packet_stream *stream) {
 	kernel_add_stream(&reti, 0);
 	PS_SET(stream, KERNELIZED);
 
+	// selected_sfd may change before we're unkernelized, so remember which one we used
+	stream->kernel_sfd = obj_get(stream->selected_sfd);
+
+	mutex_lock(&__kernel_sfds_lock);
+	sfd = g_hash_table_lookup(__kernel_sfds, &stream->kernel_sfd->socket.local);
+	g_hash_table_replace(__kernel_sfds, &stream->kernel_sfd->socket.local,
+			obj_get(stream->kernel_sfd));
+	mutex_unlock(&__kernel_sfds_lock);
+	if (sfd)
+		obj_put(sfd);
+
 	return;
 
 no_kernel_warn:
@@ -1069,17 +1397,35 @@ no_kernel:
 /* must be called with in_lock held or call->master_lock held in W */
 void __unkernelize(struct packet_stream *p) {
 	struct re_address rea;
+	struct stream_fd *sfd;
 
 	if (!PS_ISSET(p, KERNELIZED))
 		return;
 	if (PS_ISSET(p, NO_KERNEL_SUPPORT))
 		return;
+	if (!p->kernel_sfd)
+		goto out;
 
 	if (kernel.is_open) {
-		__re_address_translate_ep(&rea, &p->selected_sfd->socket.local);
+		__re_address_translate_ep(&rea, &p->kernel_sfd->socket.local);
 		kernel_del_stream(&rea);
 	}
 
+	// the entry may have been taken over by another stream in the meantime
+	mutex_lock(&__kernel_sfds_lock);
+	sfd = g_hash_table_lookup(__kernel_sfds, &p->kernel_sfd->socket.local);
+	if (sfd == p->kernel_sfd)
+		g_hash_table_remove(__kernel_sfds, &p->kernel_sfd->socket.local);
+	else
+		sfd = NULL;
+	mutex_unlock(&__kernel_sfds_lock);
+	if (sfd)
+		obj_put(sfd);
+
+	obj_put(p->kernel_sfd);
+	p->kernel_sfd = NULL;
+
+out:
 	PS_CLEAR(p, KERNELIZED);
 }
 
@@ -1105,6 +1451,20 @@ void unkernelize(struct packet_stream *ps) {
 }
 
 
+/* returns a new reference, or NULL if there's no stream forwarded in the kernel
+ * for this local address */
+struct stream_fd *kernel_stream_fd_get(const endpoint_t *local) {
+	struct stream_fd *sfd;
+
+	mutex_lock(&__kernel_sfds_lock);
+	sfd = g_hash_table_lookup(__kernel_sfds, local);
+	if (sfd)
+		obj_hold(sfd);
+	mutex_unlock(&__kernel_sfds_lock);
+
+	return sfd;
+}
+
 
 /* must be called with call->master_lock held in R, and in->in_lock held */
 static void determine_handler(struct packet_stream *in, const struct packet_stream *out) {
@@ -1325,7 +1685,7 @@ static void media_packet_rtp(struct packet_handler_ctx *phc)
 			ilog(LOG_WARNING | LOG_FLAG_LIMIT,
 					"RTP packet with unknown payload type %u received", phc->payload_type);
 			atomic64_inc(&phc->mp.stream->stats.errors);
-			atomic64_inc(&rtpe_statsps.errors);
+			thread_stats_inc(errors);
 		}
 		else {
 			atomic64_inc(&rtp_s->packets);
@@ -1553,7 +1913,232 @@ out:
 }
 
 
-/* called lock-free */
+/* must be called with call->master_lock held in R, as the queued packets refer to
+ * sockets and streams of the call */
+static void send_batch_flush(struct send_batch *b) {
+	unsigned int i, j;
+	int ret;
+
+	for (i = 0; i < b->num; ) {
+		// group consecutive packets going out through the same socket
+		for (j = i + 1; j < b->num && b->entries[j].sock == b->entries[i].sock; j++)
+			;
+
+		ret = socket_sendmmsg(b->entries[i].sock, &b->mm[i], j - i);
+		if (ret <= 0) {
+			// skip over the failed packet and carry on with the rest
+			ilog(LOG_WARNING, "Write error on media socket: %s", strerror(errno));
+			atomic64_inc(&b->entries[i].stream->stats.errors);
+			thread_stats_inc(errors);
+			ret = 1;
+		}
+		i += ret;
+	}
+
+	for (i = 0; i < b->num; i++)
+		codec_packet_free(b->entries[i].packet);
+	b->num = 0;
+}
+
+/* the destination endpoint is copied, but the packet contents must remain valid until
+ * the batch is flushed */
+static void send_batch_add(struct send_batch *b, socket_t *sock, const endpoint_t *dst,
+		struct packet_stream *stream, struct codec_packet *p)
+{
+	if (b->num >= MAX_SEND_BATCH)
+		send_batch_flush(b);
+
+	struct send_batch_entry *e = &b->entries[b->num];
+	struct socket_mmsg *mm = &b->mm[b->num];
+	e->sock = sock;
+	e->stream = stream;
+	e->packet = p;
+	mm->buf = p->s.s;
+	mm->len = p->s.len;
+	mm->ep = *dst;
+	b->num++;
+}
+
+
+/* sends out everything from packets_out. must be called with call->master_lock held in R */
+static void media_packet_forward(struct packet_handler_ctx *phc, int handler_ret) {
+	mutex_lock(&phc->sink->out_lock);
+
+	if (!phc->sink->advertised_endpoint.port
+			|| (is_addr_unspecified(&phc->sink->advertised_endpoint.address)
+				&& !is_trickle_ice_address(&phc->sink->advertised_endpoint))
+			|| handler_ret < 0)
+	{
+		mutex_unlock(&phc->sink->out_lock);
+		return;
+	}
+
+	struct codec_packet *p;
+	while ((p = g_queue_pop_head(&phc->mp.packets_out))) {
+		__C_DBG("Forward to sink endpoint: %s:%d", sockaddr_print_buf(&phc->sink->endpoint.address),
+				phc->sink->endpoint.port);
+
+		send_batch_add(phc->send_batch, &phc->sink->selected_sfd->socket, &phc->sink->endpoint,
+				phc->mp.stream, p);
+	}
+
+	mutex_unlock(&phc->sink->out_lock);
+}
+
+
+/* Transcoding workers: with --transcode-threads=N, RTP packets that need to be transcoded are
+ * handed off from the media threads to one of N worker threads, each pinned to one CPU. All
+ * packets of one SSRC go to the same worker, which keeps them in order. The worker runs the
+ * codec handler and sends the output itself. */
+
+static struct transcode_worker *transcode_workers;
+
+struct transcode_job {
+	struct packet_handler_ctx phc;
+	char buf[0]; // copy of the packet
+};
+
+void transcode_workers_init(void) {
+	unsigned int i, cpus = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		cpus = 1;
+#endif
+
+	transcode_workers = g_new0(struct transcode_worker, rtpe_config.transcode_threads);
+	for (i = 0; i < rtpe_config.transcode_threads; i++) {
+		mutex_init(&transcode_workers[i].lock);
+		cond_init(&transcode_workers[i].cond);
+		g_queue_init(&transcode_workers[i].jobs);
+		transcode_workers[i].cpu = i % cpus;
+	}
+}
+
+/* the packet is copied. takes its own references to everything the packet context points to */
+static void media_packet_queue_transcode(struct packet_handler_ctx *phc) {
+	struct transcode_job *job;
+	struct transcode_worker *w;
+	ptrdiff_t off;
+
+	w = &transcode_workers[ntohl(phc->mp.rtp->ssrc) % rtpe_config.transcode_threads];
+
+	// unlocked check, a slight overshoot doesn't matter
+	if (G_UNLIKELY(w->jobs.length >= TRANSCODE_QUEUE_MAX)) {
+		thread_stats_inc(transcode_drops);
+		return;
+	}
+
+	job = malloc(sizeof(*job) + phc->s.len);
+	job->phc = *phc;
+	memcpy(job->buf, phc->s.s, phc->s.len);
+
+	// rebase everything that points into the packet
+	off = job->buf - phc->s.s;
+	job->phc.s.s += off;
+	job->phc.mp.raw.s += off;
+	job->phc.mp.payload.s += off;
+	job->phc.mp.rtp = (void *) ((char *) job->phc.mp.rtp + off);
+
+	job->phc.send_batch = NULL;
+	job->phc.update = 0;
+	g_queue_init(&job->phc.mp.packets_out);
+
+	// holds a reference to the call
+	obj_hold(job->phc.mp.sfd);
+	if (job->phc.mp.ssrc_in)
+		obj_hold(&job->phc.mp.ssrc_in->parent->h);
+	if (job->phc.mp.ssrc_out)
+		obj_hold(&job->phc.mp.ssrc_out->parent->h);
+
+	mutex_lock(&w->lock);
+	g_queue_push_tail(&w->jobs, job);
+	cond_signal(&w->cond);
+	mutex_unlock(&w->lock);
+}
+
+static void transcode_job_run(struct transcode_job *job) {
+	struct packet_handler_ctx *phc = &job->phc;
+	struct call *call = phc->mp.call;
+	struct codec_handler *transcoder;
+	struct send_batch sb;
+	int handler_ret;
+
+	log_info_stream_fd(phc->mp.sfd);
+
+	sb.num = 0;
+	phc->send_batch = &sb;
+
+	rwlock_lock_r(&call->master_lock);
+
+	// the call may have been torn down while the packet was queued
+	if (call->destroyed)
+		goto out;
+
+	// the codec handlers may have changed since the packet was queued
+	transcoder = codec_handler_get(phc->mp.media, phc->payload_type);
+	if (transcoder->func(transcoder, phc->mp.media, &phc->mp))
+		goto out;
+
+	handler_ret = media_packet_encrypt(phc);
+	media_packet_forward(phc, handler_ret);
+	send_batch_flush(&sb);
+
+out:
+	g_queue_clear_full(&phc->mp.packets_out, codec_packet_free);
+	rwlock_unlock_r(&call->master_lock);
+
+	if (phc->update)
+		redis_update_onekey(call, rtpe_redis_write);
+
+	if (phc->mp.ssrc_in)
+		obj_put(&phc->mp.ssrc_in->parent->h);
+	if (phc->mp.ssrc_out)
+		obj_put(&phc->mp.ssrc_out->parent->h);
+	obj_put(phc->mp.sfd);
+	free(job);
+
+	log_info_clear();
+}
+
+void transcode_worker_loop(void *p) {
+	struct transcode_worker *w = &transcode_workers[GPOINTER_TO_UINT(p)];
+	struct transcode_job *job;
+	struct timeval tv;
+	GQueue jobs;
+	cpu_set_t cpuset;
+
+	CPU_ZERO(&cpuset);
+	CPU_SET(w->cpu, &cpuset);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset))
+		ilog(LOG_WARN, "Failed to pin transcoding thread to CPU %u", w->cpu);
+
+	mutex_lock(&w->lock);
+
+	while (!rtpe_shutdown) {
+		if (!w->jobs.length) {
+			gettimeofday(&tv, NULL);
+			timeval_add_usec(&tv, 1000000);
+			cond_timedwait(&w->cond, &w->lock, &tv);
+			continue;
+		}
+
+		jobs = w->jobs;
+		g_queue_init(&w->jobs);
+		mutex_unlock(&w->lock);
+
+		while ((job = g_queue_pop_head(&jobs)))
+			transcode_job_run(job);
+
+		mutex_lock(&w->lock);
+	}
+
+	mutex_unlock(&w->lock);
+}
+
+
+/* must be called with call->master_lock held in R */
 static int stream_packet(struct packet_handler_ctx *phc) {
 /**
  * Incoming packets:
@@ -1575,12 +2160,10 @@ static int stream_packet(struct packet_handler_ctx *phc) {
  */
 /* TODO move the above comments to the data structure definitions, if the above
  * always holds true */
-	int ret = 0, handler_ret = 0;
+	int ret = 0, handler_ret = 0, async = 0;
 
 	phc->mp.call = phc->mp.sfd->call;
 
-	rwlock_lock_r(&phc->mp.call->master_lock);
-
 	phc->mp.stream = phc->mp.sfd->stream;
 	if (G_UNLIKELY(!phc->mp.stream))
 		goto out;
@@ -1625,7 +2208,7 @@ static int stream_packet(struct packet_handler_ctx *phc) {
 	{
 		ilog(LOG_WARNING, "RTP packet from %s discarded", endpoint_print_buf(&phc->mp.fsin));
 		atomic64_inc(&phc->mp.stream->stats.errors);
-		atomic64_inc(&rtpe_statsps.errors);
+		thread_stats_inc(errors);
 		goto out;
 	}
 
@@ -1646,12 +2229,14 @@ static int stream_packet(struct packet_handler_ctx *phc) {
 	}
 	else {
 		struct codec_handler *transcoder = codec_handler_get(phc->mp.media, phc->payload_type);
+		if (transcode_workers && !transcoder->passthrough && phc->mp.rtp)
+			async = 1; // handed off below
 		// this transfers the packet from 's' to 'packets_out'
-		if (transcoder->func(transcoder, phc->mp.media, &phc->mp))
+		else if (transcoder->func(transcoder, phc->mp.media, &phc->mp))
 			goto drop;
 	}
 
-	if (G_LIKELY(handler_ret >= 0))
+	if (G_LIKELY(handler_ret >= 0) && !async)
 		handler_ret = media_packet_encrypt(phc);
 
 	if (phc->unkernelize) // for RTCP packet index updates
@@ -1666,40 +2251,12 @@ static int stream_packet(struct packet_handler_ctx *phc) {
 		media_packet_kernel_check(phc);
 
 
-	mutex_lock(&phc->sink->out_lock);
-
-	if (!phc->sink->advertised_endpoint.port
-			|| (is_addr_unspecified(&phc->sink->advertised_endpoint.address)
-				&& !is_trickle_ice_address(&phc->sink->advertised_endpoint))
-			|| handler_ret < 0)
-	{
-		mutex_unlock(&phc->sink->out_lock);
-		goto drop;
-	}
-
-	struct codec_packet *p;
-	ret = 0;
-	while ((p = g_queue_pop_head(&phc->mp.packets_out))) {
-		__C_DBG("Forward to sink endpoint: %s:%d", sockaddr_print_buf(&phc->sink->endpoint.address),
-				phc->sink->endpoint.port);
-
-		ret = socket_sendto(&phc->sink->selected_sfd->socket, p->s.s, p->s.len, &phc->sink->endpoint);
-
-		codec_packet_free(p);
-
-		if (ret == -1)
-			break;
-	}
-
-	mutex_unlock(&phc->sink->out_lock);
-
-	if (ret == -1) {
-		ret = -errno;
-                ilog(LOG_DEBUG,"Error when sending message. Error: %s",strerror(errno));
-		atomic64_inc(&phc->mp.stream->stats.errors);
-		atomic64_inc(&rtpe_statsps.errors);
-		goto out;
+	if (async) {
+		if (handler_ret >= 0)
+			media_packet_queue_transcode(phc);
 	}
+	else
+		media_packet_forward(phc, handler_ret);
 
 drop:
 	ret = 0;
@@ -1707,8 +2264,8 @@ drop:
 	atomic64_inc(&phc->mp.stream->stats.packets);
 	atomic64_add(&phc->mp.stream->stats.bytes, phc->s.len);
 	atomic64_set(&phc->mp.stream->last_packet, rtpe_now.tv_sec);
-	atomic64_inc(&rtpe_statsps.packets);
-	atomic64_add(&rtpe_statsps.bytes, phc->s.len);
+	thread_stats_inc(packets);
+	thread_stats_add(bytes, phc->s.len);
 
 out:
 	if (phc->unkernelize) {
@@ -1717,8 +2274,6 @@ out:
 		stream_unconfirm(phc->mp.stream->rtcp_sink);
 	}
 
-	rwlock_unlock_r(&phc->mp.call->master_lock);
-
 	g_queue_clear_full(&phc->mp.packets_out, codec_packet_free);
 
 	if (phc->mp.ssrc_in) {
@@ -1736,8 +2291,10 @@ out:
 
 static void stream_fd_readable(int fd, void *p, uintptr_t u) {
 	struct stream_fd *sfd = p;
-	char buf[RTP_BUFFER_SIZE];
-	int ret, iters;
+	char buf[MAX_RECV_BATCH][RTP_BUFFER_SIZE];
+	struct socket_mmsg mm[MAX_RECV_BATCH];
+	struct send_batch sb;
+	int ret, iters, i, num;
 	int update = 0;
 	struct call *ca;
 
@@ -1746,7 +2303,9 @@ static void stream_fd_readable(int fd, void *p, uintptr_t u) {
 
 	log_info_stream_fd(sfd);
 
-	for (iters = 0; ; iters++) {
+	sb.num = 0;
+
+	for (iters = 0; ; iters += num) {
 #if MAX_RECV_ITERS
 		if (iters >= MAX_RECV_ITERS) {
 			ilog(LOG_ERROR, "Too many packets in UDP receive queue (more than %d), "
@@ -1755,14 +2314,15 @@ static void stream_fd_readable(int fd, void *p, uintptr_t u) {
 		}
 #endif
 
-		struct packet_handler_ctx phc;
-		ZERO(phc);
-		phc.mp.sfd = sfd;
+		for (i = 0; i < MAX_RECV_BATCH; i++) {
+			mm[i].buf = buf[i] + RTP_BUFFER_HEAD_ROOM;
+			mm[i].len = MAX_RTP_PACKET_SIZE;
+		}
 
-		ret = socket_recvfrom_ts(&sfd->socket, buf + RTP_BUFFER_HEAD_ROOM, MAX_RTP_PACKET_SIZE,
-				&phc.mp.fsin, &phc.mp.tv);
+		num = socket_recvmmsg_ts(&sfd->socket, mm, MAX_RECV_BATCH);
 
-		if (ret < 0) {
+		if (num < 0) {
+			num = 0;
 			if (errno == EINTR)
 				continue;
 			if (errno == EAGAIN || errno == EWOULDBLOCK)
@@ -1770,15 +2330,38 @@ static void stream_fd_readable(int fd, void *p, uintptr_t u) {
 			stream_fd_closed(fd, sfd, 0);
 			goto done;
 		}
-		if (ret >= MAX_RTP_PACKET_SIZE)
-			ilog(LOG_WARNING, "UDP packet possibly truncated");
 
-		str_init_len(&phc.s, buf + RTP_BUFFER_HEAD_ROOM, ret);
-		ret = stream_packet(&phc);
-		if (G_UNLIKELY(ret < 0))
-			ilog(LOG_WARNING, "Write error on media socket: %s", strerror(-ret));
-		else if (phc.update)
-			update = 1;
+		// process the entire batch under one lock
+		rwlock_lock_r(&sfd->call->master_lock);
+
+		for (i = 0; i < num; i++) {
+			struct packet_handler_ctx phc;
+			ZERO(phc);
+			phc.mp.sfd = sfd;
+			phc.send_batch = &sb;
+			phc.mp.fsin = mm[i].ep;
+			phc.mp.tv = mm[i].tv;
+
+			if (mm[i].len >= MAX_RTP_PACKET_SIZE)
+				ilog(LOG_WARNING, "UDP packet possibly truncated");
+
+			str_init_len(&phc.s, mm[i].buf, mm[i].len);
+			ret = stream_packet(&phc);
+			if (G_UNLIKELY(ret < 0))
+				ilog(LOG_WARNING, "Write error on media socket: %s", strerror(-ret));
+			else if (phc.update)
+				update = 1;
+		}
+
+		send_batch_flush(&sb);
+		recording_flush_packets();
+
+		rwlock_unlock_r(&sfd->call->master_lock);
+
+		// a short batch means the receive queue has been drained. any packet
+		// arriving after this triggers a new edge on the poller
+		if (num < MAX_RECV_BATCH)
+			break;
 	}
 
 out:
@@ -1804,6 +2387,14 @@ static void stream_fd_free(void *p) {
 	obj_put(f->call);
 }
 
+// RTP and RTCP ports are allocated as consecutive even/odd pairs, so both
+// sockets of a stream end up on the same media poller and thus the same thread
+static struct poller *stream_fd_poller(const socket_t *sock) {
+	if (!rtpe_num_media_pollers)
+		return rtpe_poller;
+	return rtpe_media_pollers[(sock->local.port >> 1) % rtpe_num_media_pollers];
+}
+
 struct stream_fd *stream_fd_new(socket_t *fd, struct call *call, const struct local_intf *lif) {
 	struct stream_fd *sfd;
 	struct poller_item pi;
@@ -1813,6 +2404,7 @@ struct stream_fd *stream_fd_new(socket_t *fd, struct call *call, const struct lo
 	sfd->socket = *fd;
 	sfd->call = obj_get(call);
 	sfd->local_intf = lif;
+	sfd->poller = stream_fd_poller(fd);
 	g_queue_push_tail(&call->stream_fds, sfd); /* hand over ref */
 	g_slice_free1(sizeof(*fd), fd); /* moved into sfd, thus free */
 
@@ -1824,7 +2416,7 @@ struct stream_fd *stream_fd_new(socket_t *fd, struct call *call, const struct lo
 	pi.readable = stream_fd_readable;
 	pi.closed = stream_fd_closed;
 
-	if (poller_add_item(rtpe_poller, &pi))
+	if (poller_add_item(sfd->poller, &pi))
 		ilog(LOG_ERR, "Failed to add stream_fd to poller");
 
 	return sfd;
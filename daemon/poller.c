@@ -12,6 +12,7 @@
 #include <sys/epoll.h>
 #include <glib.h>
 #include <sys/time.h>
+#include <limits.h>
 
 #include "aux.h"
 #include "obj.h"
@@ -19,6 +20,22 @@
 
 
 
+/* hashed hierarchical timer wheel: 4 levels of 256 slots each, with 1 ms resolution
+ * on the lowest level. covers 2^32 ms (~49 days) before timers are re-hashed. */
+#define TW_LEVELS		4
+#define TW_BITS			8
+#define TW_SIZE			(1 << TW_BITS)
+#define TW_MASK			(TW_SIZE - 1)
+
+struct timer_wheel {
+	mutex_t				lock;
+	cond_t				cond;
+	long long			now; /* next tick to be processed, in ms */
+	long long			next; /* no later than the earliest armed timer, LLONG_MAX if none */
+	unsigned int			count;
+	struct poller_timer		*slots[TW_LEVELS][TW_SIZE];
+};
+
 struct timer_item {
 	struct obj			obj;
 	void				(*func)(void *);
@@ -38,12 +55,15 @@ struct poller {
 	mutex_t				lock;
 	struct poller_item_int		**items;
 	unsigned int			items_size;
+	cond_t				items_cond; /* signalled when the first item is added */
 
 	mutex_t				timers_lock;
 	GSList				*timers;
 	mutex_t				timers_add_del_lock; /* nested below timers_lock */
 	GSList				*timers_add;
 	GSList				*timers_del;
+
+	struct timer_wheel		wheel;
 };
 
 
@@ -60,8 +80,13 @@ struct poller *poller_new(void) {
 	if (p->fd == -1)
 		abort();
 	mutex_init(&p->lock);
+	cond_init(&p->items_cond);
 	mutex_init(&p->timers_lock);
 	mutex_init(&p->timers_add_del_lock);
+	mutex_init(&p->wheel.lock);
+	cond_init(&p->wheel.cond);
+	p->wheel.now = timeval_ms(&rtpe_now);
+	p->wheel.next = LLONG_MAX;
 
 	return p;
 }
@@ -119,6 +144,9 @@ static int __poller_add_item(struct poller *p, struct poller_item *i, int has_lo
 	if (epoll_ctl(p->fd, EPOLL_CTL_ADD, i->fd, &e))
 		abort();
 
+	if (!p->items_size)
+		cond_broadcast(&p->items_cond);
+
 	if (i->fd >= p->items_size) {
 		u = p->items_size;
 		p->items_size = i->fd + 1;
@@ -476,31 +504,288 @@ int poller_add_timer(struct poller *p, void (*f)(void *), struct obj *o) {
 	return poller_timer_link(p, &p->timers_add, f, o);
 }
 
+
+
+static void tw_link(struct poller_timer **head, struct poller_timer *t) {
+	t->next = *head;
+	if (t->next)
+		t->next->pprev = &t->next;
+	t->pprev = head;
+	*head = t;
+}
+
+static void tw_unlink(struct poller_timer *t) {
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+/* wheel->lock must be held. the level is determined by the highest bits in which the
+ * expiry time differs from the current time, so that the slot is not visited again
+ * before its timers are due. returns the tick at which the slot will be visited */
+static long long tw_insert(struct timer_wheel *w, struct poller_timer *t) {
+	long long exp = t->expires;
+	unsigned int level;
+
+	if (exp < w->now)
+		exp = w->now;
+
+	for (level = 0; level < TW_LEVELS - 1; level++) {
+		if ((exp >> (TW_BITS * (level + 1))) == (w->now >> (TW_BITS * (level + 1))))
+			break;
+	}
+
+	if (level == TW_LEVELS - 1
+			&& (exp >> (TW_BITS * level)) - (w->now >> (TW_BITS * level)) >= TW_SIZE)
+	{
+		/* beyond the range of the wheel: park in the last top level slot to be
+		 * visited before the expiry time, and re-hash from there */
+		exp = ((w->now >> (TW_BITS * level)) + TW_SIZE - 1) << (TW_BITS * level);
+	}
+
+	tw_link(&w->slots[level][(exp >> (TW_BITS * level)) & TW_MASK], t);
+
+	/* tick at which this slot is visited */
+	return (exp >> (TW_BITS * level)) << (TW_BITS * level);
+}
+
+/* wheel->lock must be held. moves timers from higher level slots due in the current
+ * tick down to the lower levels */
+static void tw_cascade(struct timer_wheel *w) {
+	int level;
+	struct poller_timer *t, *list;
+
+	for (level = TW_LEVELS - 1; level > 0; level--) {
+		if ((w->now & ((1LL << (TW_BITS * level)) - 1)))
+			continue;
+		list = w->slots[level][(w->now >> (TW_BITS * level)) & TW_MASK];
+		w->slots[level][(w->now >> (TW_BITS * level)) & TW_MASK] = NULL;
+		while ((t = list)) {
+			list = t->next;
+			t->next = NULL;
+			tw_insert(w, t);
+		}
+	}
+}
+
+/* wheel->lock must be held. finds the first occupied slot. timers on a level are
+ * all due before those on the next level up, and a higher level slot is due no
+ * earlier than the tick at which it's cascaded */
+static long long tw_next_expiry(struct timer_wheel *w) {
+	unsigned int level, i, cur;
+	long long base;
+
+	for (level = 0; level < TW_LEVELS; level++) {
+		base = w->now >> (TW_BITS * level);
+		cur = base & TW_MASK;
+		/* the current slot of a higher level has already been cascaded,
+		 * unless we're right at its first tick */
+		i = (level && (w->now & ((1LL << (TW_BITS * level)) - 1))) ? 1 : 0;
+		for (; i < TW_SIZE; i++) {
+			if (!w->slots[level][(cur + i) & TW_MASK])
+				continue;
+			if (!level)
+				return w->now + i;
+			return (base + i) << (TW_BITS * level);
+		}
+	}
+
+	return LLONG_MAX;
+}
+
+/* wheel->lock must be held. wakes up the timer thread if a slot is due earlier
+ * than what it's currently sleeping for */
+static void tw_next_update(struct timer_wheel *w, long long tick) {
+	if (tick >= w->next)
+		return;
+	w->next = tick;
+	cond_signal(&w->cond);
+}
+
+/* processes all ticks up to and including `until`. timer callbacks are run without
+ * holding any locks. a timer may still fire after poller_timer_disarm() if both happen
+ * concurrently. */
+static void poller_timer_wheel_run(struct poller *p, long long until) {
+	struct timer_wheel *w = &p->wheel;
+	struct poller_timer *t, **slot;
+	void (*func)(void *);
+	struct obj *o;
+
+	mutex_lock(&w->lock);
+
+	while (w->now <= until) {
+		if (!w->count) {
+			/* nothing to do, fast forward */
+			w->now = until + 1;
+			break;
+		}
+		/* skip ahead to the next occupied slot */
+		if (w->next < w->now)
+			w->next = tw_next_expiry(w);
+		if (w->next > until) {
+			w->now = until + 1;
+			break;
+		}
+		w->now = w->next;
+
+		tw_cascade(w);
+
+		slot = &w->slots[0][w->now & TW_MASK];
+		while ((t = *slot)) {
+			tw_unlink(t);
+			w->count--;
+			func = t->func;
+			o = t->obj;
+			mutex_unlock(&w->lock);
+
+			func(o);
+			if (o)
+				obj_put_o(o);
+
+			mutex_lock(&w->lock);
+		}
+
+		w->now++;
+	}
+
+	if (!w->count)
+		w->next = LLONG_MAX;
+	else if (w->next < w->now)
+		w->next = tw_next_expiry(w);
+
+	mutex_unlock(&w->lock);
+}
+
+void poller_timer_init(struct poller_timer *t, void (*f)(void *), struct obj *o) {
+	ZERO(*t);
+	t->func = f;
+	t->obj = o;
+}
+
+/* arms the timer to fire at the given absolute time, or re-arms it if already armed */
+void poller_timer_arm(struct poller *p, struct poller_timer *t, const struct timeval *tv) {
+	poller_timer_arm_ms(p, t, timeval_ms(tv));
+}
+
+void poller_timer_arm_ms(struct poller *p, struct poller_timer *t, long long expires) {
+	struct timer_wheel *w = &p->wheel;
+
+	mutex_lock(&w->lock);
+
+	if (t->pprev)
+		tw_unlink(t);
+	else {
+		if (t->obj)
+			obj_hold_o(t->obj);
+		w->count++;
+	}
+
+	t->expires = expires;
+	tw_next_update(w, tw_insert(w, t));
+
+	mutex_unlock(&w->lock);
+}
+
+/* like poller_timer_arm_ms(), but leaves the timer alone if it's already armed to fire
+ * no later than the given time */
+void poller_timer_advance_ms(struct poller *p, struct poller_timer *t, long long expires) {
+	struct timer_wheel *w = &p->wheel;
+
+	mutex_lock(&w->lock);
+
+	if (t->pprev) {
+		if (t->expires <= expires)
+			goto out;
+		tw_unlink(t);
+	}
+	else {
+		if (t->obj)
+			obj_hold_o(t->obj);
+		w->count++;
+	}
+
+	t->expires = expires;
+	tw_next_update(w, tw_insert(w, t));
+
+out:
+	mutex_unlock(&w->lock);
+}
+
+void poller_timer_disarm(struct poller *p, struct poller_timer *t) {
+	struct timer_wheel *w = &p->wheel;
+	struct obj *o = NULL;
+
+	mutex_lock(&w->lock);
+
+	if (t->pprev) {
+		tw_unlink(t);
+		w->count--;
+		o = t->obj;
+	}
+
+	mutex_unlock(&w->lock);
+
+	if (o)
+		obj_put_o(o);
+}
+
 /* run in thread separate from poller_poll() */
 void poller_timer_loop(void *d) {
 	struct poller *p = d;
 	struct timeval tv;
-	int wt;
+	long long wt;
+	time_t last_sec = 0;
 
 	while (!rtpe_shutdown) {
 		gettimeofday(&tv, NULL);
-		if (tv.tv_sec != rtpe_now.tv_sec)
+		if (tv.tv_sec != last_sec)
 			goto now;
 
+		rtpe_now = tv;
+		poller_timer_wheel_run(p, timeval_ms(&tv));
+
+		/* sleep until the next second, at most 100 ms, or until the next
+		 * millisecond timer is due. arming an earlier one wakes us up */
+		mutex_lock(&p->wheel.lock);
 		wt = 1000000 - tv.tv_usec;
 		wt = MIN(wt, 100000);
-		usleep(wt);
+		if (p->wheel.next != LLONG_MAX)
+			wt = MIN(wt, p->wheel.next * 1000 - (tv.tv_sec * 1000000LL + tv.tv_usec));
+		if (wt <= 0) {
+			mutex_unlock(&p->wheel.lock);
+			continue;
+		}
+		timeval_add_usec(&tv, wt);
+		cond_timedwait(&p->wheel.cond, &p->wheel.lock, &tv);
+		mutex_unlock(&p->wheel.lock);
 		continue;
 
 now:
 		gettimeofday(&rtpe_now, NULL);
+		last_sec = rtpe_now.tv_sec;
 		poller_timers_run(p);
 	}
 }
 
 void poller_loop(void *d) {
 	struct poller *p = d;
+	struct timeval tv;
+	int ret;
+
+	while (!rtpe_shutdown) {
+		ret = poller_poll(p, 100);
+		if (ret >= 0)
+			continue;
 
-	while (!rtpe_shutdown)
-		poller_poll(p, 100);
+		// media pollers may not have any items yet, wait for the first one
+		mutex_lock(&p->lock);
+		if (!p->items_size) {
+			gettimeofday(&tv, NULL);
+			timeval_add_usec(&tv, 100000);
+			cond_timedwait(&p->items_cond, &p->lock, &tv);
+		}
+		mutex_unlock(&p->lock);
+	}
 }
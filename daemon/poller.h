@@ -29,6 +29,17 @@ struct poller_item {
 
 struct poller;
 
+/* millisecond resolution timer, to be embedded in the object it belongs to. must be
+ * initialised with poller_timer_init() before use. a reference to `obj` is held while the
+ * timer is armed, and `func` is called with `obj` as argument from the timer thread. */
+struct poller_timer {
+	struct poller_timer		*next;
+	struct poller_timer		**pprev; /* NULL if not armed */
+	long long			expires; /* ms */
+	void				(*func)(void *);
+	struct obj			*obj;
+};
+
 
 struct poller *poller_new(void);
 int poller_add_item(struct poller *, struct poller_item *);
@@ -45,5 +56,11 @@ void poller_loop(void *);
 int poller_add_timer(struct poller *, void (*)(void *), struct obj *);
 int poller_del_timer(struct poller *, void (*)(void *), struct obj *);
 
+void poller_timer_init(struct poller_timer *, void (*)(void *), struct obj *);
+void poller_timer_arm(struct poller *, struct poller_timer *, const struct timeval *);
+void poller_timer_arm_ms(struct poller *, struct poller_timer *, long long);
+void poller_timer_advance_ms(struct poller *, struct poller_timer *, long long);
+void poller_timer_disarm(struct poller *, struct poller_timer *);
+
 
 #endif
@@ -12,6 +12,7 @@
 #include <unistd.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <fcntl.h>
 
 #include "xt_RTPENGINE.h"
 
@@ -20,6 +21,14 @@
 #include "bencode.h"
 #include "rtplib.h"
 #include "cdr.h"
+#include "statistics.h"
+
+
+
+#define PCAP_BUFFER_MAX		(1024 * 1024) // per call, further packets are dropped
+#define PCAP_WRITE_THRES	(64 * 1024) // wake up the writer early
+#define PCAP_WRITE_INTERVAL	200000 // microseconds
+#define PROC_BATCH_SIZE		(16 * 1024) // packets submitted to the kernel in one write
 
 
 
@@ -29,6 +38,23 @@ struct pcap_format {
 	void (*header)(unsigned char *, struct packet_stream *);
 };
 
+// pcap file format, in host byte order
+struct pcap_file_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+struct pcap_rec_hdr {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t caplen;
+	uint32_t len;
+};
+
 
 
 static int check_main_spool_dir(const char *spoolpath);
@@ -42,6 +68,7 @@ static void sdp_after_pcap(struct recording *, GString *str, struct call_monolog
 static void dump_packet_pcap(struct recording *recording, struct packet_stream *sink, const str *s);
 static void finish_pcap(struct call *);
 static void response_pcap(struct recording *, bencode_item_t *);
+static void pcap_writer_loop(void *);
 
 // proc methods
 static void proc_init(struct call *);
@@ -50,6 +77,7 @@ static void sdp_after_proc(struct recording *, GString *str, struct call_monolog
 static void meta_chunk_proc(struct recording *, const char *, const str *);
 static void finish_proc(struct call *);
 static void dump_packet_proc(struct recording *recording, struct packet_stream *sink, const str *s);
+static void flush_packets_proc(void);
 static void init_stream_proc(struct packet_stream *);
 static void setup_stream_proc(struct packet_stream *);
 static void setup_media_proc(struct call_media *);
@@ -69,6 +97,7 @@ static const struct recording_method methods[] = {
 		.dump_packet = dump_packet_pcap,
 		.finish = finish_pcap,
 		.response = response_pcap,
+		.writer_loop = pcap_writer_loop,
 	},
 	{
 		.name = "proc",
@@ -79,6 +108,7 @@ static const struct recording_method methods[] = {
 		.sdp_after = sdp_after_proc,
 		.meta_chunk = meta_chunk_proc,
 		.dump_packet = dump_packet_proc,
+		.flush_packets = flush_packets_proc,
 		.finish = finish_proc,
 		.init_stream_struct = init_stream_proc,
 		.setup_stream = setup_stream_proc,
@@ -104,6 +134,11 @@ static char *spooldir = NULL;
 const struct recording_method *selected_recording_method;
 static const struct pcap_format *pcap_format;
 
+// recordings with packets waiting to be written
+static mutex_t pcap_write_lock = MUTEX_STATIC_INIT;
+static cond_t pcap_write_cond = COND_STATIC_INIT;
+static GQueue pcap_write_queue = G_QUEUE_INIT;
+
 
 
 /**
@@ -291,12 +326,16 @@ static void pcap_init(struct call *call) {
 
 	// Wireshark starts at packet index 1, so we start there, too
 	recording->u.pcap.packet_num = 1;
+	recording->u.pcap.recording_fd = -1;
 	mutex_init(&recording->u.pcap.recording_lock);
+	mutex_init(&recording->u.pcap.write_lock);
+	recording->u.pcap.buf = g_string_new("");
+	recording->u.pcap.wbuf = g_string_new("");
 	meta_setup_file(recording);
 
 	// set up pcap file
 	char *pcap_path = recording_setup_file(recording);
-	if (pcap_path != NULL && recording->u.pcap.recording_pdumper != NULL
+	if (pcap_path != NULL && recording->u.pcap.recording_fd != -1
 	    && recording->u.pcap.meta_fp) {
 		// Write the location of the PCAP file to the metadata file
 		fprintf(recording->u.pcap.meta_fp, "%s\n\n", pcap_path);
@@ -439,40 +478,124 @@ static int pcap_meta_finish_file(struct call *call) {
  */
 static char *recording_setup_file(struct recording *recording) {
 	char *recording_path = NULL;
+	struct pcap_file_hdr fh;
 
 	if (!spooldir)
 		return NULL;
-	if (recording->u.pcap.recording_pd || recording->u.pcap.recording_pdumper)
+	if (recording->u.pcap.recording_path)
 		return NULL;
 
 	recording_path = file_path_str(recording->meta_prefix, "/pcaps/", ".pcap");
 	recording->u.pcap.recording_path = recording_path;
 
-	recording->u.pcap.recording_pd = pcap_open_dead(pcap_format->linktype, 65535);
-	recording->u.pcap.recording_pdumper = pcap_dump_open(recording->u.pcap.recording_pd, recording_path);
-	if (recording->u.pcap.recording_pdumper == NULL) {
-		pcap_close(recording->u.pcap.recording_pd);
-		recording->u.pcap.recording_pd = NULL;
+	recording->u.pcap.recording_fd = open(recording_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (recording->u.pcap.recording_fd == -1) {
 		ilog(LOG_INFO, "Failed to write recording file: %s", recording_path);
-	} else {
-		ilog(LOG_INFO, "Writing recording file: %s", recording_path);
+		return recording_path;
 	}
 
+	ilog(LOG_INFO, "Writing recording file: %s", recording_path);
+
+	// the file header goes out with the first packets
+	ZERO(fh);
+	fh.magic = 0xa1b2c3d4;
+	fh.version_major = 2;
+	fh.version_minor = 4;
+	fh.snaplen = 65535;
+	fh.linktype = pcap_format->linktype;
+	g_string_append_len(recording->u.pcap.buf, (void *) &fh, sizeof(fh));
+
 	return recording_path;
 }
 
+static void pcap_write_buf(struct recording *recording, GString *buf) {
+	size_t pos = 0;
+	ssize_t ret;
+
+	while (pos < buf->len) {
+		ret = write(recording->u.pcap.recording_fd, buf->str + pos, buf->len - pos);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			ilog(LOG_ERR, "Error writing to recording file %s: %s",
+					recording->u.pcap.recording_path, strerror(errno));
+			break;
+		}
+		pos += ret;
+	}
+
+	g_string_truncate(buf, 0);
+}
+
 /**
- * Flushes PCAP file, closes the dumper and descriptors, and frees object memory.
+ * Writes out everything still buffered, closes the file, and frees object memory.
  */
 static void pcap_recording_finish_file(struct recording *recording) {
-	if (recording->u.pcap.recording_pdumper != NULL) {
-		pcap_dump_flush(recording->u.pcap.recording_pdumper);
-		pcap_dump_close(recording->u.pcap.recording_pdumper);
-		free(recording->u.pcap.recording_path);
+	// make sure the writer thread is done with us
+	mutex_lock(&pcap_write_lock);
+	if (recording->u.pcap.queued)
+		g_queue_remove(&pcap_write_queue, recording);
+	mutex_unlock(&pcap_write_lock);
+	mutex_lock(&recording->u.pcap.write_lock);
+	mutex_unlock(&recording->u.pcap.write_lock);
+
+	if (recording->u.pcap.recording_fd != -1) {
+		pcap_write_buf(recording, recording->u.pcap.buf);
+		close(recording->u.pcap.recording_fd);
+		recording->u.pcap.recording_fd = -1;
 	}
-	if (recording->u.pcap.recording_pd != NULL) {
-		pcap_close(recording->u.pcap.recording_pd);
+	if (recording->u.pcap.dropped)
+		ilog(LOG_WARN, "Dropped %" PRIu64 " packets from recording file %s as it couldn't "
+				"be written fast enough",
+				recording->u.pcap.dropped, recording->u.pcap.recording_path);
+
+	free(recording->u.pcap.recording_path);
+	recording->u.pcap.recording_path = NULL;
+	g_string_free(recording->u.pcap.buf, TRUE);
+	g_string_free(recording->u.pcap.wbuf, TRUE);
+	mutex_destroy(&recording->u.pcap.write_lock);
+}
+
+/**
+ * Takes recordings off the write queue and writes out their buffered packets.
+ * The media threads only ever append to the buffers in memory.
+ */
+static void pcap_writer_loop(void *p) {
+	struct recording *recording;
+	struct timeval tv;
+	GString *buf;
+
+	mutex_lock(&pcap_write_lock);
+
+	while (!rtpe_shutdown) {
+		recording = g_queue_pop_head(&pcap_write_queue);
+		if (!recording) {
+			gettimeofday(&tv, NULL);
+			timeval_add_usec(&tv, PCAP_WRITE_INTERVAL);
+			cond_timedwait(&pcap_write_cond, &pcap_write_lock, &tv);
+			continue;
+		}
+
+		// taken before the queue lock is released, so that the recording
+		// can't go away while we're writing
+		mutex_lock(&recording->u.pcap.write_lock);
+		mutex_unlock(&pcap_write_lock);
+
+		mutex_lock(&recording->u.pcap.recording_lock);
+		buf = recording->u.pcap.buf;
+		recording->u.pcap.buf = recording->u.pcap.wbuf;
+		recording->u.pcap.wbuf = buf;
+		recording->u.pcap.queued = 0;
+		mutex_unlock(&recording->u.pcap.recording_lock);
+
+		pcap_write_buf(recording, buf);
+
+		mutex_unlock(&recording->u.pcap.write_lock);
+
+		mutex_lock(&pcap_write_lock);
 	}
+
+	mutex_unlock(&pcap_write_lock);
 }
 
 // "out" must be at least inp->len + MAX_PACKET_HEADER_LEN bytes
@@ -498,34 +621,59 @@ static void pcap_eth_header(unsigned char *pkt, struct packet_stream *stream) {
 }
 
 /**
- * Write out a PCAP packet with payload string.
+ * Append a PCAP packet with payload string to the recording's buffer.
  * A fair amount extraneous of packet data is spoofed.
+ * Returns 0 if the packet was added.
  */
-static void stream_pcap_dump(pcap_dumper_t *pdumper, struct packet_stream *stream, const str *s) {
-	if (!pdumper)
-		return;
+static int stream_pcap_dump(struct recording *recording, struct packet_stream *stream, const str *s) {
+	GString *buf = recording->u.pcap.buf;
+	unsigned int max_len = sizeof(struct pcap_rec_hdr) + s->len + MAX_PACKET_HEADER_LEN
+		+ pcap_format->headerlen;
+	gsize pos = buf->len;
+
+	if (G_UNLIKELY(pos + max_len > PCAP_BUFFER_MAX)) {
+		recording->u.pcap.dropped++;
+		atomic64_inc(&rtpe_totalstats.total_recording_dropped_packets);
+		return -1;
+	}
 
-	unsigned char pkt[s->len + MAX_PACKET_HEADER_LEN + pcap_format->headerlen];
+	g_string_set_size(buf, pos + max_len);
+	unsigned char *pkt = (unsigned char *) buf->str + pos + sizeof(struct pcap_rec_hdr);
 	unsigned int pkt_len = fake_ip_header(pkt + pcap_format->headerlen, stream, s) + pcap_format->headerlen;
 	if (pcap_format->header)
 		pcap_format->header(pkt, stream);
 
 	// Set up PCAP packet header
-	struct pcap_pkthdr header;
-	ZERO(header);
-	header.ts = rtpe_now;
+	struct pcap_rec_hdr header;
+	header.ts_sec = rtpe_now.tv_sec;
+	header.ts_usec = rtpe_now.tv_usec;
 	header.caplen = pkt_len;
 	header.len = pkt_len;
+	memcpy(buf->str + pos, &header, sizeof(header));
 
-	// Write the packet to the PCAP file
-	// Casting quiets compiler warning.
-	pcap_dump((unsigned char *)pdumper, &header, pkt);
+	g_string_set_size(buf, pos + sizeof(header) + pkt_len);
+	return 0;
 }
 
 static void dump_packet_pcap(struct recording *recording, struct packet_stream *stream, const str *s) {
 	mutex_lock(&recording->u.pcap.recording_lock);
-	stream_pcap_dump(recording->u.pcap.recording_pdumper, stream, s);
+
+	if (recording->u.pcap.recording_fd == -1 || stream_pcap_dump(recording, stream, s))
+		goto out;
+
 	recording->u.pcap.packet_num++;
+
+	if (!recording->u.pcap.queued || recording->u.pcap.buf->len >= PCAP_WRITE_THRES) {
+		mutex_lock(&pcap_write_lock);
+		if (!recording->u.pcap.queued)
+			g_queue_push_tail(&pcap_write_queue, recording);
+		recording->u.pcap.queued = 1;
+		if (recording->u.pcap.buf->len >= PCAP_WRITE_THRES)
+			cond_signal(&pcap_write_cond);
+		mutex_unlock(&pcap_write_lock);
+	}
+
+out:
 	mutex_unlock(&recording->u.pcap.recording_lock);
 }
 
@@ -738,25 +886,52 @@ static void setup_media_proc(struct call_media *media) {
 
 
 
+// packets are collected into one REMG_PACKETS message per thread and submitted
+// to the kernel through flush_packets_proc() at the end of each receive batch
+static __thread unsigned char *proc_batch_buf;
+static __thread unsigned int proc_batch_len;
+
+static void flush_packets_proc(void) {
+	if (!proc_batch_len)
+		return;
+
+	int ret = write(kernel.fd, proc_batch_buf, proc_batch_len);
+	if (ret < 0)
+		ilog(LOG_ERR, "Failed to submit packets to kernel intercepted stream: %s", strerror(errno));
+
+	proc_batch_len = 0;
+}
+
 static void dump_packet_proc(struct recording *recording, struct packet_stream *stream, const str *s) {
 	if (stream->recording.u.proc.stream_idx == UNINIT_IDX)
 		return;
 
 	struct rtpengine_message *remsg;
-	unsigned char pkt[sizeof(*remsg) + s->len + MAX_PACKET_HEADER_LEN];
-	remsg = (void *) pkt;
+	struct rtpengine_packet_hdr *hdr;
+	unsigned int max_len = RTPENGINE_PACKET_SIZE(s->len + MAX_PACKET_HEADER_LEN);
 
-	ZERO(*remsg);
-	remsg->cmd = REMG_PACKET;
-	//remsg->u.packet.call_idx = stream->call->recording->u.proc.call_idx; // unused
-	remsg->u.packet.stream_idx = stream->recording.u.proc.stream_idx;
+	if (G_UNLIKELY(sizeof(*remsg) + max_len > PROC_BATCH_SIZE)) {
+		ilog(LOG_ERR, "Packet too large to submit to kernel intercepted stream (%i bytes)", s->len);
+		return;
+	}
 
-	unsigned int pkt_len = fake_ip_header(remsg->data, stream, s);
-	pkt_len += sizeof(*remsg);
+	if (!proc_batch_buf)
+		proc_batch_buf = g_malloc(PROC_BATCH_SIZE);
+	if (proc_batch_len + max_len > PROC_BATCH_SIZE)
+		flush_packets_proc();
 
-	int ret = write(kernel.fd, pkt, pkt_len);
-	if (ret < 0)
-		ilog(LOG_ERR, "Failed to submit packet to kernel intercepted stream: %s", strerror(errno));
+	if (!proc_batch_len) {
+		remsg = (void *) proc_batch_buf;
+		ZERO(*remsg);
+		remsg->cmd = REMG_PACKETS;
+		proc_batch_len = sizeof(*remsg);
+	}
+
+	hdr = (void *) (proc_batch_buf + proc_batch_len);
+	hdr->stream_idx = stream->recording.u.proc.stream_idx;
+	hdr->len = fake_ip_header((unsigned char *) (hdr + 1), stream, s);
+
+	proc_batch_len += RTPENGINE_PACKET_SIZE(hdr->len);
 }
 
 static void kernel_info_proc(struct packet_stream *stream, struct rtpengine_target_info *reti) {
@@ -32,6 +32,7 @@
 #include "ssrc.h"
 #include "main.h"
 #include "codec.h"
+#include "redis_doc.h"
 
 struct redis		*rtpe_redis;
 struct redis		*rtpe_redis_write;
@@ -649,6 +650,9 @@ struct redis *redis_new(const endpoint_t *ep, int db, const char *auth,
 	r->restore_tick = 0;
 	r->consecutive_errors = 0;
 	mutex_init(&r->lock);
+	mutex_init(&r->write_lock);
+	cond_init(&r->write_cond);
+	g_queue_init(&r->write_queue);
 
 	if (redis_connect(r, 10)) {
 		if (r->no_redis_required) {
@@ -667,6 +671,7 @@ struct redis *redis_new(const endpoint_t *ep, int db, const char *auth,
 
 err:
 	mutex_destroy(&r->lock);
+	mutex_destroy(&r->write_lock);
 	g_slice_free1(sizeof(*r), r);
 	return NULL;
 }
@@ -676,6 +681,7 @@ static void redis_close(struct redis *r) {
 	if (r->ctx)
 		redisFree(r->ctx);
 	mutex_destroy(&r->lock);
+	mutex_destroy(&r->write_lock);
 	g_slice_free1(sizeof(*r), r);
 }
 
@@ -747,17 +753,7 @@ static int redis_check_conn(struct redis *r) {
 	return REDIS_STATE_RECONNECTED;
 }
 
-/* called with r->lock held and c->master_lock held */
-static void redis_delete_call_json(struct call *c, struct redis *r) {
-	redis_pipe(r, "DEL "PB"", STR(&c->callid));
-	redis_consume(r);
-}
 
-INLINE void json_builder_add_string_value_uri_enc(JsonBuilder *builder, const char* tmp, int len) {
-	char enc[len * 3 + 1];
-	str_uri_encode_len(enc, tmp, len);
-	json_builder_add_string_value(builder,enc);
-}
 INLINE str *json_reader_get_string_value_uri_enc(JsonReader *root_reader) {
 	const char *s = json_reader_get_string_value(root_reader);
 	if (!s)
@@ -776,12 +772,127 @@ INLINE long long json_reader_get_ll(JsonReader *root_reader, const char *key) {
 	return r;
 }
 
+struct redis_doc {
+	JsonReader		*json;		// NULL for binary data
+	struct redis_bin_doc	bin;
+};
+
+/* the binary format is used in place, so keys and values point into the redis reply */
+static int bin_get_hash(struct redis_hash *out, const char *key, struct redis_doc *doc) {
+	const struct redis_bin_node *node;
+	struct redis_bin_node val;
+	struct redis_bin_iter it;
+	unsigned int i;
+	str k;
+	int ret;
+
+	node = redis_bin_doc_get(&doc->bin, key);
+	if (!node || node->type != 'o') {
+		rlog(LOG_ERROR, "Could not read binary member: %s", key);
+		return -1;
+	}
+
+	out->ht = g_hash_table_new(g_str_hash, g_str_equal);
+	out->strs = malloc(sizeof(*out->strs) * node->count);
+
+	redis_bin_iter_init(&it, node);
+	for (i = 0; (ret = redis_bin_iter_next(&it, &k, &val)) == 1; i++) {
+		if (val.type != 's')
+			goto err;
+		out->strs[i] = val.s;
+		if (g_hash_table_insert_check(out->ht, k.s, &out->strs[i]) != TRUE) {
+			ilog(LOG_WARNING,"Key %s already exists", k.s);
+			goto err;
+		}
+	}
+	if (ret)
+		goto err;
+
+	return 0;
+
+err:
+	g_hash_table_destroy(out->ht);
+	free(out->strs);
+	return -1;
+}
+
+static int bin_build_list_cb(GQueue *q, const char *key, struct redis_list *list,
+		int (*cb)(str *, GQueue *, struct redis_list *, void *), void *ptr, struct redis_doc *doc)
+{
+	const struct redis_bin_node *node;
+	struct redis_bin_node val;
+	struct redis_bin_iter it;
+	int ret;
+
+	node = redis_bin_doc_get(&doc->bin, key);
+	if (!node || node->type != 'a') {
+		rlog(LOG_ERROR,"Key in binary data not found:%s",key);
+		return -1;
+	}
+
+	redis_bin_iter_init(&it, node);
+	while ((ret = redis_bin_iter_next(&it, NULL, &val)) == 1) {
+		if (val.type != 's') {
+			rlog(LOG_ERROR,"String in binary data not found.");
+			return -1;
+		}
+		if (cb(&val.s, q, list, ptr))
+			return -1;
+	}
+
+	return ret;
+}
+
+static long long bin_get_ll(const struct redis_bin_node *obj, const char *key) {
+	struct redis_bin_node val;
+	struct redis_bin_iter it;
+	str k;
+
+	redis_bin_iter_init(&it, obj);
+	while (redis_bin_iter_next(&it, &k, &val) == 1) {
+		if (val.type == 's' && !str_cmp(&k, key))
+			return strtoll(val.s.s, NULL, 10);
+	}
+	return -1;
+}
+
+static int bin_build_ssrc(struct call *c, struct redis_doc *doc) {
+	const struct redis_bin_node *node;
+	struct redis_bin_node obj;
+	struct redis_bin_iter it;
+	int ret;
+
+	node = redis_bin_doc_get(&doc->bin, "ssrc_table");
+	if (!node || node->type != 'a')
+		return -1;
+
+	redis_bin_iter_init(&it, node);
+	while ((ret = redis_bin_iter_next(&it, NULL, &obj)) == 1) {
+		if (obj.type != 'o')
+			return -1;
+
+		u_int32_t ssrc = bin_get_ll(&obj, "ssrc");
+		struct ssrc_entry_call *se = get_ssrc(ssrc, c->ssrc_hash);
+		se->input_ctx.srtp_index = bin_get_ll(&obj, "in_srtp_index");
+		se->input_ctx.srtcp_index = bin_get_ll(&obj, "in_srtcp_index");
+		se->input_ctx.payload_type = bin_get_ll(&obj, "in_payload_type");
+		se->output_ctx.srtp_index = bin_get_ll(&obj, "out_srtp_index");
+		se->output_ctx.srtcp_index = bin_get_ll(&obj, "out_srtcp_index");
+		se->output_ctx.payload_type = bin_get_ll(&obj, "out_payload_type");
+
+		obj_put(&se->h);
+	}
+
+	return ret;
+}
+
 static int json_get_hash(struct redis_hash *out,
-		const char *key, unsigned int id, JsonReader *root_reader)
+		const char *key, unsigned int id, struct redis_doc *doc)
 {
 	static unsigned int MAXKEYLENGTH = 512;
 	char key_concatted[MAXKEYLENGTH];
 	int rc=0;
+	JsonReader *root_reader = doc->json;
 
 	if (id == -1) {
 		rc = snprintf(key_concatted, MAXKEYLENGTH, "%s",key);
@@ -793,11 +904,15 @@ static int json_get_hash(struct redis_hash *out,
 		goto err;
 	}
 
+	if (!root_reader)
+		return bin_get_hash(out, key_concatted, doc);
+
 	if (!json_reader_read_member(root_reader, key_concatted)) {
 		rlog(LOG_ERROR, "Could not read json member: %s",key_concatted);
 		goto err;
 	}
 
+	out->strs = NULL;
 	out->ht = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
 	if (!out->ht)
 		goto err;
@@ -838,6 +953,7 @@ err:
 
 static void json_destroy_hash(struct redis_hash *rh) {
         g_hash_table_destroy(rh->ht);
+        free(rh->strs);
 }
 
 static void json_destroy_list(struct redis_list *rl) {
@@ -960,12 +1076,16 @@ static void *redis_list_get_ptr(struct redis_list *list, struct redis_hash *rh,
 
 static int json_build_list_cb(GQueue *q, struct call *c, const char *key,
 		unsigned int idx, struct redis_list *list,
-		int (*cb)(str *, GQueue *, struct redis_list *, void *), void *ptr, JsonReader *root_reader)
+		int (*cb)(str *, GQueue *, struct redis_list *, void *), void *ptr, struct redis_doc *doc)
 {
 	char key_concatted[256];
+	JsonReader *root_reader = doc->json;
 
 	snprintf(key_concatted, 256, "%s-%u", key, idx);
 
+	if (!root_reader)
+		return bin_build_list_cb(q, key_concatted, list, cb, ptr, doc);
+
 	if (!json_reader_read_member(root_reader, key_concatted)) {
 		rlog(LOG_ERROR,"Key in json not found:%s",key_concatted);
 		return -1;
@@ -1001,14 +1121,14 @@ static int rbl_cb_simple(str *s, GQueue *q, struct redis_list *list, void *ptr)
 }
 
 static int json_build_list(GQueue *q, struct call *c, const char *key, const str *callid,
-		unsigned int idx, struct redis_list *list, JsonReader *root_reader)
+		unsigned int idx, struct redis_list *list, struct redis_doc *doc)
 {
-	return json_build_list_cb(q, c, key, idx, list, rbl_cb_simple, NULL, root_reader);
+	return json_build_list_cb(q, c, key, idx, list, rbl_cb_simple, NULL, doc);
 }
 
 static int json_get_list_hash(struct redis_list *out,
 		const char *key,
-		const struct redis_hash *rh, const char *rh_num_key, JsonReader *root_reader)
+		const struct redis_hash *rh, const char *rh_num_key, struct redis_doc *doc)
 {
 	unsigned int i;
 
@@ -1022,7 +1142,7 @@ static int json_get_list_hash(struct redis_list *out,
 		goto err1;
 
 	for (i = 0; i < out->len; i++) {
-		if (json_get_hash(&out->rh[i], key, i, root_reader))
+		if (json_get_hash(&out->rh[i], key, i, doc))
 			goto err2;
 	}
 
@@ -1229,7 +1349,7 @@ static int rbl_cb_plts_s(str *s, GQueue *q, struct redis_list *list, void *ptr)
 	__rtp_payload_type_add_send(med, rbl_cb_plts_g(s, q, list, ptr));
 	return 0;
 }
-static int json_medias(struct call *c, struct redis_list *medias, JsonReader *root_reader) {
+static int json_medias(struct call *c, struct redis_list *medias, struct redis_doc *doc) {
 	unsigned int i;
 	struct redis_hash *rh;
 	struct call_media *med;
@@ -1274,8 +1394,8 @@ static int json_medias(struct call *c, struct redis_list *medias, JsonReader *ro
 		if (redis_hash_get_crypto_params(&med->sdes_out.params, rh, "sdes_out") < 0)
 			return -1;
 
-		json_build_list_cb(NULL, c, "payload_types", i, NULL, rbl_cb_plts_r, med, root_reader);
-		json_build_list_cb(NULL, c, "payload_types_send", i, NULL, rbl_cb_plts_s, med, root_reader);
+		json_build_list_cb(NULL, c, "payload_types", i, NULL, rbl_cb_plts_r, med, doc);
+		json_build_list_cb(NULL, c, "payload_types_send", i, NULL, rbl_cb_plts_s, med, doc);
 		/* XXX dtls */
 
 		medias->ptrs[i] = med;
@@ -1336,7 +1456,7 @@ static int redis_link_sfds(struct redis_list *sfds, struct redis_list *streams)
 	return 0;
 }
 
-static int json_link_tags(struct call *c, struct redis_list *tags, struct redis_list *medias, JsonReader *root_reader)
+static int json_link_tags(struct call *c, struct redis_list *tags, struct redis_list *medias, struct redis_doc *doc)
 {
 	unsigned int i;
 	struct call_monologue *ml, *other_ml;
@@ -1348,7 +1468,7 @@ static int json_link_tags(struct call *c, struct redis_list *tags, struct redis_
 
 		ml->active_dialogue = redis_list_get_ptr(tags, &tags->rh[i], "active");
 
-		if (json_build_list(&q, c, "other_tags", &c->callid, i, tags, root_reader))
+		if (json_build_list(&q, c, "other_tags", &c->callid, i, tags, doc))
 			return -1;
 		for (l = q.head; l; l = l->next) {
 			other_ml = l->data;
@@ -1358,7 +1478,7 @@ static int json_link_tags(struct call *c, struct redis_list *tags, struct redis_
 		}
 		g_queue_clear(&q);
 
-		if (json_build_list(&ml->medias, c, "medias", &c->callid, i, medias, root_reader))
+		if (json_build_list(&ml->medias, c, "medias", &c->callid, i, medias, doc))
 			return -1;
 	}
 
@@ -1366,7 +1486,7 @@ static int json_link_tags(struct call *c, struct redis_list *tags, struct redis_
 }
 
 static int json_link_streams(struct call *c, struct redis_list *streams,
-		struct redis_list *sfds, struct redis_list *medias, JsonReader *root_reader)
+		struct redis_list *sfds, struct redis_list *medias, struct redis_doc *doc)
 {
 	unsigned int i;
 	struct packet_stream *ps;
@@ -1380,7 +1500,7 @@ static int json_link_streams(struct call *c, struct redis_list *streams,
 		ps->rtcp_sink = redis_list_get_ptr(streams, &streams->rh[i], "rtcp_sink");
 		ps->rtcp_sibling = redis_list_get_ptr(streams, &streams->rh[i], "rtcp_sibling");
 
-		if (json_build_list(&ps->sfds, c, "stream_sfds", &c->callid, i, sfds, root_reader))
+		if (json_build_list(&ps->sfds, c, "stream_sfds", &c->callid, i, sfds, doc))
 			return -1;
 
 		if (ps->media)
@@ -1391,7 +1511,7 @@ static int json_link_streams(struct call *c, struct redis_list *streams,
 }
 
 static int json_link_medias(struct call *c, struct redis_list *medias,
-		struct redis_list *streams, struct redis_list *maps, struct redis_list *tags, JsonReader *root_reader)
+		struct redis_list *streams, struct redis_list *maps, struct redis_list *tags, struct redis_doc *doc)
 {
 	unsigned int i;
 	struct call_media *med;
@@ -1402,9 +1522,9 @@ static int json_link_medias(struct call *c, struct redis_list *medias,
 		med->monologue = redis_list_get_ptr(tags, &medias->rh[i], "tag");
 		if (!med->monologue)
 			return -1;
-		if (json_build_list(&med->streams, c, "streams", &c->callid, i, streams, root_reader))
+		if (json_build_list(&med->streams, c, "streams", &c->callid, i, streams, doc))
 			return -1;
-		if (json_build_list(&med->endpoint_maps, c, "maps", &c->callid, i, maps, root_reader))
+		if (json_build_list(&med->endpoint_maps, c, "maps", &c->callid, i, maps, doc))
 			return -1;
 
 		// find the pair media
@@ -1451,7 +1571,7 @@ static int rbl_cb_intf_sfds(str *s, GQueue *q, struct redis_list *list, void *pt
 }
 
 static int json_link_maps(struct call *c, struct redis_list *maps,
-		struct redis_list *sfds, JsonReader *root_reader)
+		struct redis_list *sfds, struct redis_doc *doc)
 {
 	unsigned int i;
 	struct endpoint_map *em;
@@ -1460,13 +1580,17 @@ static int json_link_maps(struct call *c, struct redis_list *maps,
 		em = maps->ptrs[i];
 
 		if (json_build_list_cb(&em->intf_sfds, c, "map_sfds", em->unique_id, sfds,
-				rbl_cb_intf_sfds, em, root_reader))
+				rbl_cb_intf_sfds, em, doc))
 			return -1;
 	}
 	return 0;
 }
 
-static int json_build_ssrc(struct call *c, JsonReader *root_reader) {
+static int json_build_ssrc(struct call *c, struct redis_doc *doc) {
+	if (!doc->json)
+		return bin_build_ssrc(c, doc);
+
+	JsonReader *root_reader = doc->json;
 	if (!json_reader_read_member(root_reader, "ssrc_table"))
 		return -1;
 	int nmemb = json_reader_count_elements(root_reader);
@@ -1490,58 +1614,74 @@ static int json_build_ssrc(struct call *c, JsonReader *root_reader) {
 	return 0;
 }
 
-static void json_restore_call(struct redis *r, const str *callid, enum call_type type) {
-	redisReply* rr_jsonStr;
+/* "data" is modified in place during the restore. returns 0 if the call was restored,
+ * 1 if it already existed, and -1 on errors */
+static int json_restore_call_data(const str *callid, char *data, size_t data_len, enum call_type type) {
 	struct redis_hash call;
 	struct redis_list tags, sfds, streams, medias, maps;
 	struct call *c = NULL;
 	str s, id, meta;
+	int exists = 0;
 
 	const char *err = 0;
 	int i;
 	JsonReader *root_reader =0;
 	JsonParser *parser =0;
+	struct redis_doc doc;
+
+	ZERO(doc);
 
-	rr_jsonStr = redis_get(r, REDIS_REPLY_STRING, "GET " PB, STR(callid));
 	err = "could not retrieve JSON data from redis";
-	if (!rr_jsonStr)
+	if (!data)
 		goto err1;
 
-	parser = json_parser_new();
-	err = "could not parse JSON data";
-	if (!json_parser_load_from_data (parser, rr_jsonStr->str, -1, NULL))
-		goto err1;
-	root_reader = json_reader_new (json_parser_get_root (parser));
-	err = "could not read JSON data";
-	if (!root_reader)
-		goto err1;
+	if (redis_bin_detect(data, data_len)) {
+		err = "could not parse binary data";
+		if (redis_bin_doc_init(&doc.bin, data, data_len))
+			goto err1;
+	}
+	else {
+		parser = json_parser_new();
+		err = "could not parse JSON data";
+		if (!json_parser_load_from_data (parser, data, data_len, NULL))
+			goto err1;
+		root_reader = json_reader_new (json_parser_get_root (parser));
+		err = "could not read JSON data";
+		if (!root_reader)
+			goto err1;
+		doc.json = root_reader;
+	}
 
 	c = call_get_or_create(callid, type);
 	err = "failed to create call struct";
 	if (!c)
 		goto err1;
 
-	err = "call already exists";
-	if (c->last_signal)
+	// not ours to destroy: it was restored or created before
+	if (c->last_signal) {
+		rlog(LOG_DEBUG, "Call ID '" STR_FORMAT "' already exists, not restoring it", STR_FMT(callid));
+		exists = 1;
+		err = NULL;
 		goto err2;
+	}
 	err = "'call' data incomplete";
 
-	if (json_get_hash(&call, "json", -1, root_reader))
+	if (json_get_hash(&call, "json", -1, &doc))
 		goto err2;
 	err = "'tags' incomplete";
-	if (json_get_list_hash(&tags, "tag", &call, "num_tags", root_reader))
+	if (json_get_list_hash(&tags, "tag", &call, "num_tags", &doc))
 		goto err3;
 	err = "'sfds' incomplete";
-	if (json_get_list_hash(&sfds, "sfd", &call, "num_sfds", root_reader))
+	if (json_get_list_hash(&sfds, "sfd", &call, "num_sfds", &doc))
 		goto err4;
 	err = "'streams' incomplete";
-	if (json_get_list_hash(&streams, "stream", &call, "num_streams", root_reader))
+	if (json_get_list_hash(&streams, "stream", &call, "num_streams", &doc))
 		goto err5;
 	err = "'medias' incomplete";
-	if (json_get_list_hash(&medias, "media", &call, "num_medias", root_reader))
+	if (json_get_list_hash(&medias, "media", &call, "num_medias", &doc))
 		goto err6;
 	err = "'maps' incomplete";
-	if (json_get_list_hash(&maps, "map", &call, "num_maps", root_reader))
+	if (json_get_list_hash(&maps, "map", &call, "num_maps", &doc))
 		goto err7;
 
 	err = "missing 'created' timestamp";
@@ -1575,7 +1715,7 @@ static void json_restore_call(struct redis *r, const str *callid, enum call_type
 	if (redis_tags(c, &tags))
 		goto err8;
 	err = "failed to create medias";
-	if (json_medias(c, &medias, root_reader))
+	if (json_medias(c, &medias, &doc))
 		goto err8;
 	err = "failed to create maps";
 	if (redis_maps(c, &maps))
@@ -1585,19 +1725,19 @@ static void json_restore_call(struct redis *r, const str *callid, enum call_type
 	if (redis_link_sfds(&sfds, &streams))
 		goto err8;
 	err = "failed to link streams";
-	if (json_link_streams(c, &streams, &sfds, &medias, root_reader))
+	if (json_link_streams(c, &streams, &sfds, &medias, &doc))
 		goto err8;
 	err = "failed to link tags";
-	if (json_link_tags(c, &tags, &medias, root_reader))
+	if (json_link_tags(c, &tags, &medias, &doc))
 		goto err8;
 	err = "failed to link medias";
-	if (json_link_medias(c, &medias, &streams, &maps, &tags, root_reader))
+	if (json_link_medias(c, &medias, &streams, &maps, &tags, &doc))
 		goto err8;
 	err = "failed to link maps";
-	if (json_link_maps(c, &maps, &sfds, root_reader))
+	if (json_link_maps(c, &maps, &sfds, &doc))
 		goto err8;
 	err = "failed to restore SSRC table";
-	if (json_build_ssrc(c, root_reader))
+	if (json_build_ssrc(c, &doc))
 		goto err8;
 
 	// presence of this key determines whether we were recording at all
@@ -1625,10 +1765,9 @@ err2:
 err1:
 	if (root_reader)
 		g_object_unref (root_reader);
+	redis_bin_doc_free(&doc.bin);
 	if (parser)
 		g_object_unref (parser);
-	if (rr_jsonStr)
-		freeReplyObject(rr_jsonStr);	
 	log_info_clear();
 	if (err) {
 		rlog(LOG_WARNING, "Failed to restore call ID '" STR_FORMAT "' from Redis: %s", STR_FMT(callid),
@@ -1643,38 +1782,179 @@ err1:
 	}
 	if (c)
 		obj_put(c);
+	if (err)
+		return -1;
+	return exists;
 }
 
+static void json_restore_call(struct redis *r, const str *callid, enum call_type type) {
+	redisReply* rr_jsonStr;
+
+	rr_jsonStr = redis_get(r, REDIS_REPLY_STRING, "GET " PB, STR(callid));
+	json_restore_call_data(callid, rr_jsonStr ? rr_jsonStr->str : NULL,
+			rr_jsonStr ? rr_jsonStr->len : 0, type);
+	if (rr_jsonStr)
+		freeReplyObject(rr_jsonStr);
+}
+
+struct restore_batch {
+	redisReply *scan;	// the SCAN reply holding the list of keys
+	redisReply *values;	// the MGET reply for these keys
+};
+
 struct thread_ctx {
-	GQueue r_q;
-	mutex_t r_m;
+	volatile unsigned int restored;
+	volatile unsigned int failed;
 };
 
-static void restore_thread(void *call_p, void *ctx_p) {
+/* decodes one batch of fetched calls, while the next batch is being fetched */
+static void restore_thread(void *batch_p, void *ctx_p) {
 	struct thread_ctx *ctx = ctx_p;
-	redisReply *call = call_p;
-	struct redis *r;
+	struct restore_batch *batch = batch_p;
+	redisReply *keys = batch->scan->element[1], *key, *val;
 	str callid;
-	str_init_len(&callid, call->str, call->len);
+	int i, ret;
 
-	rlog(LOG_DEBUG, "Processing call ID '%.*s' from Redis", REDIS_FMT(call));
+	for (i = 0; i < keys->elements; i++) {
+		key = keys->element[i];
+		val = batch->values->element[i];
+		if (key->type != REDIS_REPLY_STRING)
+			continue;
+
+		str_init_len(&callid, key->str, key->len);
+		rlog(LOG_DEBUG, "Processing call ID '%.*s' from Redis", REDIS_FMT(key));
 
-	mutex_lock(&ctx->r_m);
-	r = g_queue_pop_head(&ctx->r_q);
-	mutex_unlock(&ctx->r_m);
+		ret = json_restore_call_data(&callid, val->type == REDIS_REPLY_STRING ? val->str : NULL,
+					val->len, CT_OWN_CALL);
+		if (ret == 0)
+			g_atomic_int_inc(&ctx->restored);
+		else if (ret < 0)
+			g_atomic_int_inc(&ctx->failed);
+	}
 
-	json_restore_call(r, &callid, CT_OWN_CALL);
+	freeReplyObject(batch->values);
+	freeReplyObject(batch->scan);
+	g_slice_free1(sizeof(*batch), batch);
+}
 
-	mutex_lock(&ctx->r_m);
-	g_queue_push_tail(&ctx->r_q, r);
-	mutex_unlock(&ctx->r_m);
+static int redis_scan_reply_ok(redisReply *rr) {
+	if (!rr || rr->type != REDIS_REPLY_ARRAY || rr->elements != 2)
+		return 0;
+	if (rr->element[0]->type != REDIS_REPLY_STRING || rr->element[1]->type != REDIS_REPLY_ARRAY)
+		return 0;
+	return 1;
+}
+
+/* SCAN may return a key more than once. drops keys seen in earlier batches from the reply */
+static void redis_scan_dedup(redisReply *keys, GHashTable *seen) {
+	redisReply *key;
+	size_t i, j;
+	char *s;
+
+	for (i = 0, j = 0; i < keys->elements; i++) {
+		key = keys->element[i];
+		if (key->type == REDIS_REPLY_STRING) {
+			s = g_strndup(key->str, key->len);
+			if (g_hash_table_contains(seen, s)) {
+				g_free(s);
+				freeReplyObject(key);
+				continue;
+			}
+			g_hash_table_insert(seen, s, s);
+		}
+		keys->element[j++] = key;
+	}
+	keys->elements = j;
+}
+
+static void redis_append_mget(struct redis *r, redisReply *keys) {
+	const char **argv;
+	size_t *argvlen;
+	int i;
+
+	argv = g_new(const char *, keys->elements + 1);
+	argvlen = g_new(size_t, keys->elements + 1);
+
+	argv[0] = "MGET";
+	argvlen[0] = 4;
+	for (i = 0; i < keys->elements; i++) {
+		argv[i + 1] = keys->element[i]->str;
+		argvlen[i + 1] = keys->element[i]->len;
+	}
+
+	redisAppendCommandArgv(r->ctx, keys->elements + 1, argv, argvlen);
+
+	g_free(argv);
+	g_free(argvlen);
+}
+
+/* walks the key space with SCAN and fetches the calls with MGET, one batch per round trip:
+ * the MGET for the current batch is pipelined together with the SCAN for the next one.
+ * decoding happens in the thread pool in parallel. */
+static int redis_restore_fetch(struct redis *r, GThreadPool *gtp) {
+	redisReply *rr, *values;
+	struct restore_batch *batch;
+	int last;
+	GHashTable *seen;
+
+	seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	rr = redisCommand(r->ctx, "SCAN 0 COUNT %i", REDIS_RESTORE_SCAN_COUNT);
+
+	while (1) {
+		if (!redis_scan_reply_ok(rr))
+			goto err;
+
+		last = !strcmp(rr->element[0]->str, "0");
+		redis_scan_dedup(rr->element[1], seen);
+
+		if (rr->element[1]->elements)
+			redis_append_mget(r, rr->element[1]);
+		if (!last)
+			redisAppendCommand(r->ctx, "SCAN %s COUNT %i", rr->element[0]->str,
+					REDIS_RESTORE_SCAN_COUNT);
+
+		if (!rr->element[1]->elements)
+			freeReplyObject(rr);
+		else {
+			values = NULL;
+			if (redisGetReply(r->ctx, (void **) &values) != REDIS_OK || !values
+					|| values->type != REDIS_REPLY_ARRAY
+					|| values->elements != rr->element[1]->elements)
+			{
+				if (values)
+					freeReplyObject(values);
+				goto err;
+			}
+
+			batch = g_slice_alloc(sizeof(*batch));
+			batch->scan = rr;
+			batch->values = values;
+			g_thread_pool_push(gtp, batch, NULL);
+		}
+
+		if (last) {
+			g_hash_table_destroy(seen);
+			return 0;
+		}
+
+		rr = NULL;
+		if (redisGetReply(r->ctx, (void **) &rr) != REDIS_OK)
+			rr = NULL;
+	}
+
+err:
+	if (rr)
+		freeReplyObject(rr);
+	g_hash_table_destroy(seen);
+	return -1;
 }
 
 int redis_restore(struct redis *r) {
-	redisReply *calls = NULL, *call;
-	int i, ret = -1;
+	int ret = -1;
 	GThreadPool *gtp;
 	struct thread_ctx ctx;
+	struct timeval start, fetched, done;
 
 	if (!r)
 		return 0;
@@ -1682,6 +1962,7 @@ int redis_restore(struct redis *r) {
 	rtpe_config.common.log_level |= LOG_FLAG_RESTORE;
 
 	rlog(LOG_DEBUG, "Restoring calls from Redis...");
+	gettimeofday(&start, NULL);
 
 	mutex_lock(&r->lock);
 	// coverity[sleep : FALSE]
@@ -1692,35 +1973,27 @@ int redis_restore(struct redis *r) {
 	}
 	mutex_unlock(&r->lock);
 
-	calls = redis_get(r, REDIS_REPLY_ARRAY, "KEYS *");
+	ZERO(ctx);
+	gtp = g_thread_pool_new(restore_thread, &ctx, rtpe_config.redis_num_threads, TRUE, NULL);
 
-	if (!calls) {
+	ret = 0;
+	if (redis_restore_fetch(r, gtp)) {
 		rlog(LOG_ERR, "Could not retrieve call list from Redis: %s",
 				r->ctx ? r->ctx->errstr : "No redis context");
-		goto err;
-	}
-
-	mutex_init(&ctx.r_m);
-	g_queue_init(&ctx.r_q);
-	for (i = 0; i < rtpe_config.redis_num_threads; i++)
-		g_queue_push_tail(&ctx.r_q,
-				redis_new(&r->endpoint, r->db, r->auth, r->role, r->no_redis_required));
-	gtp = g_thread_pool_new(restore_thread, &ctx, rtpe_config.redis_num_threads, TRUE, NULL);
-
-	for (i = 0; i < calls->elements; i++) {
-		call = calls->element[i];
-		if (call->type != REDIS_REPLY_STRING)
-			continue;
-
-		g_thread_pool_push(gtp, call, NULL);
+		ret = -1;
+		// replies to the rest of the pipeline may still be pending, so start over
+		mutex_lock(&r->lock);
+		redis_connect(r, 1);
+		mutex_unlock(&r->lock);
 	}
+	gettimeofday(&fetched, NULL);
 
 	g_thread_pool_free(gtp, FALSE, TRUE);
-	while ((r = g_queue_pop_head(&ctx.r_q)))
-		redis_close(r);
-	ret = 0;
+	gettimeofday(&done, NULL);
 
-	freeReplyObject(calls);
+	rlog(LOG_INFO, "Restored %u calls from Redis in %.3f seconds (%u failed, fetching took %.3f seconds)",
+			ctx.restored, timeval_diff(&done, &start) / 1000000.0,
+			ctx.failed, timeval_diff(&fetched, &start) / 1000000.0);
 
 err:
 	rtpe_config.common.log_level &= ~LOG_FLAG_RESTORE;
@@ -1729,31 +2002,31 @@ err:
 
 #define JSON_ADD_STRING(f...) do { \
 		int len = snprintf(tmp,sizeof(tmp), f); \
-		json_builder_add_string_value_uri_enc(builder, tmp, len); \
+		redis_enc_string(builder, tmp, len); \
 	} while (0)
 #define JSON_SET_NSTRING(a,b,c,d) do { \
 		snprintf(tmp,sizeof(tmp), a,b); \
-		json_builder_set_member_name(builder, tmp); \
+		redis_enc_member(builder, tmp); \
 		JSON_ADD_STRING(c, d); \
 	} while (0)
 #define JSON_SET_NSTRING_CSTR(a,b,d) JSON_SET_NSTRING_LEN(a, b, strlen(d), d)
 #define JSON_SET_NSTRING_LEN(a,b,l,d) do { \
 		snprintf(tmp,sizeof(tmp), a,b); \
-		json_builder_set_member_name(builder, tmp); \
-		json_builder_add_string_value_uri_enc(builder, d, l); \
+		redis_enc_member(builder, tmp); \
+		redis_enc_string(builder, d, l); \
 	} while (0)
 #define JSON_SET_SIMPLE(a,c,d) do { \
-		json_builder_set_member_name(builder, a); \
+		redis_enc_member(builder, a); \
 		JSON_ADD_STRING(c, d); \
 	} while (0)
 #define JSON_SET_SIMPLE_LEN(a,l,d) do { \
-		json_builder_set_member_name(builder, a); \
-		json_builder_add_string_value_uri_enc(builder, d, l); \
+		redis_enc_member(builder, a); \
+		redis_enc_string(builder, d, l); \
 	} while (0)
 #define JSON_SET_SIMPLE_CSTR(a,d) JSON_SET_SIMPLE_LEN(a, strlen(d), d)
 #define JSON_SET_SIMPLE_STR(a,d) JSON_SET_SIMPLE_LEN(a, (d)->len, (d)->s)
 
-static int json_update_crypto_params(JsonBuilder *builder, const char *pref,
+static int json_update_crypto_params(struct redis_enc *builder, const char *pref,
 		unsigned int unique_id,
 		const char *key, const struct crypto_params *p)
 {
@@ -1777,7 +2050,7 @@ static int json_update_crypto_params(JsonBuilder *builder, const char *pref,
 	return 0;
 }
 
-static void json_update_dtls_fingerprint(JsonBuilder *builder, const char *pref,
+static void json_update_dtls_fingerprint(struct redis_enc *builder, const char *pref,
 		unsigned int unique_id,
 		const struct dtls_fingerprint *f)
 {
@@ -1792,7 +2065,7 @@ static void json_update_dtls_fingerprint(JsonBuilder *builder, const char *pref,
  * encodes the few (k,v) pairs for one call under one json structure
  */
 
-char* redis_encode_json(struct call *c) {
+static void redis_encode_call(struct redis_enc *builder, struct call *c) {
 
 	GList *l=0,*k=0, *m=0, *n=0;
 	struct endpoint_map *ep;
@@ -1802,16 +2075,15 @@ char* redis_encode_json(struct call *c) {
 	struct packet_stream *ps;
 	struct intf_list *il;
 	struct call_monologue *ml, *ml2;
-	JsonBuilder *builder = json_builder_new ();
 	struct recording *rec = 0;
 
 	char tmp[2048];
 
-	json_builder_begin_object (builder);
+	redis_enc_begin_object(builder);
 	{
-		json_builder_set_member_name(builder, "json");
+		redis_enc_member(builder, "json");
 
-		json_builder_begin_object (builder);
+		redis_enc_begin_object(builder);
 
 		{
 			JSON_SET_SIMPLE("created","%lli", timeval_us(&c->created));
@@ -1834,15 +2106,15 @@ char* redis_encode_json(struct call *c) {
 			}
 		}
 
-		json_builder_end_object (builder);
+		redis_enc_end_object(builder);
 
 		for (l = c->stream_fds.head; l; l = l->next) {
 			sfd = l->data;
 
 			snprintf(tmp, sizeof(tmp), "sfd-%u", sfd->unique_id);
-			json_builder_set_member_name(builder, tmp);
+			redis_enc_member(builder, tmp);
 
-			json_builder_begin_object (builder);
+			redis_enc_begin_object(builder);
 
 			{
 				JSON_SET_SIMPLE_CSTR("pref_family",sfd->local_intf->logical->preferred_family->rfc_name);
@@ -1852,7 +2124,7 @@ char* redis_encode_json(struct call *c) {
 				JSON_SET_SIMPLE("stream","%u",sfd->stream->unique_id);
 
 			}
-			json_builder_end_object (builder);
+			redis_enc_end_object(builder);
 
 		} // --- for
 
@@ -1863,9 +2135,9 @@ char* redis_encode_json(struct call *c) {
 			mutex_lock(&ps->out_lock);
 
 			snprintf(tmp, sizeof(tmp), "stream-%u", ps->unique_id);
-			json_builder_set_member_name(builder, tmp);
+			redis_enc_member(builder, tmp);
 
-			json_builder_begin_object (builder);
+			redis_enc_begin_object(builder);
 
 			{
 				JSON_SET_SIMPLE("media","%u",ps->media->unique_id);
@@ -1884,7 +2156,7 @@ char* redis_encode_json(struct call *c) {
 
 			}
 
-			json_builder_end_object (builder);
+			redis_enc_end_object(builder);
 
 			// stream_sfds was here before
 			mutex_unlock(&ps->in_lock);
@@ -1900,13 +2172,13 @@ char* redis_encode_json(struct call *c) {
 			mutex_lock(&ps->out_lock);
 
 			snprintf(tmp, sizeof(tmp), "stream_sfds-%u", ps->unique_id);
-			json_builder_set_member_name(builder, tmp);
-			json_builder_begin_array (builder);
+			redis_enc_member(builder, tmp);
+			redis_enc_begin_array(builder);
 			for (k = ps->sfds.head; k; k = k->next) {
 				sfd = k->data;
 				JSON_ADD_STRING("%u",sfd->unique_id);
 			}
-			json_builder_end_array (builder);
+			redis_enc_end_array(builder);
 
 			mutex_unlock(&ps->in_lock);
 			mutex_unlock(&ps->out_lock);
@@ -1917,9 +2189,9 @@ char* redis_encode_json(struct call *c) {
 			ml = l->data;
 
 			snprintf(tmp, sizeof(tmp), "tag-%u", ml->unique_id);
-			json_builder_set_member_name(builder, tmp);
+			redis_enc_member(builder, tmp);
 
-			json_builder_begin_object (builder);
+			redis_enc_begin_object(builder);
 			{
 
 				JSON_SET_SIMPLE("created","%llu",(long long unsigned) ml->created);
@@ -1933,7 +2205,7 @@ char* redis_encode_json(struct call *c) {
 				if (ml->label.s)
 					JSON_SET_SIMPLE_STR("label",&ml->label);
 			}
-			json_builder_end_object (builder);
+			redis_enc_end_object(builder);
 
 			// other_tags and medias- was here before
 
@@ -1944,24 +2216,24 @@ char* redis_encode_json(struct call *c) {
 			// -- we do it again here since the jsonbuilder is linear straight forward
 			k = g_hash_table_get_values(ml->other_tags);
 			snprintf(tmp, sizeof(tmp), "other_tags-%u", ml->unique_id);
-			json_builder_set_member_name(builder, tmp);
-			json_builder_begin_array (builder);
+			redis_enc_member(builder, tmp);
+			redis_enc_begin_array(builder);
 			for (m = k; m; m = m->next) {
 				ml2 = m->data;
 				JSON_ADD_STRING("%u",ml2->unique_id);
 			}
-			json_builder_end_array (builder);
+			redis_enc_end_array(builder);
 
 			g_list_free(k);
 
 			snprintf(tmp, sizeof(tmp), "medias-%u", ml->unique_id);
-			json_builder_set_member_name(builder, tmp);
-			json_builder_begin_array (builder);
+			redis_enc_member(builder, tmp);
+			redis_enc_begin_array(builder);
 			for (k = ml->medias.head; k; k = k->next) {
 				media = k->data;
 				JSON_ADD_STRING("%u",media->unique_id);
 			}
-			json_builder_end_array (builder);
+			redis_enc_end_array(builder);
 		}
 
 
@@ -1969,9 +2241,9 @@ char* redis_encode_json(struct call *c) {
 			media = l->data;
 
 			snprintf(tmp, sizeof(tmp), "media-%u", media->unique_id);
-			json_builder_set_member_name(builder, tmp);
+			redis_enc_member(builder, tmp);
 
-			json_builder_begin_object (builder);
+			redis_enc_begin_object(builder);
 			{
 				JSON_SET_SIMPLE("tag","%u",media->monologue->unique_id);
 				JSON_SET_SIMPLE("index","%u",media->index);
@@ -1990,7 +2262,7 @@ char* redis_encode_json(struct call *c) {
 						&media->sdes_out.params);
 				json_update_dtls_fingerprint(builder, "media", media->unique_id, &media->fingerprint);
 			}
-			json_builder_end_object (builder);
+			redis_enc_end_object(builder);
 
 		} // --- for medias.head
 
@@ -2000,26 +2272,26 @@ char* redis_encode_json(struct call *c) {
 			media = l->data;
 
 			snprintf(tmp, sizeof(tmp), "streams-%u", media->unique_id);
-			json_builder_set_member_name(builder, tmp);
-			json_builder_begin_array (builder);
+			redis_enc_member(builder, tmp);
+			redis_enc_begin_array(builder);
 			for (m = media->streams.head; m; m = m->next) {
 				ps = m->data;
 				JSON_ADD_STRING("%u",ps->unique_id);
 			}
-			json_builder_end_array (builder);
+			redis_enc_end_array(builder);
 
 			snprintf(tmp, sizeof(tmp), "maps-%u", media->unique_id);
-			json_builder_set_member_name(builder, tmp);
-			json_builder_begin_array (builder);
+			redis_enc_member(builder, tmp);
+			redis_enc_begin_array(builder);
 			for (m = media->endpoint_maps.head; m; m = m->next) {
 				ep = m->data;
 				JSON_ADD_STRING("%u",ep->unique_id);
 			}
-			json_builder_end_array (builder);
+			redis_enc_end_array(builder);
 
 			snprintf(tmp, sizeof(tmp), "payload_types-%u", media->unique_id);
-			json_builder_set_member_name(builder, tmp);
-			json_builder_begin_array (builder);
+			redis_enc_member(builder, tmp);
+			redis_enc_begin_array(builder);
 			for (m = media->codecs_prefs_recv.head; m; m = m->next) {
 				pt = m->data;
 				JSON_ADD_STRING("%u/" STR_FORMAT "/%u/" STR_FORMAT "/" STR_FORMAT "/%i/%i",
@@ -2027,11 +2299,11 @@ char* redis_encode_json(struct call *c) {
 						pt->clock_rate, STR_FMT(&pt->encoding_parameters),
 						STR_FMT(&pt->format_parameters), pt->bitrate, pt->ptime);
 			}
-			json_builder_end_array (builder);
+			redis_enc_end_array(builder);
 
 			snprintf(tmp, sizeof(tmp), "payload_types_send-%u", media->unique_id);
-			json_builder_set_member_name(builder, tmp);
-			json_builder_begin_array (builder);
+			redis_enc_member(builder, tmp);
+			redis_enc_begin_array(builder);
 			for (m = media->codecs_prefs_send.head; m; m = m->next) {
 				pt = m->data;
 				JSON_ADD_STRING("%u/" STR_FORMAT "/%u/" STR_FORMAT "/" STR_FORMAT "/%i/%i",
@@ -2039,16 +2311,16 @@ char* redis_encode_json(struct call *c) {
 						pt->clock_rate, STR_FMT(&pt->encoding_parameters),
 						STR_FMT(&pt->format_parameters), pt->bitrate, pt->ptime);
 			}
-			json_builder_end_array (builder);
+			redis_enc_end_array(builder);
 		}
 
 		for (l = c->endpoint_maps.head; l; l = l->next) {
 			ep = l->data;
 
 			snprintf(tmp, sizeof(tmp), "map-%u", ep->unique_id);
-			json_builder_set_member_name(builder, tmp);
+			redis_enc_member(builder, tmp);
 
-			json_builder_begin_object (builder);
+			redis_enc_begin_object(builder);
 			{
 				JSON_SET_SIMPLE("wildcard","%i",ep->wildcard);
 				JSON_SET_SIMPLE("num_ports","%u",ep->num_ports);
@@ -2057,7 +2329,7 @@ char* redis_encode_json(struct call *c) {
 				JSON_SET_SIMPLE_CSTR("endpoint",endpoint_print_buf(&ep->endpoint));
 
 			}
-			json_builder_end_object (builder);
+			redis_enc_end_object(builder);
 
 		} // --- for c->endpoint_maps.head
 
@@ -2066,8 +2338,8 @@ char* redis_encode_json(struct call *c) {
 			ep = l->data;
 
 			snprintf(tmp, sizeof(tmp), "map_sfds-%u", ep->unique_id);
-			json_builder_set_member_name(builder, tmp);
-			json_builder_begin_array (builder);
+			redis_enc_member(builder, tmp);
+			redis_enc_begin_array(builder);
 			for (m = ep->intf_sfds.head; m; m = m->next) {
 				il = m->data;
 				JSON_ADD_STRING("loc-%u",il->local_intf->unique_id);
@@ -2076,17 +2348,17 @@ char* redis_encode_json(struct call *c) {
 					JSON_ADD_STRING("%u",sfd->unique_id);
 				}
 			}
-			json_builder_end_array (builder);
+			redis_enc_end_array(builder);
 		}
 
 		// SSRC table dump
 		rwlock_lock_r(&c->ssrc_hash->lock);
 		k = g_hash_table_get_values(c->ssrc_hash->ht);
-		json_builder_set_member_name(builder, "ssrc_table");
-		json_builder_begin_array (builder);
+		redis_enc_member(builder, "ssrc_table");
+		redis_enc_begin_array(builder);
 		for (m = k; m; m = m->next) {
 			struct ssrc_entry_call *se = m->data;
-			json_builder_begin_object (builder);
+			redis_enc_begin_object(builder);
 
 			JSON_SET_SIMPLE("ssrc","%" PRIu32, se->h.ssrc);
 			// XXX use function for in/out
@@ -2098,107 +2370,220 @@ char* redis_encode_json(struct call *c) {
 			JSON_SET_SIMPLE("out_payload_type","%i", se->output_ctx.payload_type);
 			// XXX add rest of info
 
-			json_builder_end_object (builder);
+			redis_enc_end_object(builder);
 		}
-		json_builder_end_array (builder);
+		redis_enc_end_array(builder);
 
 		g_list_free(k);
 		rwlock_unlock_r(&c->ssrc_hash->lock);
 	}
-	json_builder_end_object (builder);
+	redis_enc_end_object(builder);
+}
 
-	JsonGenerator *gen = json_generator_new ();
-	JsonNode * root = json_builder_get_root (builder);
-	json_generator_set_root (gen, root);
-	char* result = json_generator_to_data (gen, NULL);
+char* redis_encode_json(struct call *c) {
+	struct redis_enc builder;
 
-	json_node_free (root);
-	g_object_unref (gen);
-	g_object_unref (builder);
+	redis_enc_init_json(&builder);
+	redis_encode_call(&builder, c);
+	return redis_enc_finish_json(&builder);
+}
 
-	return result;
+/* the output is only valid until the next call from the same thread */
+void redis_encode_bin(struct call *c, str *out) {
+	struct redis_enc builder;
 
+	redis_enc_init_bin(&builder);
+	redis_encode_call(&builder, c);
+	redis_enc_finish_bin(&builder, out);
 }
 
 
+/* called with r->write_lock held */
+static void redis_write_queue(struct call *c, struct redis *r) {
+	gettimeofday(&c->redis_dirty_since, NULL);
+	g_queue_push_tail(&r->write_queue, obj_get(c));
+	cond_signal(&r->write_cond);
+}
+
+/* only marks the call as dirty, the actual write is done by redis_write_loop() */
 void redis_update_onekey(struct call *c, struct redis *r) {
-	unsigned int redis_expires_s;
+	if (!r)
+		return;
 
+	mutex_lock(&r->write_lock);
+	r->write_stats.updates++;
+	switch (c->redis_write_state) {
+		case REDIS_WRITE_IDLE:
+			c->redis_write_state = REDIS_WRITE_UPDATE;
+			redis_write_queue(c, r);
+			break;
+		case REDIS_WRITE_UPDATE:
+			r->write_stats.coalesced++;
+			break;
+		default:
+			// call is being deleted
+			break;
+	}
+	mutex_unlock(&r->write_lock);
+}
+
+/* must be called lock-free */
+void redis_delete(struct call *c, struct redis *r) {
 	if (!r)
 		return;
 
-	mutex_lock(&r->lock);
-	// coverity[sleep : FALSE]
-	if (redis_check_conn(r) == REDIS_STATE_DISCONNECTED) {
-		mutex_unlock(&r->lock);
-		return ;
+	mutex_lock(&r->write_lock);
+	r->write_stats.updates++;
+	switch (c->redis_write_state) {
+		case REDIS_WRITE_IDLE:
+			c->redis_write_state = REDIS_WRITE_DELETE;
+			redis_write_queue(c, r);
+			break;
+		case REDIS_WRITE_UPDATE:
+			// turn the pending update into a delete
+			c->redis_write_state = REDIS_WRITE_DELETE;
+			r->write_stats.coalesced++;
+			break;
+		default:
+			break;
 	}
+	mutex_unlock(&r->write_lock);
+}
 
-	rwlock_lock_r(&c->master_lock);
+/* called with r->lock held */
+static void redis_write_select(struct redis *r, int *selected, int db) {
+	if (*selected == db)
+		return;
+	redis_pipe(r, "SELECT %i", db);
+	*selected = db;
+}
 
-	redis_expires_s = rtpe_config.redis_expires_secs;
+/* called with r->lock held, pipelines the writes for the whole batch */
+static void redis_write_batch(struct redis *r, GQueue *batch, GQueue *states) {
+	GList *l, *k;
+	int selected = -1;
+	char *result = NULL;
+	str bin;
 
-	c->redis_hosted_db = r->db;
-	if (redisCommandNR(r->ctx, "SELECT %i", c->redis_hosted_db)) {
-		rlog(LOG_ERR, " >>>>>>>>>>>>>>>>> Redis error.");
-		goto err;
-	}
+	for (l = batch->head, k = states->head; l; l = l->next, k = k->next) {
+		struct call *c = l->data;
 
-	char* result = redis_encode_json(c);
-	if (!result)
-		goto err;
+		if (GPOINTER_TO_UINT(k->data) == REDIS_WRITE_DELETE) {
+			redis_write_select(r, &selected, c->redis_hosted_db);
+			redis_pipe(r, "DEL "PB"", STR(&c->callid));
+			continue;
+		}
 
-	redis_pipe(r, "SET "PB" %s", STR(&c->callid), result);
-	redis_pipe(r, "EXPIRE "PB" %i", STR(&c->callid), redis_expires_s);
+		rwlock_lock_r(&c->master_lock);
+		if (c->destroyed) {
+			rwlock_unlock_r(&c->master_lock);
+			continue;
+		}
+		c->redis_hosted_db = r->db;
+		if (rtpe_config.redis_format == RF_BIN)
+			redis_encode_bin(c, &bin);
+		else
+			result = redis_encode_json(c);
+		rwlock_unlock_r(&c->master_lock);
+
+		if (rtpe_config.redis_format != RF_BIN && !result)
+			continue;
+
+		redis_write_select(r, &selected, r->db);
+		if (result) {
+			redis_pipe(r, "SET "PB" %s", STR(&c->callid), result);
+			free(result);
+			result = NULL;
+		}
+		else
+			redis_pipe(r, "SET "PB" "PB"", STR(&c->callid), STR(&bin));
+		redis_pipe(r, "EXPIRE "PB" %i", STR(&c->callid), rtpe_config.redis_expires_secs);
+	}
 
 	redis_consume(r);
+}
 
-	if (result)
-		free(result);
-	mutex_unlock(&r->lock);
-	rwlock_unlock_r(&c->master_lock);
+static void redis_write_batch_done(struct redis *r, GQueue *batch) {
+	struct timeval now;
+	struct call *c;
+	u_int64_t lat;
 
-	return;
-err:
-	if (r->ctx && r->ctx->err)
-		rlog(LOG_ERR, "Redis error: %s", r->ctx->errstr);
-	redisFree(r->ctx);
-	r->ctx = NULL;
+	gettimeofday(&now, NULL);
 
-	mutex_unlock(&r->lock);
-	rwlock_unlock_r(&c->master_lock);
+	mutex_lock(&r->write_lock);
+	while ((c = g_queue_pop_head(batch))) {
+		lat = timeval_diff(&now, &c->redis_dirty_since);
+		if (lat > r->write_stats.latency_max_us)
+			r->write_stats.latency_max_us = lat;
+		r->write_latency_sum_us += lat;
+		r->write_latency_num++;
+		r->write_stats.writes++;
+		obj_put(c);
+	}
+	mutex_unlock(&r->write_lock);
 }
 
-/* must be called lock-free */
-void redis_delete(struct call *c, struct redis *r) {
-	if (!r)
-		return;
+void redis_write_loop(void *d) {
+	struct redis *r = d;
+	GQueue batch = G_QUEUE_INIT, states = G_QUEUE_INIT;
+	struct call *c;
+	struct timeval tv;
 
-	mutex_lock(&r->lock);
-	// coverity[sleep : FALSE]
-	if (redis_check_conn(r) == REDIS_STATE_DISCONNECTED) {
-		mutex_unlock(&r->lock);
-		return ;
-	}
-	rwlock_lock_r(&c->master_lock);
+	mutex_lock(&r->write_lock);
 
-	if (redisCommandNR(r->ctx, "SELECT %i", c->redis_hosted_db))
-		goto err;
+	while (1) {
+		if (!r->write_queue.length) {
+			if (rtpe_shutdown)
+				break;
+			gettimeofday(&tv, NULL);
+			timeval_add_usec(&tv, 1000000);
+			cond_timedwait(&r->write_cond, &r->write_lock, &tv);
+			continue;
+		}
 
-	redis_delete_call_json(c, r);
+		// take over a batch of dirty calls. each call is in the queue at most once, and
+		// any request arriving from now on queues it again and will be written later.
+		while (batch.length < REDIS_WRITE_BATCH && (c = g_queue_pop_head(&r->write_queue))) {
+			g_queue_push_tail(&states, GUINT_TO_POINTER(c->redis_write_state));
+			c->redis_write_state = (c->redis_write_state == REDIS_WRITE_DELETE)
+				? REDIS_WRITE_DELETED : REDIS_WRITE_IDLE;
+			g_queue_push_tail(&batch, c);
+		}
 
-	rwlock_unlock_r(&c->master_lock);
-	mutex_unlock(&r->lock);
-	return;
+		mutex_unlock(&r->write_lock);
 
-err:
-	if (r->ctx && r->ctx->err)
-		rlog(LOG_ERR, "Redis error: %s", r->ctx->errstr);
-	redisFree(r->ctx);
-	r->ctx = NULL;
+		mutex_lock(&r->lock);
+		// coverity[sleep : FALSE]
+		if (redis_check_conn(r) != REDIS_STATE_DISCONNECTED) {
+			redis_write_batch(r, &batch, &states);
+			if (r->ctx && r->ctx->err) {
+				rlog(LOG_ERR, "Redis error: %s", r->ctx->errstr);
+				redisFree(r->ctx);
+				r->ctx = NULL;
+			}
+		}
+		mutex_unlock(&r->lock);
 
-	rwlock_unlock_r(&c->master_lock);
-	mutex_unlock(&r->lock);
+		g_queue_clear(&states);
+		redis_write_batch_done(r, &batch);
+
+		mutex_lock(&r->write_lock);
+	}
+
+	mutex_unlock(&r->write_lock);
+}
+
+void redis_get_write_stats(struct redis_write_stats *out, struct redis *r, int reset) {
+	mutex_lock(&r->write_lock);
+	*out = r->write_stats;
+	out->queue_len = r->write_queue.length;
+	out->latency_avg_us = r->write_latency_num ? r->write_latency_sum_us / r->write_latency_num : 0;
+	if (reset) {
+		r->write_stats.latency_max_us = 0;
+		r->write_latency_sum_us = 0;
+		r->write_latency_num = 0;
+	}
+	mutex_unlock(&r->write_lock);
 }
 
 
@@ -17,6 +17,8 @@
 
 
 #define REDIS_RESTORE_NUM_THREADS 4
+#define REDIS_RESTORE_SCAN_COUNT 256
+#define REDIS_WRITE_BATCH 128
 
 
 enum redis_role {
@@ -43,10 +45,26 @@ enum subscribe_action {
 	UNSUBSCRIBE_ALL,
 };
 
+enum redis_write_state {
+	REDIS_WRITE_IDLE = 0,
+	REDIS_WRITE_UPDATE,		// queued for update
+	REDIS_WRITE_DELETE,		// queued for deletion
+	REDIS_WRITE_DELETED,		// final, no further updates
+};
+
 struct call;
 
 
 
+struct redis_write_stats {
+	unsigned int	queue_len;
+	u_int64_t	updates;	// update and delete requests
+	u_int64_t	coalesced;	// requests merged into an already pending write
+	u_int64_t	writes;		// calls written to or deleted from redis
+	u_int64_t	latency_max_us;	// time from first request to completed write
+	u_int64_t	latency_avg_us;
+};
+
 struct redis {
 	endpoint_t	endpoint;
 	char		host[64];
@@ -62,10 +80,19 @@ struct redis {
 	int		no_redis_required;
 	int		consecutive_errors;
 	time_t	restore_tick;
+
+	// calls waiting to be written by redis_write_loop()
+	mutex_t		write_lock;
+	cond_t		write_cond;
+	GQueue		write_queue;
+	struct redis_write_stats write_stats;
+	u_int64_t	write_latency_sum_us;
+	u_int64_t	write_latency_num;
 };
 
 struct redis_hash {
 	GHashTable *ht;
+	str *strs;	// values of binary data
 };
 
 struct redis_list {
@@ -100,18 +127,22 @@ INLINE gboolean g_hash_table_insert_check(GHashTable *h, gpointer k, gpointer v)
 #define rlog(l, x...) ilog(l | LOG_FLAG_RESTORE, x)
 
 void redis_notify_loop(void *d);
+void redis_write_loop(void *d);
 
 
 struct redis *redis_new(const endpoint_t *, int, const char *, enum redis_role, int);
 int redis_restore(struct redis *);
 void redis_update(struct call *, struct redis *);
 void redis_update_onekey(struct call *c, struct redis *r);
+char *redis_encode_json(struct call *c);
+void redis_encode_bin(struct call *c, str *out);
 void redis_delete(struct call *, struct redis *);
 void redis_wipe(struct redis *);
 int redis_notify_event_base_action(enum event_base_action);
 int redis_notify_subscribe_action(enum subscribe_action action, int keyspace);
 int redis_set_timeout(struct redis* r, int timeout);
 int redis_reconnect(struct redis* r);
+void redis_get_write_stats(struct redis_write_stats *, struct redis *, int reset);
 
 
 
@@ -0,0 +1,303 @@
+#include "redis_doc.h"
+
+#include <string.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include "compat.h"
+
+
+struct redis_enc_container {
+	gsize		offset;
+	unsigned int	count;
+};
+
+
+// reused for every binary document encoded by a thread
+static __thread GString *redis_bin_buf;
+static __thread GArray *redis_bin_stack;
+
+
+
+INLINE void json_builder_add_string_value_uri_enc(JsonBuilder *builder, const char* tmp, int len) {
+	char enc[len * 3 + 1];
+	str_uri_encode_len(enc, tmp, len);
+	json_builder_add_string_value(builder,enc);
+}
+
+void redis_enc_init_json(struct redis_enc *e) {
+	memset(e, 0, sizeof(*e));
+	e->json = json_builder_new();
+}
+
+char *redis_enc_finish_json(struct redis_enc *e) {
+	JsonGenerator *gen = json_generator_new();
+	JsonNode *root = json_builder_get_root(e->json);
+	json_generator_set_root(gen, root);
+	char *result = json_generator_to_data(gen, NULL);
+
+	json_node_free(root);
+	g_object_unref(gen);
+	g_object_unref(e->json);
+	e->json = NULL;
+
+	return result;
+}
+
+void redis_enc_init_bin(struct redis_enc *e) {
+	memset(e, 0, sizeof(*e));
+
+	if (!redis_bin_buf) {
+		redis_bin_buf = g_string_sized_new(4096);
+		redis_bin_stack = g_array_new(FALSE, FALSE, sizeof(struct redis_enc_container));
+	}
+	g_string_truncate(redis_bin_buf, 0);
+	g_array_set_size(redis_bin_stack, 0);
+
+	e->bin = redis_bin_buf;
+	e->stack = redis_bin_stack;
+
+	g_string_append_len(e->bin, REDIS_BIN_MAGIC, REDIS_BIN_MAGIC_LEN);
+	g_string_append_c(e->bin, REDIS_BIN_VERSION);
+}
+
+/* the output points into the thread's buffer and is valid until the next document is encoded */
+void redis_enc_finish_bin(struct redis_enc *e, str *out) {
+	str_init_len(out, e->bin->str, e->bin->len);
+}
+
+static void bin_put_u32(GString *b, u_int32_t v) {
+	v = htonl(v);
+	g_string_append_len(b, (char *) &v, sizeof(v));
+}
+
+static void bin_put_u16(GString *b, u_int16_t v) {
+	v = htons(v);
+	g_string_append_len(b, (char *) &v, sizeof(v));
+}
+
+static void bin_patch_u32(GString *b, gsize offset, u_int32_t v) {
+	v = htonl(v);
+	memcpy(b->str + offset, &v, sizeof(v));
+}
+
+static void bin_count(struct redis_enc *e) {
+	if (!e->stack->len)
+		return;
+	g_array_index(e->stack, struct redis_enc_container, e->stack->len - 1).count++;
+}
+
+static void bin_begin(struct redis_enc *e, char type) {
+	struct redis_enc_container c;
+
+	bin_count(e);
+
+	c.offset = e->bin->len;
+	c.count = 0;
+	g_array_append_val(e->stack, c);
+
+	g_string_append_c(e->bin, type);
+	bin_put_u32(e->bin, 0); // size
+	bin_put_u32(e->bin, 0); // count
+}
+
+static void bin_end(struct redis_enc *e) {
+	struct redis_enc_container *c;
+
+	c = &g_array_index(e->stack, struct redis_enc_container, e->stack->len - 1);
+	bin_patch_u32(e->bin, c->offset + 1, e->bin->len - c->offset - 5);
+	bin_patch_u32(e->bin, c->offset + 5, c->count);
+	g_array_set_size(e->stack, e->stack->len - 1);
+}
+
+void redis_enc_begin_object(struct redis_enc *e) {
+	if (e->json)
+		json_builder_begin_object(e->json);
+	else
+		bin_begin(e, 'o');
+}
+
+void redis_enc_end_object(struct redis_enc *e) {
+	if (e->json)
+		json_builder_end_object(e->json);
+	else
+		bin_end(e);
+}
+
+void redis_enc_begin_array(struct redis_enc *e) {
+	if (e->json)
+		json_builder_begin_array(e->json);
+	else
+		bin_begin(e, 'a');
+}
+
+void redis_enc_end_array(struct redis_enc *e) {
+	if (e->json)
+		json_builder_end_array(e->json);
+	else
+		bin_end(e);
+}
+
+void redis_enc_member(struct redis_enc *e, const char *name) {
+	size_t len;
+
+	if (e->json) {
+		json_builder_set_member_name(e->json, name);
+		return;
+	}
+
+	len = strlen(name);
+	bin_put_u16(e->bin, len);
+	g_string_append_len(e->bin, name, len + 1);
+}
+
+void redis_enc_string(struct redis_enc *e, const char *s, int len) {
+	if (e->json) {
+		json_builder_add_string_value_uri_enc(e->json, s, len);
+		return;
+	}
+
+	bin_count(e);
+	g_string_append_c(e->bin, 's');
+	bin_put_u32(e->bin, len);
+	g_string_append_len(e->bin, s, len);
+	g_string_append_c(e->bin, '\0');
+}
+
+
+
+int redis_bin_detect(const char *buf, size_t len) {
+	return len > REDIS_BIN_MAGIC_LEN && !memcmp(buf, REDIS_BIN_MAGIC, REDIS_BIN_MAGIC_LEN);
+}
+
+static int bin_get_u32(unsigned int *out, const char **pos, const char *end) {
+	u_int32_t v;
+
+	if (end - *pos < sizeof(v))
+		return -1;
+	memcpy(&v, *pos, sizeof(v));
+	*out = ntohl(v);
+	*pos += sizeof(v);
+	return 0;
+}
+
+/* parses the node at *pos and advances *pos past it */
+static int bin_node_parse(struct redis_bin_node *out, const char **pos, const char *end) {
+	unsigned int len;
+	const char *cend;
+
+	if (*pos >= end)
+		return -1;
+
+	out->type = *(*pos)++;
+	out->count = 0;
+
+	switch (out->type) {
+		case 's':
+			if (bin_get_u32(&len, pos, end))
+				return -1;
+			if (end - *pos <= len || (*pos)[len] != '\0')
+				return -1;
+			str_init_len(&out->s, (char *) *pos, len);
+			*pos += len + 1;
+			return 0;
+
+		case 'o':
+		case 'a':
+			if (bin_get_u32(&len, pos, end))
+				return -1;
+			if (end - *pos < len)
+				return -1;
+			cend = *pos + len;
+			if (bin_get_u32(&out->count, pos, cend))
+				return -1;
+			// smallest possible element is an empty string
+			if (out->count > (cend - *pos) / 6)
+				return -1;
+			str_init_len(&out->s, (char *) *pos, cend - *pos);
+			*pos = cend;
+			return 0;
+	}
+
+	return -1;
+}
+
+void redis_bin_iter_init(struct redis_bin_iter *it, const struct redis_bin_node *c) {
+	it->pos = c->s.s;
+	it->end = c->s.s + c->s.len;
+	it->left = c->count;
+	it->object = (c->type == 'o');
+}
+
+/* returns 1 if an element was returned, 0 at the end of the container, -1 if the data is malformed.
+ * "key" is only set for members of objects and may be NULL. */
+int redis_bin_iter_next(struct redis_bin_iter *it, str *key, struct redis_bin_node *val) {
+	u_int16_t len;
+
+	if (!it->left)
+		return 0;
+
+	if (it->object) {
+		if (it->end - it->pos < sizeof(len))
+			return -1;
+		memcpy(&len, it->pos, sizeof(len));
+		len = ntohs(len);
+		it->pos += sizeof(len);
+		if (it->end - it->pos <= len || it->pos[len] != '\0')
+			return -1;
+		if (key)
+			str_init_len(key, (char *) it->pos, len);
+		it->pos += len + 1;
+	}
+
+	if (bin_node_parse(val, &it->pos, it->end))
+		return -1;
+
+	it->left--;
+	return 1;
+}
+
+/* indexes the top level members. the document is not copied and "buf" must remain valid */
+int redis_bin_doc_init(struct redis_bin_doc *d, char *buf, size_t len) {
+	struct redis_bin_node root;
+	struct redis_bin_iter it;
+	const char *pos;
+	unsigned int i;
+	str key;
+	int ret;
+
+	memset(d, 0, sizeof(*d));
+
+	if (!redis_bin_detect(buf, len) || buf[REDIS_BIN_MAGIC_LEN] != REDIS_BIN_VERSION)
+		return -1;
+
+	pos = buf + REDIS_BIN_MAGIC_LEN + 1;
+	if (bin_node_parse(&root, &pos, buf + len) || root.type != 'o')
+		return -1;
+
+	d->members = g_hash_table_new(g_str_hash, g_str_equal);
+	d->nodes = g_new(struct redis_bin_node, root.count);
+
+	redis_bin_iter_init(&it, &root);
+	for (i = 0; (ret = redis_bin_iter_next(&it, &key, &d->nodes[i])) == 1; i++)
+		g_hash_table_insert(d->members, key.s, &d->nodes[i]);
+
+	if (ret) {
+		redis_bin_doc_free(d);
+		return -1;
+	}
+
+	return 0;
+}
+
+void redis_bin_doc_free(struct redis_bin_doc *d) {
+	if (d->members)
+		g_hash_table_destroy(d->members);
+	g_free(d->nodes);
+	d->members = NULL;
+	d->nodes = NULL;
+}
+
+const struct redis_bin_node *redis_bin_doc_get(const struct redis_bin_doc *d, const char *name) {
+	return g_hash_table_lookup(d->members, name);
+}
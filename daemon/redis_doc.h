@@ -0,0 +1,76 @@
+#ifndef _REDIS_DOC_H_
+#define _REDIS_DOC_H_
+
+
+#include <glib.h>
+#include <glib-object.h>
+#include <json-glib/json-glib.h>
+#include "str.h"
+
+
+/*
+ * Call state documents stored in Redis are a single object, whose members are either objects of
+ * (key, string value) pairs or arrays of strings or objects. They are encoded either as JSON or
+ * in the binary format below, which is selected through --redis-format. Restoring detects the
+ * format of each call. The binary format starts with REDIS_BIN_MAGIC followed by a version byte
+ * and the root object. All integers are in network byte order, and all strings are stored with
+ * a trailing NUL so that they can be used in place.
+ *
+ *   string:	's' u32 len, data[len], '\0'
+ *   object:	'o' u32 size, u32 count, count * (u16 keylen, key[keylen], '\0', node)
+ *   array:	'a' u32 size, u32 count, count * node
+ *
+ * "size" is the number of bytes following the size field up to the end of the container.
+ */
+#define REDIS_BIN_MAGIC		"\0RB"
+#define REDIS_BIN_MAGIC_LEN	3
+#define REDIS_BIN_VERSION	1
+
+
+struct redis_enc {
+	JsonBuilder	*json;
+	GString		*bin;
+	GArray		*stack;
+};
+
+struct redis_bin_node {
+	char		type;
+	unsigned int	count;
+	str		s;		// string value, or the contents of a container
+};
+
+struct redis_bin_iter {
+	const char	*pos;
+	const char	*end;
+	unsigned int	left;
+	int		object;
+};
+
+struct redis_bin_doc {
+	GHashTable	*members;	// top level member name -> struct redis_bin_node
+	struct redis_bin_node *nodes;
+};
+
+
+void redis_enc_init_json(struct redis_enc *);
+char *redis_enc_finish_json(struct redis_enc *);
+void redis_enc_init_bin(struct redis_enc *);
+void redis_enc_finish_bin(struct redis_enc *, str *out);
+
+void redis_enc_begin_object(struct redis_enc *);
+void redis_enc_end_object(struct redis_enc *);
+void redis_enc_begin_array(struct redis_enc *);
+void redis_enc_end_array(struct redis_enc *);
+void redis_enc_member(struct redis_enc *, const char *name);
+void redis_enc_string(struct redis_enc *, const char *s, int len);
+
+int redis_bin_detect(const char *buf, size_t len);
+int redis_bin_doc_init(struct redis_bin_doc *, char *buf, size_t len);
+void redis_bin_doc_free(struct redis_bin_doc *);
+const struct redis_bin_node *redis_bin_doc_get(const struct redis_bin_doc *, const char *name);
+
+void redis_bin_iter_init(struct redis_bin_iter *, const struct redis_bin_node *container);
+int redis_bin_iter_next(struct redis_bin_iter *, str *key, struct redis_bin_node *val);
+
+
+#endif
@@ -12,6 +12,18 @@
 #include "xt_RTPENGINE.h"
 #include "call.h"
 
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_MAX_SEGMENTS
+#define UDP_MAX_SEGMENTS 64
+#endif
+// the kernel rejects GSO sends whose total payload doesn't fit into one IP packet
+#define UDP_GSO_MAX_BYTES (0xffff - MAX_PACKET_HEADER_LEN)
+
 static int __ip4_addr_parse(sockaddr_t *dst, const char *src);
 static int __ip6_addr_parse(sockaddr_t *dst, const char *src);
 static int __ip4_addr_print(const sockaddr_t *a, char *buf, size_t len);
@@ -36,8 +48,10 @@ static int __ip4_addrport2sockaddr(void *, const sockaddr_t *, unsigned int);
 static int __ip6_addrport2sockaddr(void *, const sockaddr_t *, unsigned int);
 static ssize_t __ip_recvfrom(socket_t *s, void *buf, size_t len, endpoint_t *ep);
 static ssize_t __ip_recvfrom_ts(socket_t *s, void *buf, size_t len, endpoint_t *ep, struct timeval *);
+static int __ip_recvmmsg_ts(socket_t *s, struct socket_mmsg *, unsigned int);
 static ssize_t __ip_sendmsg(socket_t *s, struct msghdr *mh, const endpoint_t *ep);
 static ssize_t __ip_sendto(socket_t *s, const void *buf, size_t len, const endpoint_t *ep);
+static int __ip_sendmmsg(socket_t *s, struct socket_mmsg *, unsigned int);
 static int __ip4_tos(socket_t *, unsigned int);
 static int __ip6_tos(socket_t *, unsigned int);
 static int __ip_error(socket_t *s);
@@ -83,8 +97,10 @@ static struct socket_family __socket_families[__SF_LAST] = {
 		.timestamping		= __ip_timestamping,
 		.recvfrom		= __ip_recvfrom,
 		.recvfrom_ts		= __ip_recvfrom_ts,
+		.recvmmsg_ts		= __ip_recvmmsg_ts,
 		.sendmsg		= __ip_sendmsg,
 		.sendto			= __ip_sendto,
+		.sendmmsg		= __ip_sendmmsg,
 		.tos			= __ip4_tos,
 		.error			= __ip_error,
 		.endpoint2kernel	= __ip4_endpoint2kernel,
@@ -114,8 +130,10 @@ static struct socket_family __socket_families[__SF_LAST] = {
 		.timestamping		= __ip_timestamping,
 		.recvfrom		= __ip_recvfrom,
 		.recvfrom_ts		= __ip_recvfrom_ts,
+		.recvmmsg_ts		= __ip_recvmmsg_ts,
 		.sendmsg		= __ip_sendmsg,
 		.sendto			= __ip_sendto,
+		.sendmmsg		= __ip_sendmmsg,
 		.tos			= __ip6_tos,
 		.error			= __ip_error,
 		.endpoint2kernel	= __ip6_endpoint2kernel,
@@ -128,6 +146,9 @@ static struct socket_family __socket_families[__SF_LAST] = {
 
 socktype_t *socktype_udp;
 
+static int __udp_gso_unsupported;
+static int __sendmmsg_unsupported;
+
 
 
 
@@ -291,13 +312,33 @@ static int __ip_accept(socket_t *s, socket_t *newsock) {
 
 	return 0;
 }
+static void __ip_msg_ts(struct msghdr *msg, struct timeval *tv) {
+	struct cmsghdr *cm;
+
+	if (tv) {
+		for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+			if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_TIMESTAMP) {
+				*tv = *((struct timeval *) CMSG_DATA(cm));
+				tv = NULL;
+				break;
+			}
+		}
+		if (G_UNLIKELY(tv)) {
+			ilog(LOG_WARNING, "No receive timestamp received from kernel");
+			ZERO(*tv);
+		}
+	}
+	if (G_UNLIKELY((msg->msg_flags & MSG_TRUNC)))
+		ilog(LOG_WARNING, "Kernel indicates that data was truncated");
+	if (G_UNLIKELY((msg->msg_flags & MSG_CTRUNC)))
+		ilog(LOG_WARNING, "Kernel indicates that ancillary data was truncated");
+}
 static ssize_t __ip_recvfrom_ts(socket_t *s, void *buf, size_t len, endpoint_t *ep, struct timeval *tv) {
 	ssize_t ret;
 	struct sockaddr_storage sin;
 	struct msghdr msg;
 	struct iovec iov;
 	char ctrl[32];
-	struct cmsghdr *cm;
 
 	ZERO(msg);
 	msg.msg_name = &sin;
@@ -315,23 +356,42 @@ static ssize_t __ip_recvfrom_ts(socket_t *s, void *buf, size_t len, endpoint_t *
 		return ret;
 	s->family->sockaddr2endpoint(ep, &sin);
 
-	if (tv) {
-		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
-			if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_TIMESTAMP) {
-				*tv = *((struct timeval *) CMSG_DATA(cm));
-				tv = NULL;
-				break;
-			}
-		}
-		if (G_UNLIKELY(tv)) {
-			ilog(LOG_WARNING, "No receive timestamp received from kernel");
-			ZERO(*tv);
-		}
+	__ip_msg_ts(&msg, tv);
+
+	return ret;
+}
+/* returns number of datagrams received, or -1 with errno set */
+static int __ip_recvmmsg_ts(socket_t *s, struct socket_mmsg *mm, unsigned int num) {
+	int ret, i;
+	struct mmsghdr mh[SOCKET_MMSG_MAX];
+	struct iovec iov[SOCKET_MMSG_MAX];
+	struct sockaddr_storage sin[SOCKET_MMSG_MAX];
+	char ctrl[SOCKET_MMSG_MAX][32];
+
+	if (num > SOCKET_MMSG_MAX)
+		num = SOCKET_MMSG_MAX;
+
+	for (i = 0; i < num; i++) {
+		ZERO(mh[i]);
+		mh[i].msg_hdr.msg_name = &sin[i];
+		mh[i].msg_hdr.msg_namelen = s->family->sockaddr_size;
+		mh[i].msg_hdr.msg_iov = &iov[i];
+		mh[i].msg_hdr.msg_iovlen = 1;
+		mh[i].msg_hdr.msg_control = ctrl[i];
+		mh[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+		iov[i].iov_base = mm[i].buf;
+		iov[i].iov_len = mm[i].len;
+	}
+
+	ret = recvmmsg(s->fd, mh, num, 0, NULL);
+	if (ret <= 0)
+		return ret;
+
+	for (i = 0; i < ret; i++) {
+		s->family->sockaddr2endpoint(&mm[i].ep, &sin[i]);
+		mm[i].len = mh[i].msg_len;
+		__ip_msg_ts(&mh[i].msg_hdr, &mm[i].tv);
 	}
-	if (G_UNLIKELY((msg.msg_flags & MSG_TRUNC)))
-		ilog(LOG_WARNING, "Kernel indicates that data was truncated");
-	if (G_UNLIKELY((msg.msg_flags & MSG_CTRUNC)))
-		ilog(LOG_WARNING, "Kernel indicates that ancillary data was truncated");
 
 	return ret;
 }
@@ -353,6 +413,132 @@ static ssize_t __ip_sendto(socket_t *s, const void *buf, size_t len, const endpo
 	s->family->endpoint2sockaddr(&sin, ep);
 	return sendto(s->fd, buf, len, 0, (void *) &sin, s->family->sockaddr_size);
 }
+// UDP GSO: a single sendmsg() carrying all datagrams, to be split by the kernel into
+// segments of `seg_len` bytes. All datagrams must go to the same destination and all
+// but the last one must be exactly `seg_len` bytes long.
+static int __ip_sendmsg_gso(socket_t *s, struct socket_mmsg *mm, unsigned int num, unsigned int seg_len) {
+	struct sockaddr_storage sin;
+	struct msghdr mh;
+	struct iovec iov[SOCKET_MMSG_MAX];
+	char ctrl[CMSG_SPACE(sizeof(uint16_t))];
+	struct cmsghdr *cm;
+	unsigned int i;
+
+	ZERO(mh);
+	ZERO(ctrl);
+	s->family->endpoint2sockaddr(&sin, &mm[0].ep);
+	mh.msg_name = &sin;
+	mh.msg_namelen = s->family->sockaddr_size;
+	mh.msg_iov = iov;
+	mh.msg_iovlen = num;
+	mh.msg_control = ctrl;
+	mh.msg_controllen = sizeof(ctrl);
+
+	cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_UDP;
+	cm->cmsg_type = UDP_SEGMENT;
+	cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	*((uint16_t *) CMSG_DATA(cm)) = seg_len;
+
+	for (i = 0; i < num; i++) {
+		iov[i].iov_base = mm[i].buf;
+		iov[i].iov_len = mm[i].len;
+	}
+
+	if (sendmsg(s->fd, &mh, 0) < 0)
+		return -1;
+	return num;
+}
+// returns how many of the leading datagrams can be sent in a single GSO call, or 0
+static unsigned int __ip_gso_num(struct socket_mmsg *mm, unsigned int num) {
+	unsigned int i, total;
+
+	if (__udp_gso_unsupported)
+		return 0;
+	if (num > UDP_MAX_SEGMENTS)
+		num = UDP_MAX_SEGMENTS;
+
+	total = mm[0].len;
+	for (i = 1; i < num; i++) {
+		if (!endpoint_eq(&mm[i].ep, &mm[0].ep))
+			break;
+		if (mm[i].len > mm[0].len)
+			break;
+		if (total + mm[i].len > UDP_GSO_MAX_BYTES)
+			break;
+		total += mm[i].len;
+		// a shorter datagram ends the segment train
+		if (mm[i].len != mm[0].len) {
+			i++;
+			break;
+		}
+	}
+	return i < 2 ? 0 : i;
+}
+/* returns number of datagrams sent, or -1 with errno set */
+static int __ip_sendmmsg(socket_t *s, struct socket_mmsg *mm, unsigned int num) {
+	struct mmsghdr mh[SOCKET_MMSG_MAX];
+	struct iovec iov[SOCKET_MMSG_MAX];
+	struct sockaddr_storage sin[SOCKET_MMSG_MAX];
+	unsigned int i, gso;
+	int ret;
+
+	if (num > SOCKET_MMSG_MAX)
+		num = SOCKET_MMSG_MAX;
+
+	gso = s->no_gso ? 0 : __ip_gso_num(mm, num);
+	if (gso) {
+		ret = __ip_sendmsg_gso(s, mm, gso, mm[0].len);
+		if (ret >= 0)
+			return ret;
+		switch (errno) {
+			case ENOPROTOOPT:
+				ilog(LOG_INFO, "UDP segmentation offload not supported by the kernel, "
+						"using sendmmsg() instead");
+				__udp_gso_unsupported = 1;
+				break;
+			// EINVAL: segment size or count not acceptable for this route or device.
+			// EIO: no checksum offloading on the outgoing interface.
+			// Either way this socket's sends won't do better next time.
+			case EINVAL:
+			case EIO:
+				ilog(LOG_DEBUG, "UDP segmentation offload failed on socket (%s), "
+						"using sendmmsg() for it from now on", strerror(errno));
+				s->no_gso = 1;
+				break;
+			default:
+				return ret;
+		}
+	}
+
+	if (__sendmmsg_unsupported)
+		goto sendto;
+
+	for (i = 0; i < num; i++) {
+		ZERO(mh[i]);
+		s->family->endpoint2sockaddr(&sin[i], &mm[i].ep);
+		mh[i].msg_hdr.msg_name = &sin[i];
+		mh[i].msg_hdr.msg_namelen = s->family->sockaddr_size;
+		mh[i].msg_hdr.msg_iov = &iov[i];
+		mh[i].msg_hdr.msg_iovlen = 1;
+		iov[i].iov_base = mm[i].buf;
+		iov[i].iov_len = mm[i].len;
+	}
+
+	ret = sendmmsg(s->fd, mh, num, 0);
+	if (ret >= 0 || errno != ENOSYS)
+		return ret;
+
+	ilog(LOG_INFO, "sendmmsg() not supported by the kernel, falling back to sendto()");
+	__sendmmsg_unsupported = 1;
+
+sendto:
+	for (i = 0; i < num; i++) {
+		if (__ip_sendto(s, mm[i].buf, mm[i].len, &mm[i].ep) < 0)
+			return i ? i : -1;
+	}
+	return num;
+}
 static int __ip4_tos(socket_t *s, unsigned int tos) {
 	unsigned char ctos;
 	ctos = tos;
@@ -779,6 +965,21 @@ socktype_t *get_socket_type_c(const char *s) {
 
 
 
+static void __udp_gso_probe(void) {
+	int fd, val;
+	socklen_t len = sizeof(val);
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return;
+	if (getsockopt(fd, SOL_UDP, UDP_SEGMENT, &val, &len)) {
+		ilog(LOG_INFO, "UDP segmentation offload not supported by the kernel (%s)",
+				strerror(errno));
+		__udp_gso_unsupported = 1;
+	}
+	close(fd);
+}
+
 void socket_init(void) {
 	int i;
 
@@ -786,4 +987,6 @@ void socket_init(void) {
 		__socket_families[i].idx = i;
 
 	socktype_udp = get_socket_type_c("udp");
+
+	__udp_gso_probe();
 }
@@ -87,7 +87,7 @@ void statistics_update_foreignown_dec(struct call* c) {
 	if(IS_OWN_CALL(c)) 	{
 		mutex_lock(&rtpe_totalstats_interval.managed_sess_lock);
 		rtpe_totalstats_interval.managed_sess_min = MIN(rtpe_totalstats_interval.managed_sess_min,
-				g_hash_table_size(rtpe_callhash) - atomic64_get(&rtpe_stats.foreign_sessions));
+				atomic64_get(&rtpe_callhash_size) - atomic64_get(&rtpe_stats.foreign_sessions));
 		mutex_unlock(&rtpe_totalstats_interval.managed_sess_lock);
 	}
 
@@ -98,7 +98,7 @@ void statistics_update_foreignown_inc(struct call* c) {
 		mutex_lock(&rtpe_totalstats_interval.managed_sess_lock);
 		rtpe_totalstats_interval.managed_sess_max = MAX(
 				rtpe_totalstats_interval.managed_sess_max,
-				g_hash_table_size(rtpe_callhash)
+				atomic64_get(&rtpe_callhash_size)
 						- atomic64_get(&rtpe_stats.foreign_sessions));
 		mutex_unlock(&rtpe_totalstats_interval.managed_sess_lock);
 	}
@@ -0,0 +1,45 @@
+#include "thread_stats.h"
+#include <string.h>
+#include <stdlib.h>
+
+
+__thread struct thread_stats *thread_stats_local;
+
+static mutex_t thread_stats_lock = MUTEX_STATIC_INIT;
+static struct thread_stats *thread_stats_list;
+
+
+
+struct thread_stats *thread_stats_register(void) {
+	struct thread_stats *s;
+
+	if (posix_memalign((void **) &s, THREAD_STATS_ALIGN, sizeof(*s)))
+		abort();
+	memset(s, 0, sizeof(*s));
+
+	mutex_lock(&thread_stats_lock);
+	s->next = thread_stats_list;
+	thread_stats_list = s;
+	mutex_unlock(&thread_stats_lock);
+
+	// slabs are never freed, so that counts from threads that have exited remain
+	thread_stats_local = s;
+	return s;
+}
+
+void thread_stats_sum(struct thread_stats *out) {
+	struct thread_stats *s;
+
+	memset(out, 0, sizeof(*out));
+
+	mutex_lock(&thread_stats_lock);
+	for (s = thread_stats_list; s; s = s->next) {
+		atomic64_add_na(&out->packets, atomic64_get(&s->packets));
+		atomic64_add_na(&out->bytes, atomic64_get(&s->bytes));
+		atomic64_add_na(&out->errors, atomic64_get(&s->errors));
+		atomic64_add_na(&out->codec_buffer_hits, atomic64_get(&s->codec_buffer_hits));
+		atomic64_add_na(&out->codec_buffer_misses, atomic64_get(&s->codec_buffer_misses));
+		atomic64_add_na(&out->transcode_drops, atomic64_get(&s->transcode_drops));
+	}
+	mutex_unlock(&thread_stats_lock);
+}
@@ -0,0 +1,41 @@
+#ifndef _THREAD_STATS_H_
+#define _THREAD_STATS_H_
+
+#include <glib.h>
+#include "aux.h"
+
+/* slabs of different threads must not share a cache line */
+#define THREAD_STATS_ALIGN	64
+
+/* Global packet counters for the media path. Every thread counts into its own slab, which
+ * only that thread ever writes to, so the hot path has no atomic operations on shared
+ * cache lines. The counters are never reset; readers sum up all slabs and work with
+ * differences. */
+struct thread_stats {
+	atomic64		packets;
+	atomic64		bytes;
+	atomic64		errors;
+
+	// transcoder output buffer pool
+	atomic64		codec_buffer_hits;
+	atomic64		codec_buffer_misses;
+	atomic64		transcode_drops; // transcoding worker queue full
+
+	struct thread_stats	*next;
+} __attribute__ ((aligned (THREAD_STATS_ALIGN)));
+
+extern __thread struct thread_stats *thread_stats_local;
+
+struct thread_stats *thread_stats_register(void);
+void thread_stats_sum(struct thread_stats *out);
+
+INLINE struct thread_stats *thread_stats_get(void) {
+	if (G_UNLIKELY(!thread_stats_local))
+		return thread_stats_register();
+	return thread_stats_local;
+}
+
+#define thread_stats_add(field, n) atomic64_add_na(&thread_stats_get()->field, n)
+#define thread_stats_inc(field) thread_stats_add(field, 1)
+
+#endif
@@ -574,6 +574,9 @@ INLINE void atomic64_local_copy_zero(atomic64 *dst, atomic64 *src) {
 INLINE long long timeval_us(const struct timeval *t) {
 	return (long long) ((long long) t->tv_sec * 1000000LL) + t->tv_usec;
 }
+INLINE long long timeval_ms(const struct timeval *t) {
+	return (long long) ((long long) t->tv_sec * 1000LL) + t->tv_usec / 1000;
+}
 INLINE void timeval_from_us(struct timeval *t, long long ms) {
 	t->tv_sec = ms/1000000LL;
 	t->tv_usec = ms%1000000LL;
@@ -20,6 +20,7 @@
 #include "recording.h"
 #include "statistics.h"
 #include "codeclib.h"
+#include "poller.h"
 
 #define UNDEFINED ((unsigned int) -1)
 
@@ -276,6 +277,7 @@ struct packet_stream {
 
 	GQueue			sfds;		/* LOCK: call->master_lock */
 	struct stream_fd * volatile selected_sfd;
+	struct stream_fd	*kernel_sfd;	/* LOCK: in_lock, the one used when kernelized */
 	struct dtls_connection	ice_dtls;	/* LOCK: in_lock */
 	struct packet_stream	*rtp_sink;	/* LOCK: call->master_lock */
 	struct packet_stream	*rtcp_sink;	/* LOCK: call->master_lock */
@@ -289,6 +291,7 @@ struct packet_stream {
 
 	struct stats		stats;
 	struct stats		kernel_stats;
+	atomic64		kernel_stun;	/* STUN requests answered by the kernel module */
 	atomic64		last_packet;
 	GHashTable		*rtp_stats;	/* LOCK: call->master_lock */
 	volatile struct rtp_stats *rtp_stats_cache;
@@ -402,21 +405,27 @@ struct call {
 
 	unsigned int		redis_hosted_db;
 	unsigned int		foreign_call; // created_via_redis_notify call
+	unsigned int		redis_write_state; // protected by the redis write_lock
+	struct timeval		redis_dirty_since;
+	int			destroyed;
 
 	struct recording 	*recording;
+
+	struct poller_timer	timeout_timer; /* next check of the call's timeouts */
 };
 
 
 
-extern rwlock_t rtpe_callhash_lock;
-extern GHashTable *rtpe_callhash;
+extern atomic64 rtpe_callhash_size;	/* number of calls in the call hash */
 
-extern struct stats rtpe_statsps;	/* per second stats, running timer */
-extern struct stats rtpe_stats;		/* copied from statsps once a second */
+extern struct stats rtpe_statsps;	/* per second request stats, running timer */
+extern struct stats rtpe_stats;		/* updated once a second from statsps and thread_stats */
 
 
 int call_init(void);
 void call_get_all_calls(GQueue *q);
+void call_get_some_calls(GQueue *q, unsigned int limit);
+void call_timer_schedule(struct call *, time_t);
 
 struct call_monologue *__monologue_create(struct call *call);
 void __monologue_tag(struct call_monologue *ml, const str *tag);
@@ -86,6 +86,7 @@ struct crypto_context {
 	/* <from, to>? */
 
 	void *session_key_ctx[2];
+	void *session_hmac_ctx;
 
 	int have_session_key:1;
 };
@@ -16,6 +16,7 @@
 
 
 struct media_packet;
+struct poller;
 
 typedef int rtcp_filter_func(struct media_packet *, GQueue *);
 
@@ -36,6 +37,12 @@ struct port_pool {
 	volatile unsigned int		free_ports;
 
 	unsigned int			min, max;
+
+	/* pre-bound sockets, only used with --socket-pool */
+	mutex_t				sock_pool_lock;
+	GQueue				sock_pool; /* socket_t, consecutive RTP/RTCP pairs ready for use */
+	GHashTable			*sock_pool_single; /* port -> socket_t, released and waiting for its pair */
+	volatile unsigned int		sock_pool_ports; /* == sock_pool.length */
 };
 struct intf_address {
 	socktype_t			*type;
@@ -70,6 +77,7 @@ struct stream_fd {
 	socket_t			socket;		/* RO */
 	const struct local_intf		*local_intf;	/* RO */
 	struct call			*call;		/* RO */
+	struct poller			*poller;	/* RO */
 	struct packet_stream		*stream;	/* LOCK: call->master_lock */
 	struct crypto_context		crypto;		/* IN direction, LOCK: stream->in_lock */
 	struct dtls_connection		dtls;		/* LOCK: stream->in_lock */
@@ -108,6 +116,9 @@ int is_local_endpoint(const struct intf_address *addr, unsigned int port);
 int __get_consecutive_ports(GQueue *out, unsigned int num_ports, unsigned int wanted_start_port,
 		struct intf_spec *spec, const str *);
 int get_consecutive_ports(GQueue *out, unsigned int num_ports, const struct logical_intf *log, const str *);
+void socket_pool_loop(void *);
+void transcode_workers_init(void);
+void transcode_worker_loop(void *);
 struct stream_fd *stream_fd_new(socket_t *fd, struct call *call, const struct local_intf *lif);
 
 void free_intf_list(struct intf_list *il);
@@ -120,6 +131,7 @@ INLINE int open_intf_socket(socket_t *r, unsigned int port, const struct local_i
 void kernelize(struct packet_stream *);
 void __unkernelize(struct packet_stream *);
 void unkernelize(struct packet_stream *);
+struct stream_fd *kernel_stream_fd_get(const endpoint_t *);
 void __stream_unconfirm(struct packet_stream *);
 
 /* XXX shouldn't be necessary */
@@ -27,12 +27,17 @@ struct call_media;
 
 struct recording_pcap {
 	FILE          *meta_fp;
-	pcap_t        *recording_pd;
-	pcap_dumper_t *recording_pdumper;
+	int           recording_fd;
 	uint64_t      packet_num;
+	uint64_t      dropped;
 	char          *recording_path;
 
-	mutex_t       recording_lock;
+	mutex_t       recording_lock; // for the fields below
+	GString       *buf; // packets waiting to be written
+	int           queued; // waiting for the writer thread
+
+	mutex_t       write_lock; // held while the writer thread is writing
+	GString       *wbuf; // packets being written
 };
 
 struct recording_proc {
@@ -73,6 +78,7 @@ struct recording_method {
 	void (*meta_chunk)(struct recording *, const char *, const str *);
 
 	void (*dump_packet)(struct recording *, struct packet_stream *sink, const str *s);
+	void (*flush_packets)(void);
 	void (*finish)(struct call *);
 	void (*response)(struct recording *, bencode_item_t *);
 
@@ -80,6 +86,8 @@ struct recording_method {
 	void (*setup_stream)(struct packet_stream *);
 	void (*setup_media)(struct call_media *);
 	void (*stream_kernel_info)(struct packet_stream *, struct rtpengine_target_info *);
+
+	void (*writer_loop)(void *);
 };
 
 extern const struct recording_method *selected_recording_method;
@@ -184,6 +192,13 @@ void recording_finish(struct call *);
 // void dump_packet(struct recording *, struct packet_stream *, str *s);
 #define dump_packet(args...) _rm_chk(dump_packet, args)
 
+/**
+ * Submits packets previously passed to dump_packet() that the recording method
+ * buffered. Called by the media threads at the end of each batch of received
+ * packets, while the call is still locked.
+ */
+#define recording_flush_packets() _rm(flush_packets)
+
 
 
 #define recording_setup_stream(args...) _rm(setup_stream, args)
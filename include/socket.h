@@ -4,6 +4,7 @@
 
 #include <arpa/inet.h>
 #include <sys/types.h>
+#include <sys/time.h>
 
 
 
@@ -21,6 +22,7 @@ struct socket_type;
 struct socket_family;
 struct endpoint;
 struct socket;
+struct socket_mmsg;
 struct re_address;
 
 typedef struct socket_address sockaddr_t;
@@ -35,6 +37,7 @@ typedef const struct socket_family sockfamily_t;
 
 
 #define MAX_PACKET_HEADER_LEN 48 // 40 bytes IPv6 + 8 bytes UDP
+#define SOCKET_MMSG_MAX 16 // max number of datagrams per recvmmsg()/sendmmsg() call
 
 
 
@@ -69,8 +72,10 @@ struct socket_family {
 	int				(*timestamping)(socket_t *);
 	ssize_t				(*recvfrom)(socket_t *, void *, size_t, endpoint_t *);
 	ssize_t				(*recvfrom_ts)(socket_t *, void *, size_t, endpoint_t *, struct timeval *);
+	int				(*recvmmsg_ts)(socket_t *, struct socket_mmsg *, unsigned int);
 	ssize_t				(*sendmsg)(socket_t *, struct msghdr *, const endpoint_t *);
 	ssize_t				(*sendto)(socket_t *, const void *, size_t, const endpoint_t *);
+	int				(*sendmmsg)(socket_t *, struct socket_mmsg *, unsigned int);
 	int				(*tos)(socket_t *, unsigned int);
 	int				(*error)(socket_t *);
 	void				(*endpoint2kernel)(struct re_address *, const endpoint_t *);
@@ -94,6 +99,13 @@ struct socket {
 	sockfamily_t			*family;
 	endpoint_t			local;
 	endpoint_t			remote;
+	int				no_gso; /* UDP GSO failed on this socket's route, don't retry */
+};
+struct socket_mmsg {
+	void				*buf;
+	size_t				len; /* buffer size on input, received length on output */
+	endpoint_t			ep; /* source address when receiving, destination when sending */
+	struct timeval			tv; /* receive timestamp */
 };
 
 
@@ -162,8 +174,10 @@ INLINE int is_addr_unspecified(const sockaddr_t *a) {
 }
 #define socket_recvfrom(s,a...) (s)->family->recvfrom((s), a)
 #define socket_recvfrom_ts(s,a...) (s)->family->recvfrom_ts((s), a)
+#define socket_recvmmsg_ts(s,a...) (s)->family->recvmmsg_ts((s), a)
 #define socket_sendmsg(s,a...) (s)->family->sendmsg((s), a)
 #define socket_sendto(s,a...) (s)->family->sendto((s), a)
+#define socket_sendmmsg(s,a...) (s)->family->sendmmsg((s), a)
 #define socket_error(s) (s)->family->error((s))
 #define socket_timestamping(s) (s)->family->timestamping((s))
 INLINE ssize_t socket_sendiov(socket_t *s, const struct iovec *v, unsigned int len, const endpoint_t *dst) {
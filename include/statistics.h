@@ -47,6 +47,7 @@ struct totalstats {
 	atomic64		total_relayed_errors;
 	atomic64		total_nopacket_relayed_sess;
 	atomic64		total_oneway_stream_sess;
+	atomic64		total_recording_dropped_packets;
 
 	u_int64_t               foreign_sessions;
 	u_int64_t               own_sessions;
@@ -17,6 +17,10 @@
 #include <net/dst.h>
 #include <linux/proc_fs.h>
 #include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/log2.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0)
 #include <linux/bsearch.h>
 #endif
@@ -40,7 +44,7 @@ MODULE_LICENSE("GPL");
 
 
 #define MAX_ID 64 /* - 1 */
-#define MAX_SKB_TAIL_ROOM (sizeof(((struct rtpengine_srtp *) 0)->mki) + 20)
+#define MAX_SKB_TAIL_ROOM (sizeof(((struct rtpengine_srtp *) 0)->mki) + 20 + sizeof(u_int32_t)) /* MKI, auth tag, SRTCP index */
 
 #define MIPF		"%i:%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x:%u"
 #define MIPP(x)		(x).family,		\
@@ -149,6 +153,7 @@ MODULE_LICENSE("GPL");
 struct re_hmac;
 struct re_cipher;
 struct rtp_parsed;
+struct rtcp_parsed;
 struct re_crypto_context;
 struct re_auto_array;
 struct re_call;
@@ -209,6 +214,7 @@ static int proc_list_show(struct seq_file *, void *);
 static int proc_blist_open(struct inode *, struct file *);
 static int proc_blist_close(struct inode *, struct file *);
 static ssize_t proc_blist_read(struct file *, char __user *, size_t, loff_t *);
+static ssize_t proc_stats_read(struct file *, char __user *, size_t, loff_t *);
 
 static int proc_main_list_open(struct inode *, struct file *);
 
@@ -221,6 +227,7 @@ static int proc_stream_open(struct inode *i, struct file *f);
 static int proc_stream_close(struct inode *i, struct file *f);
 static ssize_t proc_stream_read(struct file *f, char __user *b, size_t l, loff_t *o);
 static unsigned int proc_stream_poll(struct file *f, struct poll_table_struct *p);
+static long proc_stream_ioctl(struct file *f, unsigned int cmd, unsigned long arg);
 
 static void table_put(struct rtpengine_table *);
 static struct rtpengine_target *get_target(struct rtpengine_table *, const struct re_address *);
@@ -231,6 +238,10 @@ static int srtp_encrypt_aes_cm(struct re_crypto_context *, struct rtpengine_srtp
 		struct rtp_parsed *, u_int64_t);
 static int srtp_encrypt_aes_f8(struct re_crypto_context *, struct rtpengine_srtp *,
 		struct rtp_parsed *, u_int64_t);
+static int srtcp_encrypt_aes_cm(struct re_crypto_context *, struct rtpengine_srtp *,
+		struct rtcp_parsed *, u_int32_t);
+static int srtcp_encrypt_aes_f8(struct re_crypto_context *, struct rtpengine_srtp *,
+		struct rtcp_parsed *, u_int32_t);
 
 static void call_put(struct re_call *call);
 static void del_stream(struct re_stream *stream, struct rtpengine_table *);
@@ -256,29 +267,41 @@ struct re_crypto_context {
 	const struct re_hmac		*hmac;
 };
 
-struct rtpengine_stats_a {
-	atomic64_t			packets;
-	atomic64_t			bytes;
-	atomic64_t			errors;
-	u_int64_t			delay_min;
-	u_int64_t			delay_avg;
-	u_int64_t			delay_max;
-	atomic_t          in_tos;
+#define RE_DELAY_BUCKETS 16 /* log2 of the delay in microseconds, the last one catches everything above */
+/* one per CPU per target, summed up when the stats are read */
+struct rtpengine_stats_pcpu {
+	struct u64_stats_sync		syncp;
+	u64				packets;
+	u64				bytes;
+	u64				errors;
+	u64				stun;
+	struct rtpengine_rtp_stats	rtp_stats[NUM_PAYLOAD_TYPES];
+#if (RE_HAS_MEASUREDELAY)
+	u64				delay_min; /* nanoseconds */
+	u64				delay_max;
+	u64				delay_sum;
+	u64				delay_count;
+	u32				delay_hist[RE_DELAY_BUCKETS];
+#endif
 };
-struct rtpengine_rtp_stats_a {
-	atomic64_t			packets;
-	atomic64_t			bytes;
+struct rtpengine_output {
+	struct re_crypto_context	encrypt;
+	struct re_crypto_context	rtcp_encrypt; /* only set up with rtcp_fwd. lock protects encrypt.rtcp_index */
 };
 struct rtpengine_target {
 	atomic_t			refcnt;
+	struct rcu_head			rcu;
 	u_int32_t			table;
 	struct rtpengine_target_info	target;
 
-	struct rtpengine_stats_a	stats;
-	struct rtpengine_rtp_stats_a	rtp_stats[NUM_PAYLOAD_TYPES];
+	struct rtpengine_stats_pcpu __percpu *stats;
+	atomic_t			in_tos; /* of the first packet, -1 until then */
 
 	struct re_crypto_context	decrypt;
-	struct re_crypto_context	encrypt;
+	struct re_crypto_context	rtcp_decrypt; /* only set up with rtcp_fwd */
+	struct rtpengine_output		outputs[MAX_OUTPUTS]; /* same order as target.outputs */
+
+	struct crypto_shash		*stun_shash; /* HMAC-SHA1 keyed with the local ICE password */
 };
 
 struct re_bitfield {
@@ -287,6 +310,7 @@ struct re_bitfield {
 };
 
 struct re_bucket {
+	struct rcu_head			rcu;
 	struct re_bitfield		ports_lo_bf;
 	struct rtpengine_target		*ports_lo[256];
 };
@@ -359,7 +383,7 @@ struct re_stream {
 #define RE_HASH_BITS 8 /* make configurable? */
 struct rtpengine_table {
 	atomic_t			refcnt;
-	rwlock_t			target_lock;
+	rwlock_t			target_lock; /* serializes changes to dest_addr_hash, which is read under RCU */
 	pid_t				pid;
 
 	unsigned int			id;
@@ -368,6 +392,7 @@ struct rtpengine_table {
 	struct proc_dir_entry		*proc_control;
 	struct proc_dir_entry		*proc_list;
 	struct proc_dir_entry		*proc_blist;
+	struct proc_dir_entry		*proc_stats;
 	struct proc_dir_entry		*proc_calls;
 
 	struct re_dest_addr_hash	dest_addr_hash;
@@ -391,6 +416,10 @@ struct re_cipher {
 	int				(*encrypt)(struct re_crypto_context *, struct rtpengine_srtp *,
 			struct rtp_parsed *, u_int64_t);
 	int				(*session_key_init)(struct re_crypto_context *, struct rtpengine_srtp *);
+	int				(*rtcp_decrypt)(struct re_crypto_context *, struct rtpengine_srtp *,
+			struct rtcp_parsed *, u_int32_t);
+	int				(*rtcp_encrypt)(struct re_crypto_context *, struct rtpengine_srtp *,
+			struct rtcp_parsed *, u_int32_t);
 };
 
 struct re_hmac {
@@ -422,6 +451,22 @@ struct rtp_parsed {
 	int				ok;
 };
 
+/* only the part up to and including the sender SSRC, which is what SRTCP cares about */
+struct rtcp_header {
+	unsigned char v_p_rc;
+	unsigned char pt;
+	u_int16_t length;
+	u_int32_t ssrc;
+} __attribute__ ((packed));
+
+struct rtcp_parsed {
+	struct rtcp_header		*header;
+	unsigned int			header_len;
+	unsigned char			*payload;
+	unsigned int			payload_len;
+	int				ok;
+};
+
 
 
 
@@ -480,6 +525,13 @@ static const struct file_operations proc_blist_ops = {
 	.release		= proc_blist_close,
 };
 
+static const struct file_operations proc_stats_ops = {
+	.owner			= THIS_MODULE,
+	.open			= proc_blist_open,
+	.read			= proc_stats_read,
+	.release		= proc_blist_close,
+};
+
 static const struct seq_operations proc_list_seq_ops = {
 	.start			= proc_list_start,
 	.next			= proc_list_next,
@@ -506,6 +558,7 @@ static const struct file_operations proc_stream_ops = {
 	.owner			= THIS_MODULE,
 	.read			= proc_stream_read,
 	.poll			= proc_stream_poll,
+	.unlocked_ioctl		= proc_stream_ioctl,
 	.open			= proc_stream_open,
 	.release		= proc_stream_close,
 };
@@ -525,6 +578,8 @@ static const struct re_cipher re_ciphers[] = {
 		.tfm_name	= "aes",
 		.decrypt	= srtp_encrypt_aes_cm,
 		.encrypt	= srtp_encrypt_aes_cm,
+		.rtcp_decrypt	= srtcp_encrypt_aes_cm,
+		.rtcp_encrypt	= srtcp_encrypt_aes_cm,
 	},
 	[REC_AES_F8] = {
 		.id		= REC_AES_F8,
@@ -533,6 +588,8 @@ static const struct re_cipher re_ciphers[] = {
 		.decrypt	= srtp_encrypt_aes_f8,
 		.encrypt	= srtp_encrypt_aes_f8,
 		.session_key_init = aes_f8_session_key_init,
+		.rtcp_decrypt	= srtcp_encrypt_aes_f8,
+		.rtcp_encrypt	= srtcp_encrypt_aes_f8,
 	},
 	[REC_AES_CM_192] = {
 		.id		= REC_AES_CM_192,
@@ -540,6 +597,8 @@ static const struct re_cipher re_ciphers[] = {
 		.tfm_name	= "aes",
 		.decrypt	= srtp_encrypt_aes_cm,
 		.encrypt	= srtp_encrypt_aes_cm,
+		.rtcp_decrypt	= srtcp_encrypt_aes_cm,
+		.rtcp_encrypt	= srtcp_encrypt_aes_cm,
 	},
 	[REC_AES_CM_256] = {
 		.id		= REC_AES_CM_256,
@@ -547,6 +606,8 @@ static const struct re_cipher re_ciphers[] = {
 		.tfm_name	= "aes",
 		.decrypt	= srtp_encrypt_aes_cm,
 		.encrypt	= srtp_encrypt_aes_cm,
+		.rtcp_decrypt	= srtcp_encrypt_aes_cm,
+		.rtcp_encrypt	= srtcp_encrypt_aes_cm,
 	},
 };
 
@@ -736,6 +797,11 @@ static int table_create_proc(struct rtpengine_table *t, u_int32_t id) {
 	if (!t->proc_blist)
 		return -1;
 
+	t->proc_stats = proc_create_user("stats", S_IFREG | S_IRUGO, t->proc_root,
+			&proc_stats_ops, (void *) (unsigned long) id);
+	if (!t->proc_stats)
+		return -1;
+
 	t->proc_calls = proc_mkdir_user("calls", S_IRUGO | S_IXUGO, t->proc_root);
 	if (!t->proc_calls)
 		return -1;
@@ -768,8 +834,8 @@ static struct rtpengine_table *new_table_link(u_int32_t id) {
 	}
 
 	ref_get(t);
-	table[id] = t;
 	t->id = id;
+	rcu_assign_pointer(table[id], t);
 	write_unlock_irqrestore(&table_lock, flags);
 
 	if (table_create_proc(t, id))
@@ -789,11 +855,40 @@ static void free_crypto_context(struct re_crypto_context *c) {
 	for (i = 0; i < ARRAY_SIZE(c->tfm); i++) {
 		if (c->tfm[i])
 			crypto_free_cipher(c->tfm[i]);
+		c->tfm[i] = NULL;
 	}
 	if (c->shash)
 		crypto_free_shash(c->shash);
+	c->shash = NULL;
 }
 
+static void free_target_crypto(struct rtpengine_target *t) {
+	int i;
+
+	free_crypto_context(&t->decrypt);
+	free_crypto_context(&t->rtcp_decrypt);
+	for (i = 0; i < ARRAY_SIZE(t->outputs); i++) {
+		free_crypto_context(&t->outputs[i].encrypt);
+		free_crypto_context(&t->outputs[i].rtcp_encrypt);
+	}
+	if (t->stun_shash)
+		crypto_free_shash(t->stun_shash);
+	t->stun_shash = NULL;
+}
+
+static void target_free_rcu(struct rcu_head *head) {
+	struct rtpengine_target *t = container_of(head, struct rtpengine_target, rcu);
+
+	DBG("Freeing target\n");
+
+	free_target_crypto(t);
+	free_percpu(t->stats);
+
+	kfree(t);
+}
+
+/* the packet path uses targets under RCU without holding a reference,
+ * so the memory is released only after a grace period */
 static void target_put(struct rtpengine_target *t) {
 	if (!t)
 		return;
@@ -801,12 +896,7 @@ static void target_put(struct rtpengine_target *t) {
 	if (!atomic_dec_and_test(&t->refcnt))
 		return;
 
-	DBG("Freeing target\n");
-
-	free_crypto_context(&t->decrypt);
-	free_crypto_context(&t->encrypt);
-
-	kfree(t);
+	call_rcu(&t->rcu, target_free_rcu);
 }
 
 
@@ -818,6 +908,89 @@ static void target_get(struct rtpengine_target *t) {
 	atomic_inc(&t->refcnt);
 }
 
+/* adds up the per-CPU stats into "out" and "rtp_stats", which must be zeroed. "hist" may be NULL */
+static void target_stats_sum(const struct rtpengine_target *g, struct rtpengine_stats *out,
+		struct rtpengine_rtp_stats *rtp_stats, u64 *hist)
+{
+	const struct rtpengine_stats_pcpu *p;
+	struct rtpengine_stats_pcpu c;
+	unsigned int start;
+	int cpu, i;
+#if (RE_HAS_MEASUREDELAY)
+	u64 delay_sum = 0, delay_count = 0;
+#endif
+
+	for_each_possible_cpu(cpu) {
+		p = per_cpu_ptr(g->stats, cpu);
+		do {
+			start = u64_stats_fetch_begin(&p->syncp);
+			memcpy(&c, p, sizeof(c));
+		} while (u64_stats_fetch_retry(&p->syncp, start));
+
+		out->packets += c.packets;
+		out->bytes += c.bytes;
+		out->errors += c.errors;
+		out->stun += c.stun;
+		for (i = 0; i < NUM_PAYLOAD_TYPES; i++) {
+			rtp_stats[i].packets += c.rtp_stats[i].packets;
+			rtp_stats[i].bytes += c.rtp_stats[i].bytes;
+		}
+
+#if (RE_HAS_MEASUREDELAY)
+		if (!c.delay_count)
+			continue;
+		if (!delay_count || c.delay_min < out->delay_min)
+			out->delay_min = c.delay_min;
+		if (c.delay_max > out->delay_max)
+			out->delay_max = c.delay_max;
+		delay_sum += c.delay_sum;
+		delay_count += c.delay_count;
+		if (hist) {
+			for (i = 0; i < RE_DELAY_BUCKETS; i++)
+				hist[i] += c.delay_hist[i];
+		}
+#endif
+	}
+
+#if (RE_HAS_MEASUREDELAY)
+	if (delay_count)
+		out->delay_avg = div64_u64(delay_sum, delay_count);
+#endif
+
+	i = atomic_read(&g->in_tos);
+	out->in_tos = i < 0 ? 0 : i;
+}
+
+static void target_stats_error(struct rtpengine_target *g) {
+	struct rtpengine_stats_pcpu *s;
+
+	s = get_cpu_ptr(g->stats);
+	u64_stats_update_begin(&s->syncp);
+	s->errors++;
+	u64_stats_update_end(&s->syncp);
+	put_cpu_ptr(g->stats);
+}
+
+#if (RE_HAS_MEASUREDELAY)
+/* must be called within u64_stats_update_begin/end */
+static inline void target_stats_delay(struct rtpengine_stats_pcpu *s, u64 delay) {
+	unsigned int b;
+
+	if (!s->delay_count || delay < s->delay_min)
+		s->delay_min = delay;
+	if (delay > s->delay_max)
+		s->delay_max = delay;
+	s->delay_sum += delay;
+	s->delay_count++;
+
+	delay = div_u64(delay, 1000);
+	b = delay ? ilog2(delay) + 1 : 0;
+	if (b >= RE_DELAY_BUCKETS)
+		b = RE_DELAY_BUCKETS - 1;
+	s->delay_hist[b]++;
+}
+#endif
+
 
 
 
@@ -846,6 +1019,7 @@ static void clear_table_proc_files(struct rtpengine_table *t) {
 	clear_proc(&t->proc_control);
 	clear_proc(&t->proc_list);
 	clear_proc(&t->proc_blist);
+	clear_proc(&t->proc_stats);
 	clear_proc(&t->proc_calls);
 	clear_proc(&t->proc_root);
 }
@@ -863,6 +1037,9 @@ static void table_put(struct rtpengine_table *t) {
 
 	DBG("Freeing table\n");
 
+	/* the table has been unlinked, but the packet path may still be using it */
+	synchronize_rcu();
+
 	for (k = 0; k < 256; k++) {
 		rda = t->dest_addr_hash.addrs[k];
 		if (!rda)
@@ -995,7 +1172,7 @@ static int unlink_table(struct rtpengine_table *t) {
 		write_unlock_irqrestore(&table_lock, flags);
 		return -EBUSY;
 	}
-	table[t->id] = NULL;
+	RCU_INIT_POINTER(table[t->id], NULL);
 	t->id = -1;
 	write_unlock_irqrestore(&table_lock, flags);
 
@@ -1033,6 +1210,13 @@ static struct rtpengine_table *get_table(unsigned int id) {
 	return t;
 }
 
+/* must be called under rcu_read_lock(). doesn't take a reference */
+static struct rtpengine_table *get_table_rcu(unsigned int id) {
+	if (id >= MAX_ID)
+		return NULL;
+	return rcu_dereference(table[id]);
+}
+
 
 
 
@@ -1183,7 +1367,7 @@ static inline struct rtpengine_target *find_next_target(struct rtpengine_table *
 	struct re_bucket *b;
 	unsigned char hi, lo, ab;
 	unsigned int rda_b, hi_b, lo_b;
-	struct rtpengine_target *g;
+	struct rtpengine_target *g = NULL;
 
 	if (*port < 0)
 		return NULL;
@@ -1334,26 +1518,21 @@ static ssize_t proc_blist_read(struct file *f, char __user *b, size_t l, loff_t
 
 	memcpy(&opp->target, &g->target, sizeof(opp->target));
 
-	opp->stats.packets = atomic64_read(&g->stats.packets);
-	opp->stats.bytes = atomic64_read(&g->stats.bytes);
-	opp->stats.errors = atomic64_read(&g->stats.errors);
-	opp->stats.delay_min = g->stats.delay_min;
-	opp->stats.delay_max = g->stats.delay_max;
-	opp->stats.delay_avg = g->stats.delay_avg;
-	opp->stats.in_tos = atomic_read(&g->stats.in_tos);
-
-	for (i = 0; i < g->target.num_payload_types; i++) {
-		opp->rtp_stats[i].packets = atomic64_read(&g->rtp_stats[i].packets);
-		opp->rtp_stats[i].bytes = atomic64_read(&g->rtp_stats[i].bytes);
-	}
+	target_stats_sum(g, &opp->stats, opp->rtp_stats, NULL);
 
 	spin_lock_irqsave(&g->decrypt.lock, flags);
 	opp->target.decrypt.last_index = g->target.decrypt.last_index;
 	spin_unlock_irqrestore(&g->decrypt.lock, flags);
 
-	spin_lock_irqsave(&g->encrypt.lock, flags);
-	opp->target.encrypt.last_index = g->target.encrypt.last_index;
-	spin_unlock_irqrestore(&g->encrypt.lock, flags);
+	for (i = 0; i < g->target.num_outputs; i++) {
+		spin_lock_irqsave(&g->outputs[i].encrypt.lock, flags);
+		opp->target.outputs[i].encrypt.last_index = g->target.outputs[i].encrypt.last_index;
+		spin_unlock_irqrestore(&g->outputs[i].encrypt.lock, flags);
+
+		spin_lock_irqsave(&g->outputs[i].rtcp_encrypt.lock, flags);
+		opp->target.outputs[i].encrypt.rtcp_index = g->target.outputs[i].encrypt.rtcp_index;
+		spin_unlock_irqrestore(&g->outputs[i].rtcp_encrypt.lock, flags);
+	}
 
 	target_put(g);
 
@@ -1372,6 +1551,88 @@ err:
 	return err;
 }
 
+/* fills the buffer with as many stats entries as fit, one per target. an
+ * entry carries only what the daemon needs to pick up, so that all targets
+ * can be read with a handful of reads */
+static ssize_t proc_stats_read(struct file *f, char __user *b, size_t l, loff_t *o) {
+	struct inode *inode;
+	u_int32_t id;
+	struct rtpengine_table *t;
+	struct rtpengine_stats_entry *ent;
+	int port, addr_bucket;
+	struct rtpengine_target *g;
+	unsigned long flags;
+	size_t pos = 0;
+
+	if (l < sizeof(*ent))
+		return -EINVAL;
+	if (*o < 0)
+		return -EINVAL;
+
+	inode = f->f_path.dentry->d_inode;
+	id = (u_int32_t) (unsigned long) PDE_DATA(inode);
+	t = get_table(id);
+	if (!t)
+		return -ENOENT;
+
+	ent = kmalloc(sizeof(*ent), GFP_KERNEL);
+	if (!ent) {
+		table_put(t);
+		return -ENOMEM;
+	}
+
+	addr_bucket = ((int) *o) >> 17;
+	port = ((int) *o) & 0x1ffff;
+
+	while (pos + sizeof(*ent) <= l) {
+		g = find_next_target(t, &addr_bucket, &port);
+		if (!g) {
+			/* don't wrap around to the beginning on the next read */
+			addr_bucket = 256;
+			port = 0;
+			break;
+		}
+
+		memset(ent, 0, sizeof(*ent));
+		ent->local = g->target.local;
+		memcpy(ent->payload_types, g->target.payload_types, sizeof(ent->payload_types));
+		ent->num_payload_types = g->target.num_payload_types;
+		ent->ssrc = g->target.ssrc;
+		ent->rtcp_fwd = g->target.rtcp_fwd;
+
+		target_stats_sum(g, &ent->stats, ent->rtp_stats, NULL);
+
+		spin_lock_irqsave(&g->decrypt.lock, flags);
+		ent->decrypt_last_index = g->target.decrypt.last_index;
+		spin_unlock_irqrestore(&g->decrypt.lock, flags);
+
+		if (g->target.num_outputs) {
+			spin_lock_irqsave(&g->outputs[0].encrypt.lock, flags);
+			ent->encrypt_last_index = g->target.outputs[0].encrypt.last_index;
+			spin_unlock_irqrestore(&g->outputs[0].encrypt.lock, flags);
+
+			spin_lock_irqsave(&g->outputs[0].rtcp_encrypt.lock, flags);
+			ent->encrypt_rtcp_index = g->target.outputs[0].encrypt.rtcp_index;
+			spin_unlock_irqrestore(&g->outputs[0].rtcp_encrypt.lock, flags);
+		}
+
+		target_put(g);
+
+		if (copy_to_user(b + pos, ent, sizeof(*ent))) {
+			kfree(ent);
+			table_put(t);
+			return -EFAULT;
+		}
+		pos += sizeof(*ent);
+	}
+
+	*o = (addr_bucket << 17) | port;
+
+	kfree(ent);
+	table_put(t);
+	return pos;
+}
+
 static int proc_list_open(struct inode *i, struct file *f) {
 	int err;
 	struct seq_file *p;
@@ -1483,28 +1744,59 @@ static void proc_list_crypto_print(struct seq_file *f, struct re_crypto_context
 
 static int proc_list_show(struct seq_file *f, void *v) {
 	struct rtpengine_target *g = v;
+	struct rtpengine_stats stats;
+	struct rtpengine_rtp_stats rtp_stats[NUM_PAYLOAD_TYPES];
+	u64 hist[RE_DELAY_BUCKETS];
 	int i;
 
+	memset(&stats, 0, sizeof(stats));
+	memset(rtp_stats, 0, sizeof(rtp_stats));
+	memset(hist, 0, sizeof(hist));
+	target_stats_sum(g, &stats, rtp_stats, hist);
+
 	seq_printf(f, "local ");
 	seq_addr_print(f, &g->target.local);
 	seq_printf(f, "\n");
-	proc_list_addr_print(f, "src", &g->target.src_addr);
-	proc_list_addr_print(f, "dst", &g->target.dst_addr);
-	proc_list_addr_print(f, "mirror", &g->target.mirror_addr);
 	proc_list_addr_print(f, "expect", &g->target.expected_src);
 	if (g->target.src_mismatch > 0 && g->target.src_mismatch <= ARRAY_SIZE(re_msm_strings))
 		seq_printf(f, "    src mismatch action: %s\n", re_msm_strings[g->target.src_mismatch]);
 	seq_printf(f, "    stats: %20llu bytes, %20llu packets, %20llu errors\n",
-		(unsigned long long) atomic64_read(&g->stats.bytes),
-		(unsigned long long) atomic64_read(&g->stats.packets),
-		(unsigned long long) atomic64_read(&g->stats.errors));
+		(unsigned long long) stats.bytes,
+		(unsigned long long) stats.packets,
+		(unsigned long long) stats.errors);
+	if (g->target.stun_reply) {
+		seq_printf(f, "    STUN: %llu binding requests answered from ",
+			(unsigned long long) stats.stun);
+		seq_addr_print(f, &g->target.ice.remote);
+		seq_printf(f, "\n");
+	}
 	for (i = 0; i < g->target.num_payload_types; i++)
 		seq_printf(f, "        RTP payload type %3u: %20llu bytes, %20llu packets\n",
 			g->target.payload_types[i],
-			(unsigned long long) atomic64_read(&g->rtp_stats[i].bytes),
-			(unsigned long long) atomic64_read(&g->rtp_stats[i].packets));
+			(unsigned long long) rtp_stats[i].bytes,
+			(unsigned long long) rtp_stats[i].packets);
+#if (RE_HAS_MEASUREDELAY)
+	seq_printf(f, "    delay: min %llu ns, avg %llu ns, max %llu ns\n",
+		(unsigned long long) stats.delay_min,
+		(unsigned long long) stats.delay_avg,
+		(unsigned long long) stats.delay_max);
+	seq_printf(f, "        histogram (us):");
+	for (i = 0; i < RE_DELAY_BUCKETS; i++)
+		seq_printf(f, " %s%u:%llu", i == RE_DELAY_BUCKETS - 1 ? ">=" : "<",
+			i == RE_DELAY_BUCKETS - 1 ? 1u << (i - 1) : 1u << i,
+			(unsigned long long) hist[i]);
+	seq_printf(f, "\n");
+#endif
 	proc_list_crypto_print(f, &g->decrypt, &g->target.decrypt, "decryption (incoming)");
-	proc_list_crypto_print(f, &g->encrypt, &g->target.encrypt, "encryption (outgoing)");
+	for (i = 0; i < g->target.num_outputs; i++) {
+		seq_printf(f, "    output %i:\n", i);
+		proc_list_addr_print(f, "src", &g->target.outputs[i].src_addr);
+		proc_list_addr_print(f, "dst", &g->target.outputs[i].dst_addr);
+		if (g->target.outputs[i].ssrc_out)
+			seq_printf(f, "    SSRC out: %08x\n", ntohl(g->target.outputs[i].ssrc_out));
+		proc_list_crypto_print(f, &g->outputs[i].encrypt, &g->target.outputs[i].encrypt,
+				"encryption (outgoing)");
+	}
 	if (g->target.rtcp_mux)
 		seq_printf(f, "    option: rtcp-mux\n");
 	if (g->target.dtls)
@@ -1513,6 +1805,8 @@ static int proc_list_show(struct seq_file *f, void *v) {
 		seq_printf(f, "    option: stun\n");
 	if (g->target.transcoding)
 		seq_printf(f, "    option: transcoding\n");
+	if (g->target.rtcp_fwd)
+		seq_printf(f, "    option: rtcp-fwd\n");
 
 	target_put(g);
 
@@ -1580,7 +1874,8 @@ static struct re_dest_addr *find_dest_addr(const struct re_dest_addr_hash *h, co
 	i = rda_hash = re_address_hash(local);
 
 	while (1) {
-		rda = h->addrs[i];
+		/* called both under RCU and with target_lock held */
+		rda = rcu_dereference_raw(h->addrs[i]);
 		if (!rda)
 			return NULL;
 		if (re_address_match(local, &rda->destination))
@@ -1623,11 +1918,11 @@ static int table_del_target(struct rtpengine_table *t, const struct re_address *
 	if (!g)
 		goto out;
 
-	b->ports_lo[lo] = NULL;
+	RCU_INIT_POINTER(b->ports_lo[lo], NULL);
 	re_bitfield_clear(&b->ports_lo_bf, lo);
 	t->num_targets--;
 	if (!b->ports_lo_bf.used) {
-		rda->ports_hi[hi] = NULL;
+		RCU_INIT_POINTER(rda->ports_hi[hi], NULL);
 		re_bitfield_clear(&rda->ports_hi_bf, hi);
 	}
 	else
@@ -1641,7 +1936,7 @@ out:
 	if (!g)
 		return -ENOENT;
 	if (b)
-		kfree(b);
+		kfree_rcu(b, rcu);
 
 	target_put(g);
 
@@ -1687,6 +1982,8 @@ static int validate_srtp(struct rtpengine_srtp *s) {
 		return -1;
 	if (s->auth_tag_len > 20)
 		return -1;
+	if (s->rtcp_auth_tag_len > 20)
+		return -1;
 	if (s->mki_len > sizeof(s->mki))
 		return -1;
 	return 0;
@@ -1887,20 +2184,21 @@ error:
 	return ret;
 }
 
-static int gen_session_keys(struct re_crypto_context *c, struct rtpengine_srtp *s) {
+/* label is 0x00 for SRTP and 0x03 for SRTCP session keys (rfc 3711 section 4.3.2) */
+static int gen_session_keys(struct re_crypto_context *c, struct rtpengine_srtp *s, unsigned char label) {
 	int ret;
 	const char *err;
 
 	if (s->cipher == REC_NULL && s->hmac == REH_NULL)
 		return 0;
 	err = "failed to generate session key";
-	ret = gen_session_key(c->session_key, s->session_key_len, s, 0x00);
+	ret = gen_session_key(c->session_key, s->session_key_len, s, label);
 	if (ret)
 		goto error;
-	ret = gen_session_key(c->session_auth_key, 20, s, 0x01);
+	ret = gen_session_key(c->session_auth_key, 20, s, label + 1);
 	if (ret)
 		goto error;
-	ret = gen_session_key(c->session_salt, 14, s, 0x02);
+	ret = gen_session_key(c->session_salt, 14, s, label + 2);
 	if (ret)
 		goto error;
 
@@ -2022,6 +2320,55 @@ static void crypto_context_init(struct re_crypto_context *c, struct rtpengine_sr
 	c->hmac = &re_hmacs[s->hmac];
 }
 
+static int validate_output(struct rtpengine_output_info *o) {
+	if (!is_valid_address(&o->src_addr))
+		return -1;
+	if (!is_valid_address(&o->dst_addr))
+		return -1;
+	if (o->src_addr.family != o->dst_addr.family)
+		return -1;
+	if (validate_srtp(&o->encrypt))
+		return -1;
+	return 0;
+}
+
+static int validate_ice(struct rtpengine_ice_info *ice, const struct re_address *local) {
+	if (!is_valid_address(&ice->remote))
+		return -1;
+	if (ice->remote.family != local->family)
+		return -1;
+	if (!ice->ufrag_len || ice->ufrag_len > sizeof(ice->ufrag))
+		return -1;
+	if (!ice->pwd_len || ice->pwd_len > sizeof(ice->pwd))
+		return -1;
+	return 0;
+}
+
+/* carries the stats of a replaced target over into the new, not yet visible one */
+static void target_stats_carry(struct rtpengine_target *g, const struct rtpengine_target *og) {
+	struct rtpengine_stats stats;
+	struct rtpengine_stats_pcpu *s;
+
+	s = per_cpu_ptr(g->stats, cpumask_first(cpu_possible_mask));
+	memset(&stats, 0, sizeof(stats));
+	memset(s->rtp_stats, 0, sizeof(s->rtp_stats));
+	target_stats_sum(og, &stats, s->rtp_stats, NULL);
+
+	s->packets = stats.packets;
+	s->bytes = stats.bytes;
+	s->errors = stats.errors;
+	s->stun = stats.stun;
+#if (RE_HAS_MEASUREDELAY)
+	if (stats.packets) {
+		s->delay_min = stats.delay_min;
+		s->delay_max = stats.delay_max;
+		s->delay_sum = stats.delay_avg * stats.packets;
+		s->delay_count = stats.packets;
+	}
+#endif
+	atomic_set(&g->in_tos, atomic_read(&og->in_tos));
+}
+
 static int table_new_target(struct rtpengine_table *t, struct rtpengine_target_info *i, int update) {
 	unsigned char hi, lo;
 	unsigned int rda_hash, rh_it;
@@ -2029,6 +2376,8 @@ static int table_new_target(struct rtpengine_table *t, struct rtpengine_target_i
 	struct re_dest_addr *rda;
 	struct re_bucket *b, *ba = NULL;
 	struct rtpengine_target *og = NULL;
+	struct rtpengine_output *o;
+	struct rtpengine_output_info *oi;
 	int err, j;
 	unsigned long flags;
 
@@ -2036,21 +2385,15 @@ static int table_new_target(struct rtpengine_table *t, struct rtpengine_target_i
 
 	if (!is_valid_address(&i->local))
 		return -EINVAL;
-	if (!is_valid_address(&i->src_addr))
-		return -EINVAL;
-	if (!is_valid_address(&i->dst_addr))
+	if (validate_srtp(&i->decrypt))
 		return -EINVAL;
-	if (i->src_addr.family != i->dst_addr.family)
+	if (!i->num_outputs || i->num_outputs > MAX_OUTPUTS)
 		return -EINVAL;
-	if (i->mirror_addr.family) {
-		if (!is_valid_address(&i->mirror_addr))
-			return -EINVAL;
-		if (i->mirror_addr.family != i->src_addr.family)
+	for (j = 0; j < i->num_outputs; j++) {
+		if (validate_output(&i->outputs[j]))
 			return -EINVAL;
 	}
-	if (validate_srtp(&i->decrypt))
-		return -EINVAL;
-	if (validate_srtp(&i->encrypt))
+	if (i->stun_reply && validate_ice(&i->ice, &i->local))
 		return -EINVAL;
 
 	DBG("Creating new target\n");
@@ -2062,20 +2405,61 @@ static int table_new_target(struct rtpengine_table *t, struct rtpengine_target_i
 	if (!g)
 		goto fail1;
 
+	g->stats = alloc_percpu(struct rtpengine_stats_pcpu);
+	if (!g->stats)
+		goto fail2;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0)
+	for_each_possible_cpu(j)
+		u64_stats_init(&per_cpu_ptr(g->stats, j)->syncp);
+#endif
+
 	g->table = t->id;
 	atomic_set(&g->refcnt, 1);
+	atomic_set(&g->in_tos, -1);
 	spin_lock_init(&g->decrypt.lock);
-	spin_lock_init(&g->encrypt.lock);
+	spin_lock_init(&g->rtcp_decrypt.lock);
 	memcpy(&g->target, i, sizeof(*i));
 	crypto_context_init(&g->decrypt, &g->target.decrypt);
-	crypto_context_init(&g->encrypt, &g->target.encrypt);
 
-	err = gen_session_keys(&g->decrypt, &g->target.decrypt);
-	if (err)
-		goto fail2;
-	err = gen_session_keys(&g->encrypt, &g->target.encrypt);
+	err = gen_session_keys(&g->decrypt, &g->target.decrypt, 0x00);
 	if (err)
 		goto fail2;
+	if (g->target.rtcp_fwd) {
+		crypto_context_init(&g->rtcp_decrypt, &g->target.decrypt);
+		err = gen_session_keys(&g->rtcp_decrypt, &g->target.decrypt, 0x03);
+		if (err)
+			goto fail2;
+	}
+
+	for (j = 0; j < g->target.num_outputs; j++) {
+		o = &g->outputs[j];
+		oi = &g->target.outputs[j];
+
+		spin_lock_init(&o->encrypt.lock);
+		spin_lock_init(&o->rtcp_encrypt.lock);
+		crypto_context_init(&o->encrypt, &oi->encrypt);
+		err = gen_session_keys(&o->encrypt, &oi->encrypt, 0x00);
+		if (err)
+			goto fail2;
+		if (g->target.rtcp_fwd) {
+			crypto_context_init(&o->rtcp_encrypt, &oi->encrypt);
+			err = gen_session_keys(&o->rtcp_encrypt, &oi->encrypt, 0x03);
+			if (err)
+				goto fail2;
+		}
+	}
+
+	if (g->target.stun_reply) {
+		g->stun_shash = crypto_alloc_shash("hmac(sha1)", 0, CRYPTO_ALG_ASYNC);
+		if (IS_ERR(g->stun_shash)) {
+			err = PTR_ERR(g->stun_shash);
+			g->stun_shash = NULL;
+			goto fail2;
+		}
+		err = crypto_shash_setkey(g->stun_shash, g->target.ice.pwd, g->target.ice.pwd_len);
+		if (err)
+			goto fail2;
+	}
 
 	/* find or allocate re_dest_addr */
 
@@ -2121,7 +2505,7 @@ retry:
 		goto retry;
 	}
 
-	t->dest_addr_hash.addrs[rh_it] = rda;
+	rcu_assign_pointer(t->dest_addr_hash.addrs[rh_it], rda);
 	re_bitfield_set(&t->dest_addr_hash.addrs_bf, rh_it);
 
 got_rda:
@@ -2144,7 +2528,7 @@ got_rda:
 	write_lock_irqsave(&t->target_lock, flags);
 
 	if (!rda->ports_hi[hi]) {
-		rda->ports_hi[hi] = b;
+		rcu_assign_pointer(rda->ports_hi[hi], b);
 		re_bitfield_set(&rda->ports_hi_bf, hi);
 	}
 	else {
@@ -2159,18 +2543,7 @@ got_bucket:
 		if (!og)
 			goto fail4;
 
-		atomic64_set(&g->stats.packets, atomic64_read(&og->stats.packets));
-		atomic64_set(&g->stats.bytes, atomic64_read(&og->stats.bytes));
-		atomic64_set(&g->stats.errors, atomic64_read(&og->stats.errors));
-		g->stats.delay_min = og->stats.delay_min;
-		g->stats.delay_max = og->stats.delay_max;
-		g->stats.delay_avg = og->stats.delay_avg;
-		atomic_set(&g->stats.in_tos, atomic_read(&og->stats.in_tos));
-
-		for (j = 0; j < NUM_PAYLOAD_TYPES; j++) {
-			atomic64_set(&g->rtp_stats[j].packets, atomic64_read(&og->rtp_stats[j].packets));
-			atomic64_set(&g->rtp_stats[j].bytes, atomic64_read(&og->rtp_stats[j].bytes));
-		}
+		target_stats_carry(g, og);
 	}
 	else {
 		err = -EEXIST;
@@ -2180,7 +2553,7 @@ got_bucket:
 		t->num_targets++;
 	}
 
-	b->ports_lo[lo] = g;
+	rcu_assign_pointer(b->ports_lo[lo], g);
 	g = NULL;
 	write_unlock_irqrestore(&t->target_lock, flags);
 
@@ -2196,6 +2569,8 @@ fail4:
 	if (ba)
 		kfree(ba);
 fail2:
+	free_target_crypto(g);
+	free_percpu(g->stats);
 	kfree(g);
 fail1:
 	return err;
@@ -2205,11 +2580,12 @@ fail1:
 
 
 
+/* must be called under rcu_read_lock(). doesn't take a reference, the target
+ * remains valid until rcu_read_unlock() */
 static struct rtpengine_target *get_target(struct rtpengine_table *t, const struct re_address *local) {
 	unsigned char hi, lo;
 	struct re_dest_addr *rda;
-	struct rtpengine_target *r;
-	unsigned long flags;
+	struct re_bucket *b;
 
 	if (!t)
 		return NULL;
@@ -2219,15 +2595,13 @@ static struct rtpengine_target *get_target(struct rtpengine_table *t, const stru
 	hi = (local->port & 0xff00) >> 8;
 	lo = local->port & 0xff;
 
-	read_lock_irqsave(&t->target_lock, flags);
-
 	rda = find_dest_addr(&t->dest_addr_hash, local);
-	r = rda ? (rda->ports_hi[hi] ? rda->ports_hi[hi]->ports_lo[lo] : NULL) : NULL;
-	if (r)
-		target_get(r);
-	read_unlock_irqrestore(&t->target_lock, flags);
-
-	return r;
+	if (!rda)
+		return NULL;
+	b = rcu_dereference(rda->ports_hi[hi]);
+	if (!b)
+		return NULL;
+	return rcu_dereference(b->ports_lo[lo]);
 }
 
 
@@ -2886,6 +3260,59 @@ out:
 
 
 
+static unsigned int stream_packet_data(const struct re_stream_packet *packet, const char **to_copy) {
+	if (packet->buflen) {
+		*to_copy = packet->buf;
+		return packet->buflen;
+	}
+	if (packet->skbuf) {
+		*to_copy = packet->skbuf->data;
+		return packet->skbuf->len;
+	}
+	*to_copy = NULL;
+	return 0;
+}
+
+/* frees all packets in the list */
+static ssize_t stream_read_batch(struct re_stream *stream, struct list_head *list, char __user *b, size_t l) {
+	struct re_stream_packet *packet, *tmp;
+	struct rtpengine_packet_hdr hdr;
+	const char *to_copy;
+	unsigned int len;
+	size_t pos = 0;
+	ssize_t err = 0;
+
+	list_for_each_entry_safe(packet, tmp, list, list_entry) {
+		list_del(&packet->list_entry);
+
+		len = stream_packet_data(packet, &to_copy);
+		if (!to_copy) {
+			printk(KERN_WARNING "BUG in packet stream list buffer\n");
+			err = -ENXIO;
+		}
+		if (err)
+			goto next;
+
+		// only the first packet can be too large, and is truncated
+		if (len > l - pos - sizeof(hdr))
+			len = l - pos - sizeof(hdr);
+
+		hdr.stream_idx = stream->info.stream_idx;
+		hdr.len = len;
+		if (copy_to_user(b + pos, &hdr, sizeof(hdr))
+				|| copy_to_user(b + pos + sizeof(hdr), to_copy, len))
+			err = -EFAULT;
+
+		pos += RTPENGINE_PACKET_SIZE(len);
+		if (pos > l)
+			pos = l;
+next:
+		free_packet(packet);
+	}
+
+	return err ? err : pos;
+}
+
 static ssize_t proc_stream_read(struct file *f, char __user *b, size_t l, loff_t *o) {
 	unsigned int stream_idx = (unsigned int) (unsigned long) PDE_DATA(f->f_path.dentry->d_inode);
 	struct re_stream *stream;
@@ -2893,6 +3320,8 @@ static ssize_t proc_stream_read(struct file *f, char __user *b, size_t l, loff_t
 	struct re_stream_packet *packet;
 	ssize_t ret;
 	const char *to_copy;
+	size_t size, psize;
+	LIST_HEAD(batch);
 
 	DBG("entering proc_stream_read()\n");
 
@@ -2924,6 +3353,31 @@ static ssize_t proc_stream_read(struct file *f, char __user *b, size_t l, loff_t
 		goto out;
 	}
 
+	if (f->private_data) {
+		// batched mode: take as many packets as fit, but always at least one
+		ret = -EINVAL;
+		if (l < sizeof(struct rtpengine_packet_hdr)) {
+			spin_unlock_irqrestore(&stream->packet_list_lock, flags);
+			goto out;
+		}
+		size = 0;
+		while (!list_empty(&stream->packet_list)) {
+			packet = list_first_entry(&stream->packet_list, struct re_stream_packet, list_entry);
+			psize = RTPENGINE_PACKET_SIZE(stream_packet_data(packet, &to_copy));
+			if (size && size + psize > l)
+				break;
+			list_move_tail(&packet->list_entry, &batch);
+			stream->list_count--;
+			size += psize;
+		}
+
+		spin_unlock_irqrestore(&stream->packet_list_lock, flags);
+
+		DBG("reading batch of %i bytes\n", (int) size);
+		ret = stream_read_batch(stream, &batch, b, l);
+		goto out;
+	}
+
 	DBG("removing packet from queue, reading %i bytes\n", (int) l);
 	packet = list_first_entry(&stream->packet_list, struct re_stream_packet, list_entry);
 	list_del(&packet->list_entry);
@@ -2931,21 +3385,13 @@ static ssize_t proc_stream_read(struct file *f, char __user *b, size_t l, loff_t
 
 	spin_unlock_irqrestore(&stream->packet_list_lock, flags);
 
-	if (packet->buflen) {
-		ret = packet->buflen;
-		to_copy = packet->buf;
-		DBG("packet is from userspace, %i bytes\n", (int) ret);
-	}
-	else if (packet->skbuf) {
-		ret = packet->skbuf->len;
-		to_copy = packet->skbuf->data;
-		DBG("packet is from kernel, %i bytes\n", (int) ret);
-	}
-	else {
+	ret = stream_packet_data(packet, &to_copy);
+	if (!to_copy) {
 		printk(KERN_WARNING "BUG in packet stream list buffer\n");
 		ret = -ENXIO;
 		goto err;
 	}
+	DBG("packet is from %s, %i bytes\n", packet->buflen ? "userspace" : "kernel", (int) ret);
 
 	if (ret > l)
 		ret = l;
@@ -2959,6 +3405,14 @@ out:
 	stream_put(stream);
 	return ret;
 }
+static long proc_stream_ioctl(struct file *f, unsigned int cmd, unsigned long arg) {
+	switch (cmd) {
+		case RTPENGINE_STREAM_IOC_BATCH:
+			f->private_data = (void *) 1;
+			return 0;
+	}
+	return -ENOTTY;
+}
 static unsigned int proc_stream_poll(struct file *f, struct poll_table_struct *p) {
 	unsigned int stream_idx = (unsigned int) (unsigned long) PDE_DATA(f->f_path.dentry->d_inode);
 	struct re_stream *stream;
@@ -3128,6 +3582,37 @@ out:
 	return err;
 }
 
+/* processes all packets even if some of them fail, and returns the last error */
+static int stream_packets(struct rtpengine_table *t, const unsigned char *data, unsigned int len) {
+	struct rtpengine_packet_hdr hdr;
+	struct rtpengine_packet_info info;
+	unsigned int size;
+	int err, ret = 0;
+
+	memset(&info, 0, sizeof(info));
+
+	while (len) {
+		if (len < sizeof(hdr))
+			return -EINVAL;
+		memcpy(&hdr, data, sizeof(hdr));
+		if (hdr.len > len - sizeof(hdr))
+			return -EINVAL;
+		size = RTPENGINE_PACKET_SIZE(hdr.len);
+		if (size > len)
+			size = len; // no padding after the last packet
+
+		info.stream_idx = hdr.stream_idx;
+		err = stream_packet(t, &info, data + sizeof(hdr), hdr.len);
+		if (err)
+			ret = err;
+
+		data += size;
+		len -= size;
+	}
+
+	return ret;
+}
+
 
 
 
@@ -3208,6 +3693,10 @@ static inline ssize_t proc_control_read_write(struct file *file, char __user *ub
 			err = stream_packet(t, &msg->u.packet, msg->data, buflen - sizeof(*msg));
 			break;
 
+		case REMG_PACKETS:
+			err = stream_packets(t, msg->data, buflen - sizeof(*msg));
+			break;
+
 		default:
 			printk(KERN_WARNING "xt_RTPENGINE unimplemented op %u\n", msg->cmd);
 			err = -EINVAL;
@@ -3759,6 +4248,201 @@ static inline int srtp_decrypt(struct re_crypto_context *c,
 	return c->cipher->decrypt(c, s, r, pkt_idx);
 }
 
+static void parse_rtcp(struct rtcp_parsed *rtcp, struct sk_buff *skb) {
+	if (skb->len < sizeof(*rtcp->header))
+		goto error;
+	rtcp->header = (void *) skb->data;
+	if ((rtcp->header->v_p_rc & 0xc0) != 0x80) /* version 2 */
+		goto error;
+	rtcp->header_len = sizeof(*rtcp->header);
+	rtcp->payload = skb->data + rtcp->header_len;
+	rtcp->payload_len = skb->len - rtcp->header_len;
+
+	rtcp->ok = 1;
+	return;
+
+error:
+	rtcp->ok = 0;
+}
+
+/* rfc 3711 section 3.4 */
+static u_int32_t srtcp_index(struct re_crypto_context *c, struct rtpengine_srtp *s) {
+	u_int32_t index;
+	unsigned long flags;
+
+	spin_lock_irqsave(&c->lock, flags);
+	index = s->rtcp_index & 0x7fffffffUL;
+	s->rtcp_index = (index + 1) & 0x7fffffffUL;
+	spin_unlock_irqrestore(&c->lock, flags);
+
+	return index;
+}
+
+/* length of the E flag, SRTCP index, MKI and auth tag appended to an outgoing packet */
+static inline unsigned int srtcp_trailer_len(struct rtpengine_srtp *s) {
+	if (s->hmac == REH_NULL)
+		return 0;
+	return sizeof(u_int32_t) + s->mki_len + s->rtcp_auth_tag_len;
+}
+
+static int srtcp_hash(unsigned char *hmac,
+		struct re_crypto_context *c,
+		struct rtcp_parsed *r)
+{
+	struct shash_desc *dsc;
+
+	dsc = kmalloc(sizeof(*dsc) + crypto_shash_descsize(c->shash), GFP_ATOMIC);
+	if (!dsc)
+		return -1;
+
+	dsc->tfm = c->shash;
+	dsc->flags = 0;
+
+	if (crypto_shash_init(dsc))
+		goto error;
+
+	/* payload includes the E flag and SRTCP index */
+	crypto_shash_update(dsc, (void *) r->header, r->header_len + r->payload_len);
+
+	crypto_shash_final(dsc, hmac);
+
+	kfree(dsc);
+
+	return 0;
+
+error:
+	kfree(dsc);
+	return -1;
+}
+
+static int srtcp_authenticate(struct re_crypto_context *c,
+		struct rtpengine_srtp *s, struct rtcp_parsed *r,
+		u_int32_t idx)
+{
+	unsigned char hmac[20];
+	u_int32_t *idx_p;
+
+	if (s->hmac == REH_NULL)
+		return 0;
+	if (!c->hmac)
+		return 0;
+	if (!c->shash)
+		return -1;
+
+	idx_p = (void *) (r->payload + r->payload_len);
+	*idx_p = htonl((s->rtcp_unencrypted ? 0 : 0x80000000UL) | idx);
+	r->payload_len += sizeof(*idx_p);
+
+	if (srtcp_hash(hmac, c, r))
+		return -1;
+
+	if (s->mki_len) {
+		memcpy(r->payload + r->payload_len, s->mki, s->mki_len);
+		r->payload_len += s->mki_len;
+	}
+
+	memcpy(r->payload + r->payload_len, hmac, s->rtcp_auth_tag_len);
+	r->payload_len += s->rtcp_auth_tag_len;
+
+	return 0;
+}
+
+/* strips the SRTCP trailer and returns the E flag and index in *idx_p */
+static int srtcp_auth_validate(struct re_crypto_context *c,
+		struct rtpengine_srtp *s, struct rtcp_parsed *r,
+		u_int32_t *idx_p)
+{
+	unsigned char *auth_tag;
+	unsigned char hmac[20];
+	u_int32_t *ip;
+
+	*idx_p = 0;
+
+	if (s->hmac == REH_NULL)
+		return 0;
+	if (!c->hmac)
+		return 0;
+	if (!c->shash)
+		return -1;
+
+	if (r->payload_len < s->rtcp_auth_tag_len + s->mki_len + sizeof(*ip))
+		return -1;
+
+	r->payload_len -= s->rtcp_auth_tag_len;
+	auth_tag = r->payload + r->payload_len;
+	r->payload_len -= s->mki_len;
+
+	if (srtcp_hash(hmac, c, r))
+		return -1;
+	if (memcmp(auth_tag, hmac, s->rtcp_auth_tag_len))
+		return -1;
+
+	r->payload_len -= sizeof(*ip);
+	ip = (void *) (r->payload + r->payload_len);
+	*idx_p = ntohl(*ip);
+
+	return 0;
+}
+
+static int srtcp_encrypt_aes_cm(struct re_crypto_context *c,
+		struct rtpengine_srtp *s, struct rtcp_parsed *r,
+		u_int32_t idx)
+{
+	unsigned char iv[16];
+	u_int32_t *ivi;
+
+	memcpy(iv, c->session_salt, 14);
+	iv[14] = iv[15] = '\0';
+	ivi = (void *) iv;
+
+	ivi[1] ^= r->header->ssrc;
+	ivi[2] ^= htonl(idx >> 16);
+	ivi[3] ^= htonl((idx & 0xffffUL) << 16);
+
+	aes_ctr(r->payload, r->payload, r->payload_len, c->tfm[0], iv);
+
+	return 0;
+}
+
+static int srtcp_encrypt_aes_f8(struct re_crypto_context *c,
+		struct rtpengine_srtp *s, struct rtcp_parsed *r,
+		u_int32_t idx)
+{
+	unsigned char iv[16];
+	u_int32_t i;
+
+	memset(iv, 0, 4);
+	i = htonl(0x80000000UL | idx);
+	memcpy(&iv[4], &i, 4);
+	memcpy(&iv[8], r->header, 8); /* v, p, rc, pt, length, ssrc */
+
+	aes_f8(r->payload, r->payload_len, c->tfm[0], c->tfm[1], iv);
+
+	return 0;
+}
+
+static inline int srtcp_encrypt(struct re_crypto_context *c,
+		struct rtpengine_srtp *s, struct rtcp_parsed *r,
+		u_int32_t idx)
+{
+	if (s->hmac == REH_NULL || s->rtcp_unencrypted)
+		return 0;
+	if (!c->cipher->rtcp_encrypt)
+		return 0;
+	return c->cipher->rtcp_encrypt(c, s, r, idx);
+}
+
+static inline int srtcp_decrypt(struct re_crypto_context *c,
+		struct rtpengine_srtp *s, struct rtcp_parsed *r,
+		u_int32_t idx)
+{
+	if (!(idx & 0x80000000UL)) /* E flag */
+		return 0;
+	if (!c->cipher->rtcp_decrypt)
+		return 0;
+	return c->cipher->rtcp_decrypt(c, s, r, idx & 0x7fffffffUL);
+}
+
 static inline int is_muxed_rtcp(struct rtp_parsed *r) {
 	if (r->header->m_pt < 194)
 		return 0;
@@ -3844,6 +4528,253 @@ static struct sk_buff *intercept_skb_copy(struct sk_buff *oskb, const struct re_
 
 
 
+/* encrypts and sends one copy of the packet. the parsed headers refer to the
+ * original skb, which may be different from the one given here */
+static int send_output(struct sk_buff *skb, struct rtpengine_target *g, unsigned int out_idx,
+		const struct rtp_parsed *rtp_in, const struct rtcp_parsed *rtcp_in, int rtp_pt_idx,
+		const struct xt_action_param *par)
+{
+	struct rtpengine_output *o = &g->outputs[out_idx];
+	struct rtpengine_output_info *oi = &g->target.outputs[out_idx];
+	struct rtp_parsed rtp = *rtp_in;
+	struct rtcp_parsed rtcp = *rtcp_in;
+	u_int64_t pkt_idx;
+	u_int32_t rtcp_idx;
+
+	if (rtp.ok) {
+		rtp.header = (void *) skb->data;
+		rtp.payload = skb->data + rtp.header_len;
+
+		// header rewriting must happen before the header gets authenticated
+		if (oi->ssrc_out)
+			rtp.header->ssrc = oi->ssrc_out;
+		if (oi->pt_rewrite && rtp_pt_idx >= 0)
+			rtp.header->m_pt = (rtp.header->m_pt & 0x80) | (oi->pt_output[rtp_pt_idx] & 0x7f);
+
+		pkt_idx = packet_index(&o->encrypt, &oi->encrypt, rtp.header);
+		srtp_encrypt(&o->encrypt, &oi->encrypt, &rtp, pkt_idx);
+		skb_put(skb, oi->encrypt.mki_len + oi->encrypt.auth_tag_len);
+		srtp_authenticate(&o->encrypt, &oi->encrypt, &rtp, pkt_idx);
+	}
+	else if (rtcp.ok) {
+		rtcp.header = (void *) skb->data;
+		rtcp.payload = skb->data + rtcp.header_len;
+
+		rtcp_idx = srtcp_index(&o->rtcp_encrypt, &oi->encrypt);
+		srtcp_encrypt(&o->rtcp_encrypt, &oi->encrypt, &rtcp, rtcp_idx);
+		skb_put(skb, srtcp_trailer_len(&oi->encrypt));
+		srtcp_authenticate(&o->rtcp_encrypt, &oi->encrypt, &rtcp, rtcp_idx);
+	}
+
+	return send_proxy_packet(skb, &oi->src_addr, &oi->dst_addr, g->target.tos, par);
+}
+
+#define STUN_COOKIE			0x2112A442UL
+#define STUN_CRC_XOR			0x5354554eUL
+#define STUN_BINDING_REQUEST		0x0001
+#define STUN_BINDING_SUCCESS		0x0101
+#define STUN_USERNAME			0x0006
+#define STUN_MESSAGE_INTEGRITY		0x0008
+#define STUN_XOR_MAPPED_ADDRESS		0x0020
+#define STUN_PRIORITY			0x0024
+#define STUN_USE_CANDIDATE		0x0025
+#define STUN_SOFTWARE			0x8022
+#define STUN_FINGERPRINT		0x8028
+#define STUN_ICE_CONTROLLED		0x8029
+#define STUN_ICE_CONTROLLING		0x802a
+
+struct stun_header {
+	u_int16_t			msg_type;
+	u_int16_t			msg_len;
+	u_int32_t			cookie;
+	u_int32_t			transaction[3];
+} __attribute__ ((packed));
+
+struct stun_attr {
+	u_int16_t			type;
+	u_int16_t			len;
+} __attribute__ ((packed));
+
+/* HMAC over a STUN message up to the MESSAGE-INTEGRITY attribute at "mi_pos". the
+ * length in the header must already cover the attribute */
+static int stun_integrity(unsigned char *digest, struct rtpengine_target *g,
+		const unsigned char *msg, unsigned int mi_pos)
+{
+	struct shash_desc *dsc;
+
+	dsc = kmalloc(sizeof(*dsc) + crypto_shash_descsize(g->stun_shash), GFP_ATOMIC);
+	if (!dsc)
+		return -1;
+
+	dsc->tfm = g->stun_shash;
+	dsc->flags = 0;
+
+	if (crypto_shash_digest(dsc, msg, mi_pos, digest)) {
+		kfree(dsc);
+		return -1;
+	}
+
+	kfree(dsc);
+	return 0;
+}
+
+static u_int32_t stun_fingerprint(const unsigned char *msg, unsigned int fp_pos) {
+	return htonl(crc32_le(~0, msg, fp_pos) ^ ~0 ^ STUN_CRC_XOR);
+}
+
+/* answers a STUN binding request the way the daemon would, if it's a plain consent
+ * check from the established candidate pair. the checks for the magic cookie and the
+ * trailing fingerprint attribute have already been done. returns 0 if the skb was
+ * consumed, or -1 if the packet should go to userspace. */
+static int stun_reply(struct sk_buff *skb, struct rtpengine_target *g, struct re_address *src,
+		const struct xt_action_param *par)
+{
+	struct rtpengine_ice_info *ice = &g->target.ice;
+	unsigned char *msg = skb->data;
+	unsigned int len = skb->len;
+	struct stun_header *hdr = (void *) msg;
+	struct stun_attr *attr;
+	unsigned int pos, alen, mi_pos = 0, un_pos = 0, un_len = 0, i;
+	int controlling = 0, controlled = 0, ret;
+	u_int16_t msg_len;
+	unsigned char digest[20];
+	unsigned char resp[20 + 24 + 24 + 8]; /* header, xor-mapped-address, integrity, fingerprint */
+	struct stun_header *rhdr = (void *) resp;
+	u_int16_t *u16;
+	u_int32_t *u32;
+
+	/* anything from a different peer could be a new candidate */
+	if (memcmp(src, &ice->remote, sizeof(*src)))
+		return -1;
+	if (hdr->msg_type != htons(STUN_BINDING_REQUEST))
+		return -1;
+	if (ntohs(hdr->msg_len) + sizeof(*hdr) != len)
+		return -1;
+
+	for (pos = sizeof(*hdr); pos < len; pos += sizeof(*attr) + ((alen + 3) & ~3)) {
+		if (pos + sizeof(*attr) > len)
+			return -1;
+		attr = (void *) &msg[pos];
+		alen = ntohs(attr->len);
+		if (pos + sizeof(*attr) + alen > len)
+			return -1;
+		/* only the fingerprint may follow the integrity attribute */
+		if (mi_pos && ntohs(attr->type) != STUN_FINGERPRINT)
+			return -1;
+
+		switch (ntohs(attr->type)) {
+			case STUN_USERNAME:
+				un_pos = pos + sizeof(*attr);
+				un_len = alen;
+				break;
+			case STUN_MESSAGE_INTEGRITY:
+				if (alen != 20)
+					return -1;
+				mi_pos = pos;
+				break;
+			case STUN_FINGERPRINT:
+				if (alen != 4 || pos + sizeof(*attr) + alen != len)
+					return -1;
+				break;
+			case STUN_ICE_CONTROLLING:
+				controlling = 1;
+				break;
+			case STUN_ICE_CONTROLLED:
+				controlled = 1;
+				break;
+			case STUN_PRIORITY:
+			case STUN_SOFTWARE:
+				break;
+			default:
+				/* USE-CANDIDATE and unknown attributes are left to the ICE agent */
+				return -1;
+		}
+	}
+
+	if (!un_pos || !mi_pos)
+		return -1;
+
+	/* role conflicts are resolved by the ICE agent */
+	if (controlling == controlled)
+		return -1;
+	if ((ice->controlling && controlling) || (!ice->controlling && controlled))
+		return -1;
+
+	/* USERNAME is "<local ufrag>:<remote ufrag>" */
+	if (un_len <= ice->ufrag_len + 1)
+		return -1;
+	if (memcmp(&msg[un_pos], ice->ufrag, ice->ufrag_len) || msg[un_pos + ice->ufrag_len] != ':')
+		return -1;
+
+	u32 = (void *) &msg[len - 4];
+	if (*u32 != stun_fingerprint(msg, len - 8))
+		return -1;
+
+	/* the integrity is calculated with the length covering only up to the
+	 * MESSAGE-INTEGRITY attribute itself */
+	msg_len = hdr->msg_len;
+	hdr->msg_len = htons(mi_pos + 24 - sizeof(*hdr));
+	ret = stun_integrity(digest, g, msg, mi_pos);
+	hdr->msg_len = msg_len;
+	if (ret)
+		return -1;
+	if (memcmp(digest, &msg[mi_pos + sizeof(*attr)], 20))
+		return -1;
+
+	/* build the success response */
+	rhdr->msg_type = htons(STUN_BINDING_SUCCESS);
+	rhdr->cookie = htonl(STUN_COOKIE);
+	memcpy(rhdr->transaction, hdr->transaction, sizeof(rhdr->transaction));
+	pos = sizeof(*rhdr);
+
+	attr = (void *) &resp[pos];
+	attr->type = htons(STUN_XOR_MAPPED_ADDRESS);
+	u16 = (void *) &resp[pos + sizeof(*attr)];
+	u32 = (void *) &resp[pos + sizeof(*attr) + 4];
+	u16[1] = htons(src->port ^ (STUN_COOKIE >> 16));
+	if (src->family == AF_INET) {
+		attr->len = htons(8);
+		u16[0] = htons(0x01);
+		u32[0] = src->u.ipv4 ^ htonl(STUN_COOKIE);
+	}
+	else {
+		attr->len = htons(20);
+		u16[0] = htons(0x02);
+		memcpy(u32, src->u.ipv6, 16);
+		u32[0] ^= htonl(STUN_COOKIE);
+		for (i = 0; i < 3; i++)
+			u32[i + 1] ^= hdr->transaction[i];
+	}
+	pos += sizeof(*attr) + ntohs(attr->len);
+
+	attr = (void *) &resp[pos];
+	attr->type = htons(STUN_MESSAGE_INTEGRITY);
+	attr->len = htons(20);
+	rhdr->msg_len = htons(pos + 24 - sizeof(*rhdr));
+	if (stun_integrity(&resp[pos + sizeof(*attr)], g, resp, pos))
+		return -1;
+	pos += 24;
+
+	attr = (void *) &resp[pos];
+	attr->type = htons(STUN_FINGERPRINT);
+	attr->len = htons(4);
+	rhdr->msg_len = htons(pos + 8 - sizeof(*rhdr));
+	u32 = (void *) &resp[pos + sizeof(*attr)];
+	*u32 = stun_fingerprint(resp, pos);
+	pos += 8;
+
+	/* the response replaces the request in the skb, which has tail room left
+	 * over from skb_copy_expand() */
+	if (skb->len + skb_tailroom(skb) < pos)
+		return -1;
+	skb_trim(skb, 0);
+	memcpy(skb_put(skb, pos), resp, pos);
+
+	send_proxy_packet(skb, &g->target.local, src, g->target.tos, par);
+
+	return 0;
+}
+
 static unsigned int rtpengine46(struct sk_buff *skb, struct rtpengine_table *t, struct re_address *src,
 		struct re_address *dst, u_int8_t in_tos, const struct xt_action_param *par)
 {
@@ -3853,13 +4784,17 @@ static unsigned int rtpengine46(struct sk_buff *skb, struct rtpengine_table *t,
 	int err;
 	int error_nf_action = XT_CONTINUE;
 	int rtp_pt_idx = -2;
-	unsigned int datalen;
+	unsigned int datalen, i, sent;
 	u_int32_t *u32;
 	struct rtp_parsed rtp;
+	struct rtcp_parsed rtcp;
 	u_int64_t pkt_idx;
+	u_int32_t rtcp_idx;
 	struct re_stream *stream;
 	struct re_stream_packet *packet;
 	const char *errstr = NULL;
+	struct rtpengine_stats_pcpu *stats;
+	unsigned int errors = 0;
 
 #if (RE_HAS_MEASUREDELAY)
 	u_int64_t starttime, endtime, delay;
@@ -3883,7 +4818,8 @@ static unsigned int rtpengine46(struct sk_buff *skb, struct rtpengine_table *t,
 	if (!g)
 		goto skip2;
 
-	DBG("target found, src "MIPF" -> dst "MIPF"\n", MIPP(g->target.src_addr), MIPP(g->target.dst_addr));
+	DBG("target found, src "MIPF" -> dst "MIPF" (%u outputs)\n", MIPP(g->target.outputs[0].src_addr),
+			MIPP(g->target.outputs[0].dst_addr), g->target.num_outputs);
 	DBG("target decrypt hmac and cipher are %s and %s", g->decrypt.hmac->name,
 			g->decrypt.cipher->name);
 
@@ -3902,8 +4838,21 @@ static unsigned int rtpengine46(struct sk_buff *skb, struct rtpengine_table *t,
 	if (u32[0] != htonl(0x80280004UL)) /* required fingerprint attribute */
 		goto not_stun;
 
-	/* probably stun, pass to application */
-	goto skip1;
+	/* probably stun. consent checks on the established pair are answered
+	 * right here, everything else is passed to the application */
+	if (!g->target.stun_reply)
+		goto skip1;
+	if (stun_reply(skb, g, src, par))
+		goto skip1;
+
+	stats = get_cpu_ptr(g->stats);
+	u64_stats_update_begin(&stats->syncp);
+	stats->stun++;
+	u64_stats_update_end(&stats->syncp);
+	put_cpu_ptr(g->stats);
+
+	rcu_read_unlock();
+	return NF_DROP;
 
 not_stun:
 	if (g->target.src_mismatch == MSM_IGNORE)
@@ -3922,6 +4871,7 @@ src_check_ok:
 		goto skip1;
 
 	rtp.ok = 0;
+	rtcp.ok = 0;
 	if (!g->target.rtp)
 		goto not_rtp;
 
@@ -3932,8 +4882,27 @@ src_check_ok:
 		goto not_rtp;
 	}
 
-	if (g->target.rtcp_mux && is_muxed_rtcp(&rtp))
-		goto skip1;
+	if (g->target.rtcp_mux && is_muxed_rtcp(&rtp)) {
+		if (!g->target.rtcp_fwd || g->target.transcoding)
+			goto skip1;
+		rtp.ok = 0;
+		parse_rtcp(&rtcp, skb);
+		if (!rtcp.ok)
+			goto skip1;
+		// RTCP from unknown senders is left to userspace
+		if (unlikely((g->target.ssrc) && (g->target.ssrc != rtcp.header->ssrc)))
+			goto skip1;
+
+		errstr = "SRTCP authentication tag mismatch";
+		if (srtcp_auth_validate(&g->rtcp_decrypt, &g->target.decrypt, &rtcp, &rtcp_idx))
+			goto skip_error;
+		errstr = "SRTCP decryption failed";
+		if (srtcp_decrypt(&g->rtcp_decrypt, &g->target.decrypt, &rtcp, rtcp_idx))
+			goto skip_error;
+
+		skb_trim(skb, rtcp.header_len + rtcp.payload_len);
+		goto not_rtp;
+	}
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0)
 	rtp_pt_idx = rtp_payload_type(rtp.header, &g->target);
@@ -3966,15 +4935,6 @@ src_check_ok:
 			rtp.payload[16], rtp.payload[17], rtp.payload[18], rtp.payload[19]);
 
 not_rtp:
-	if (g->target.mirror_addr.family) {
-		DBG("sending mirror packet to dst "MIPF"\n", MIPP(g->target.mirror_addr));
-		skb2 = skb_copy_expand(skb, MAX_HEADER, MAX_SKB_TAIL_ROOM, GFP_ATOMIC);
-		err = send_proxy_packet(skb2, &g->target.src_addr, &g->target.mirror_addr, g->target.tos,
-				par);
-		if (err)
-			atomic64_inc(&g->stats.errors);
-	}
-
 	if (g->target.do_intercept) {
 		DBG("do_intercept is set\n");
 		stream = get_stream_lock(NULL, g->target.intercept_stream_idx);
@@ -3996,78 +4956,71 @@ intercept_done:
 	}
 
 no_intercept:
-	if (rtp.ok) {
-		pkt_idx = packet_index(&g->encrypt, &g->target.encrypt, rtp.header);
-		srtp_encrypt(&g->encrypt, &g->target.encrypt, &rtp, pkt_idx);
-		skb_put(skb, g->target.encrypt.mki_len + g->target.encrypt.auth_tag_len);
-		srtp_authenticate(&g->encrypt, &g->target.encrypt, &rtp, pkt_idx);
-
-		// SSRC substitution
-		if (g->target.transcoding && g->target.ssrc_out)
-			rtp.header->ssrc = g->target.ssrc_out;
+	// each output gets its own copy of the decrypted packet, except for the
+	// last one, which gets the original
+	sent = 0;
+	for (i = 0; i < g->target.num_outputs; i++) {
+		skb2 = skb;
+		if (i + 1 < g->target.num_outputs) {
+			skb2 = skb_copy_expand(skb, MAX_HEADER, MAX_SKB_TAIL_ROOM, GFP_ATOMIC);
+			if (!skb2) {
+				errors++;
+				continue;
+			}
+		}
+		err = send_output(skb2, g, i, &rtp, &rtcp, rtp_pt_idx, par);
+		if (err)
+			errors++;
+		else
+			sent++;
 	}
 
-	err = send_proxy_packet(skb, &g->target.src_addr, &g->target.dst_addr, g->target.tos, par);
+	if (unlikely(atomic_read(&g->in_tos) < 0))
+		atomic_cmpxchg(&g->in_tos, -1, in_tos);
 
-	if (atomic64_read(&g->stats.packets)==0)
-		atomic_set(&g->stats.in_tos,in_tos);
+#if (RE_HAS_MEASUREDELAY)
+	starttime = ktime_to_ns(skb->tstamp);
+	endtime = ktime_to_ns(ktime_get_real());
+	delay = endtime - starttime;
+#endif
 
-	if (err)
-		atomic64_inc(&g->stats.errors);
-	else {
-		atomic64_inc(&g->stats.packets);
-		atomic64_add(datalen, &g->stats.bytes);
+	stats = get_cpu_ptr(g->stats);
+	u64_stats_update_begin(&stats->syncp);
+
+	stats->errors += errors;
+	if (sent) {
+		stats->packets++;
+		stats->bytes += datalen;
 	}
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0)
 	if (rtp_pt_idx >= 0) {
-		atomic64_inc(&g->rtp_stats[rtp_pt_idx].packets);
-		atomic64_add(datalen, &g->rtp_stats[rtp_pt_idx].bytes);
-
+		stats->rtp_stats[rtp_pt_idx].packets++;
+		stats->rtp_stats[rtp_pt_idx].bytes += datalen;
 #if (RE_HAS_MEASUREDELAY)
-		starttime = ktime_to_ns(skb->tstamp);
-		endtime = ktime_to_ns(ktime_get_real());
-
-		delay = endtime - starttime;
-
-		/* XXX needs locking - not atomic */
-		if (atomic64_read(&g->stats.packets)==1) {
-			g->stats.delay_min=delay;
-			g->stats.delay_avg=delay;
-			g->stats.delay_max=delay;
-		} else {
-			if (g->stats.delay_min > delay) {
-				g->stats.delay_min = delay;
-			}
-			if (g->stats.delay_max < delay) {
-				g->stats.delay_max = delay;
-			}
-
-			g->stats.delay_avg = g->stats.delay_avg * (atomic64_read(&g->stats.packets)-1);
-			g->stats.delay_avg = g->stats.delay_avg + delay;
-			g->stats.delay_avg = g->stats.delay_avg / atomic64_read(&g->stats.packets);
-		}
+		target_stats_delay(stats, delay);
 #endif
 	}
 	else if (rtp_pt_idx == -2)
 		/* not RTP */ ;
 	else if (rtp_pt_idx == -1)
-		atomic64_inc(&g->stats.errors);
+		stats->errors++;
 #endif
 
-	target_put(g);
-	table_put(t);
+	u64_stats_update_end(&stats->syncp);
+	put_cpu_ptr(g->stats);
+
+	rcu_read_unlock();
 
 	return NF_DROP;
 
 skip_error:
 	log_err("x_tables action failed: %s", errstr);
-	atomic64_inc(&g->stats.errors);
+	target_stats_error(g);
 skip1:
-	target_put(g);
 skip2:
 	kfree_skb(skb);
-	table_put(t);
+	rcu_read_unlock();
 	return error_nf_action;
 }
 
@@ -4083,9 +5036,10 @@ static unsigned int rtpengine4(struct sk_buff *oskb, const struct xt_action_para
 	struct rtpengine_table *t;
 	struct re_address src, dst;
 
-	t = get_table(pinfo->id);
+	rcu_read_lock();
+	t = get_table_rcu(pinfo->id);
 	if (!t)
-		goto skip;
+		goto skip3;
 
 	skb = skb_copy_expand(oskb, MAX_HEADER, MAX_SKB_TAIL_ROOM, GFP_ATOMIC);
 	if (!skb)
@@ -4109,8 +5063,7 @@ static unsigned int rtpengine4(struct sk_buff *oskb, const struct xt_action_para
 skip2:
 	kfree_skb(skb);
 skip3:
-	table_put(t);
-skip:
+	rcu_read_unlock();
 	return XT_CONTINUE;
 }
 
@@ -4124,9 +5077,10 @@ static unsigned int rtpengine6(struct sk_buff *oskb, const struct xt_action_para
 	struct rtpengine_table *t;
 	struct re_address src, dst;
 
-	t = get_table(pinfo->id);
+	rcu_read_lock();
+	t = get_table_rcu(pinfo->id);
 	if (!t)
-		goto skip;
+		goto skip3;
 
 	skb = skb_copy_expand(oskb, MAX_HEADER, MAX_SKB_TAIL_ROOM, GFP_ATOMIC);
 	if (!skb)
@@ -4151,8 +5105,7 @@ static unsigned int rtpengine6(struct sk_buff *oskb, const struct xt_action_para
 skip2:
 	kfree_skb(skb);
 skip3:
-	table_put(t);
-skip:
+	rcu_read_unlock();
 	return XT_CONTINUE;
 }
 
@@ -4271,6 +5224,9 @@ static void __exit fini(void) {
 
 	auto_array_free(&streams);
 	auto_array_free(&calls);
+
+	/* wait for pending target frees */
+	rcu_barrier();
 }
 
 module_init(init);
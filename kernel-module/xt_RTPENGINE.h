@@ -4,6 +4,7 @@
 
 
 #define NUM_PAYLOAD_TYPES 16
+#define MAX_OUTPUTS 4
 
 
 
@@ -15,6 +16,7 @@ struct rtpengine_stats {
 	u_int64_t			packets;
 	u_int64_t			bytes;
 	u_int64_t			errors;
+	u_int64_t			stun; /* binding requests answered in the kernel */
 	u_int64_t			delay_min;
 	u_int64_t			delay_avg;
 	u_int64_t			delay_max;
@@ -69,6 +71,9 @@ struct rtpengine_srtp {
 	u_int64_t			last_index;
 	unsigned int			auth_tag_len; /* in bytes */
 	unsigned int			mki_len;
+	u_int32_t			rtcp_index; /* next SRTCP index, outgoing only */
+	unsigned int			rtcp_auth_tag_len; /* in bytes */
+	int				rtcp_unencrypted:1;
 };
 
 
@@ -78,25 +83,47 @@ enum rtpengine_src_mismatch {
 	MSM_PROPAGATE,		/* propagate to userspace daemon */
 };
 
+struct rtpengine_output_info {
+	struct re_address		src_addr; /* for outgoing packets */
+	struct re_address		dst_addr;
+
+	struct rtpengine_srtp		encrypt;
+	u_int32_t			ssrc_out; // Rewrite SSRC if non-zero
+	unsigned char			pt_output[NUM_PAYLOAD_TYPES]; // same order as payload_types
+	int				pt_rewrite:1;
+};
+
+#define RTPENGINE_MAX_ICE_UFRAG		64
+#define RTPENGINE_MAX_ICE_PWD		64
+
+/* local ICE credentials, for answering consent checks on an established candidate pair */
+struct rtpengine_ice_info {
+	struct re_address		remote; /* only requests from here are answered */
+	unsigned char			ufrag[RTPENGINE_MAX_ICE_UFRAG];
+	unsigned int			ufrag_len;
+	unsigned char			pwd[RTPENGINE_MAX_ICE_PWD];
+	unsigned int			pwd_len;
+	int				controlling:1;
+};
+
 struct rtpengine_target_info {
 	struct re_address		local;
 	struct re_address		expected_src; /* for incoming packets */
 	enum rtpengine_src_mismatch	src_mismatch;
 
-	struct re_address		src_addr; /* for outgoing packets */
-	struct re_address		dst_addr;
-
-	struct re_address		mirror_addr;
 	unsigned int			intercept_stream_idx;
 
 	struct rtpengine_srtp		decrypt;
-	struct rtpengine_srtp		encrypt;
         u_int32_t                       ssrc; // Expose the SSRC to userspace when we resync.
-        u_int32_t                       ssrc_out; // Rewrite SSRC
 
 	unsigned char			payload_types[NUM_PAYLOAD_TYPES]; /* must be sorted */
 	unsigned int			num_payload_types;
 
+	struct rtpengine_output_info	outputs[MAX_OUTPUTS]; /* each packet is sent to all of these */
+	unsigned int			num_outputs;
+
+	struct rtpengine_ice_info	ice; /* only with stun_reply */
+
 	unsigned char			tos;
 	int				rtcp_mux:1,
 					dtls:1,
@@ -104,7 +131,9 @@ struct rtpengine_target_info {
 					rtp:1,
 					rtp_only:1,
 					do_intercept:1,
-					transcoding:1; // SSRC subst and RTP PT filtering
+					transcoding:1, // RTP PT filtering
+					rtcp_fwd:1, // forward muxed (S)RTCP instead of passing it to userspace
+					stun_reply:1; // answer STUN binding requests from ice.remote
 };
 
 struct rtpengine_call_info {
@@ -144,6 +173,9 @@ struct rtpengine_message {
 		/* packet_info: */
 		REMG_PACKET,
 
+		/* data is a sequence of rtpengine_packet_hdr records */
+		REMG_PACKETS,
+
 		__REMG_LAST
 	}				cmd;
 
@@ -157,11 +189,41 @@ struct rtpengine_message {
 	unsigned char			data[];
 };
 
+/* Multiple packets in one buffer, used by REMG_PACKETS and by intercepted stream files
+ * in batched mode. Each packet is preceded by this header, and the next header follows
+ * the packet data at the next multiple of RTPENGINE_PACKET_ALIGN bytes. */
+struct rtpengine_packet_hdr {
+	unsigned int			stream_idx;
+	unsigned int			len;
+};
+
+#define RTPENGINE_PACKET_ALIGN		4
+#define RTPENGINE_PACKET_SIZE(len)	(sizeof(struct rtpengine_packet_hdr) \
+		+ (((len) + RTPENGINE_PACKET_ALIGN - 1) & ~(RTPENGINE_PACKET_ALIGN - 1)))
+
+/* ioctl on an intercepted stream file: each read() returns as many packets as fit into the
+ * buffer, in the format above, instead of a single packet */
+#define RTPENGINE_STREAM_IOC_BATCH	_IO('R', 1)
+
 struct rtpengine_list_entry {
 	struct rtpengine_target_info	target;
 	struct rtpengine_stats		stats;
 	struct rtpengine_rtp_stats	rtp_stats[NUM_PAYLOAD_TYPES];
 };
 
+/* returned by reading a table's "stats" file, as many as fit into the buffer */
+struct rtpengine_stats_entry {
+	struct re_address		local;
+	struct rtpengine_stats		stats;
+	struct rtpengine_rtp_stats	rtp_stats[NUM_PAYLOAD_TYPES];
+	unsigned char			payload_types[NUM_PAYLOAD_TYPES];
+	unsigned int			num_payload_types;
+	u_int32_t			ssrc;
+	u_int64_t			decrypt_last_index;
+	u_int64_t			encrypt_last_index;
+	u_int32_t			encrypt_rtcp_index;
+	int				rtcp_fwd:1;
+};
+
 
 #endif
@@ -20,6 +20,10 @@
 #define PACKET_SEQ_DUPE_THRES 100
 #define PACKET_TS_RESET_THRES 5000 // milliseconds
 
+#if PACKET_SEQ_RING_SIZE <= PACKET_SEQ_DUPE_THRES
+#error PACKET_SEQ_RING_SIZE must be larger than PACKET_SEQ_DUPE_THRES
+#endif
+
 
 
 #ifndef dbg
@@ -765,98 +769,76 @@ void codeclib_init(int print) {
 
 
 
-static int ptr_cmp(const void *a, const void *b, void *dummy) {
-	if (a < b)
-		return -1;
-	if (a > b)
-		return 1;
-	return 0;
-}
+#define SEQ_SLOT(ps, seq) (ps)->ring[(seq) & (PACKET_SEQ_RING_SIZE - 1)]
 
 void packet_sequencer_init(packet_sequencer_t *ps, GDestroyNotify ffunc) {
-	ps->packets = g_tree_new_full(ptr_cmp, NULL, NULL, ffunc);
+	memset(ps->ring, 0, sizeof(ps->ring));
+	ps->count = 0;
+	ps->ffunc = ffunc;
+	ps->gap_since = 0;
+	ps->max_delay = PACKET_SEQ_MAX_DELAY;
 	ps->seq = -1;
 }
-void packet_sequencer_destroy(packet_sequencer_t *ps) {
-	g_tree_destroy(ps->packets);
-}
-struct tree_searcher {
-	int find_seq,
-	    found_seq;
-};
-static int packet_tree_search(const void *testseq_p, const void *ts_p) {
-	struct tree_searcher *ts = (void *) ts_p;
-	int testseq = GPOINTER_TO_INT(testseq_p);
-	// called as a binary search test function. we're looking for the lowest
-	// seq number that is higher than find_seq. if our test number is too low,
-	// we proceed with higher numbers. if it's too high, we proceed to the lower
-	// numbers, but remember the lowest we've seen along that path.
-	if (G_UNLIKELY(testseq == ts->find_seq)) {
-		// we've struck gold
-		ts->found_seq = testseq;
-		return 0;
+static void packet_sequencer_flush(packet_sequencer_t *ps) {
+	for (int i = 0; i < PACKET_SEQ_RING_SIZE && ps->count; i++) {
+		if (!ps->ring[i])
+			continue;
+		ps->ffunc(ps->ring[i]);
+		ps->ring[i] = NULL;
+		ps->count--;
 	}
-	if (testseq < ts->find_seq)
-		return 1;
-	// testseq > ts->find_seq
-	if (ts->found_seq == -1 || testseq < ts->found_seq)
-		ts->found_seq = testseq;
-	return -1;
+	ps->gap_since = 0;
+}
+void packet_sequencer_destroy(packet_sequencer_t *ps) {
+	packet_sequencer_flush(ps);
 }
 // caller must take care of locking
 void *packet_sequencer_next_packet(packet_sequencer_t *ps) {
-	// see if we have a packet with the correct seq nr in the queue
-	seq_packet_t *packet = g_tree_lookup(ps->packets, GINT_TO_POINTER(ps->seq));
-	if (G_LIKELY(packet != NULL)) {
-		dbg("returning in-sequence packet (seq %i)", ps->seq);
-		goto out;
-	}
-
-	// why not? do we have anything? (we should)
-	int nnodes = g_tree_nnodes(ps->packets);
-	if (G_UNLIKELY(nnodes == 0)) {
+	if (G_UNLIKELY(ps->count == 0)) {
 		dbg("packet queue empty");
 		return NULL;
 	}
-	if (G_LIKELY(nnodes < 10)) { // XXX arbitrary value
-		dbg("only %i packets in queue - waiting for more", nnodes);
-		return NULL; // need to wait for more
-	}
 
-	// packet was probably lost. search for the next highest seq
-	struct tree_searcher ts = { .find_seq = ps->seq + 1, .found_seq = -1 };
-	packet = g_tree_search(ps->packets, packet_tree_search, &ts);
-	if (packet) {
-		// bullseye
-		dbg("lost packet - returning packet with next seq %i", packet->seq);
+	// see if we have a packet with the correct seq nr in the queue
+	seq_packet_t *packet = SEQ_SLOT(ps, ps->seq);
+	if (G_LIKELY(packet != NULL)) {
+		dbg("returning in-sequence packet (seq %i)", ps->seq);
 		goto out;
 	}
-	if (G_UNLIKELY(ts.found_seq == -1)) {
-		// didn't find anything. seq must have wrapped around. retry
-		// starting from zero
-		ts.find_seq = 0;
-		packet = g_tree_search(ps->packets, packet_tree_search, &ts);
-		if (packet) {
-			dbg("lost packet - returning packet with next seq %i (after wrap)", packet->seq);
-			goto out;
+
+	// packet is either late or lost. wait for more packets or until the gap is too old
+	if (G_LIKELY(ps->count < PACKET_SEQ_WAIT_PACKETS)) {
+		gint64 now = g_get_monotonic_time();
+		if (!ps->gap_since)
+			ps->gap_since = now;
+		if (now - ps->gap_since < ps->max_delay) {
+			dbg("only %u packets in queue - waiting for more", ps->count);
+			return NULL;
 		}
-		if (G_UNLIKELY(ts.found_seq == -1))
-			abort();
+		dbg("waited %lli us for seq %i - giving up", (long long) (now - ps->gap_since), ps->seq);
 	}
 
-	// pull out the packet we found
-	packet = g_tree_lookup(ps->packets, GINT_TO_POINTER(ts.found_seq));
+	// packet was probably lost. everything in the queue is within the ring's
+	// window above the expected seq, so the next highest seq is the first
+	// occupied slot
+	for (int i = 1; i < PACKET_SEQ_RING_SIZE; i++) {
+		packet = SEQ_SLOT(ps, ps->seq + i);
+		if (packet)
+			break;
+	}
 	if (G_UNLIKELY(packet == NULL))
 		abort();
 
-	dbg("lost multiple packets - returning packet with next highest seq %i", packet->seq);
+	dbg("lost packet - returning packet with next highest seq %i", packet->seq);
 
 out:
 	;
 	u_int16_t l = packet->seq - ps->seq;
 	ps->lost_count += l;
 
-	g_tree_steal(ps->packets, GINT_TO_POINTER(packet->seq));
+	SEQ_SLOT(ps, packet->seq) = NULL;
+	ps->count--;
+	ps->gap_since = 0;
 	ps->seq = (packet->seq + 1) & 0xffff;
 
 	if (packet->seq < ps->ext_seq)
@@ -888,14 +870,17 @@ int packet_sequencer_insert(packet_sequencer_t *ps, seq_packet_t *p) {
 	if (diff > (0xffff - PACKET_SEQ_DUPE_THRES))
 		return -1;
 
-	// everything else we consider a seq reset
+	// everything else we consider a seq reset. packets still queued from before
+	// the reset would collide with the new sequence, so they're discarded
 	ilog(LOG_DEBUG, "Seq reset detected: expected seq %i, received seq %i", ps->seq, p->seq);
+	packet_sequencer_flush(ps);
 	ps->seq = p->seq;
 	// seq ok - fall thru
 seq_ok:
-	if (g_tree_lookup(ps->packets, GINT_TO_POINTER(p->seq)))
+	if (SEQ_SLOT(ps, p->seq))
 		return -1;
-	g_tree_insert(ps->packets, GINT_TO_POINTER(p->seq), p);
+	SEQ_SLOT(ps, p->seq) = p;
+	ps->count++;
 
 	return 0;
 }
@@ -174,11 +174,19 @@ struct encoder_s {
 	int64_t mux_dts; // last dts passed to muxer
 };
 
+#define PACKET_SEQ_RING_SIZE 128 // power of two, must be larger than the dupe threshold
+#define PACKET_SEQ_WAIT_PACKETS 10 // release on loss once this many packets are queued
+#define PACKET_SEQ_MAX_DELAY 100000 // or once the gap is this old, in microseconds
+
 struct seq_packet_s {
 	int seq;
 };
 struct packet_sequencer_s {
-	GTree *packets;
+	seq_packet_t *ring[PACKET_SEQ_RING_SIZE]; // indexed by seq
+	unsigned int count;
+	GDestroyNotify ffunc;
+	gint64 gap_since; // monotonic time at which the next expected packet was first found missing
+	gint64 max_delay; // microseconds
 	unsigned int lost_count;
 	int seq; // next expected
 	unsigned int ext_seq; // last received
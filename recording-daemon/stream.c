@@ -4,7 +4,9 @@
 #include <unistd.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <sys/ioctl.h>
 #include <libavcodec/avcodec.h>
+#include "xt_RTPENGINE.h"
 #include "metafile.h"
 #include "epoll.h"
 #include "log.h"
@@ -37,6 +39,42 @@ void stream_free(stream_t *stream) {
 }
 
 
+// takes over the buffer
+static void stream_packet(stream_t *stream, unsigned char *buf, unsigned int len) {
+	if (output_enabled)
+		packet_process(stream, buf, len);
+	if (forward_to){
+		if (forward_packet(stream->metafile,buf,len))
+			g_atomic_int_inc(&stream->metafile->forward_failed);
+		else
+			g_atomic_int_inc(&stream->metafile->forward_count);
+	}
+}
+
+// splits up the result of a batched read into individual packets
+static void stream_packets(stream_t *stream, const unsigned char *buf, unsigned int len) {
+	struct rtpengine_packet_hdr hdr;
+	unsigned int size;
+
+	while (len >= sizeof(hdr)) {
+		memcpy(&hdr, buf, sizeof(hdr));
+		if (hdr.len > len - sizeof(hdr)) {
+			ilog(LOG_WARN, "Truncated packet in batch read from stream %s", stream->name);
+			return;
+		}
+
+		unsigned char *pkt = malloc(hdr.len + ALLOCLEN - MAXBUFLEN);
+		memcpy(pkt, buf + sizeof(hdr), hdr.len);
+		stream_packet(stream, pkt, hdr.len);
+
+		size = RTPENGINE_PACKET_SIZE(hdr.len);
+		if (size >= len)
+			break;
+		buf += size;
+		len -= size;
+	}
+}
+
 static void stream_handler(handler_t *handler) {
 	stream_t *stream = handler->ptr;
 	unsigned char *buf = NULL;
@@ -66,16 +104,14 @@ static void stream_handler(handler_t *handler) {
 		goto out;
 	}
 
-	// got a packet
+	// got a packet, or a batch of them
 	pthread_mutex_unlock(&stream->lock);
-	if (output_enabled)
-		packet_process(stream, buf, ret);
-	if (forward_to){
-		if (forward_packet(stream->metafile,buf,ret))
-			g_atomic_int_inc(&stream->metafile->forward_failed);
-		else
-			g_atomic_int_inc(&stream->metafile->forward_count);
+	if (stream->batch) {
+		stream_packets(stream, buf, ret);
+		free(buf);
 	}
+	else
+		stream_packet(stream, buf, ret);
 	log_info_call = NULL;
 	log_info_stream = NULL;
 	return;
@@ -125,6 +161,9 @@ void stream_open(metafile_t *mf, unsigned long id, char *name) {
 		return;
 	}
 
+	// read multiple packets at once if the kernel module supports it
+	stream->batch = (ioctl(stream->fd, RTPENGINE_STREAM_IOC_BATCH) == 0);
+
 	// add to epoll
 	stream->handler.ptr = stream;
 	stream->handler.func = stream_handler;
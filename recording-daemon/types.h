@@ -45,6 +45,7 @@ struct stream_s {
 	metafile_t *metafile;
 	unsigned long id;
 	int fd;
+	int batch; // each read returns multiple packets with headers
 	handler_t handler;
 };
 typedef struct stream_s stream_t;
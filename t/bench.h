@@ -0,0 +1,13 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <time.h>
+
+/* seconds on the monotonic clock, for timing benchmark loops */
+static inline double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#endif
@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "xt_RTPENGINE.h"
+#include "bench.h"
+
+/* Forwarding rate of the kernel module, without the daemon involved.
+ *
+ *   kernel-bench [-t table] [-n targets] [-T threads] [-s seconds] [-l payload len]
+ *                [-a local address] [-d destination address] [-p port]
+ *
+ * Sets up a throwaway forwarding table with one target per local port, starting at
+ * -p. Each target relays to port - 1 on the destination address. Sender threads send
+ * RTP at the targets for the given time. Both the send rate and the forwarded rate
+ * are printed, the latter taken from the targets' packet counters. Needs root, the
+ * loaded module, and a rule steering the traffic into the table, for example:
+ *
+ *   iptables -I INPUT -p udp -d 127.0.0.1 --dport 30000:30999 -j RTPENGINE --id 42
+ *
+ * To measure across an interface, use the addresses of a veth pair for -a and -d.
+ */
+
+#define PREFIX "/proc/rtpengine"
+#define BATCH 64
+
+static unsigned int table_id = 42;
+static unsigned int num_targets = 100;
+static unsigned int num_threads = 4;
+static unsigned int seconds = 5;
+static unsigned int payload_len = 160;
+static const char *local_addr = "127.0.0.1";
+static const char *dest_addr = NULL;
+static unsigned int base_port = 30000;
+
+static volatile int stop;
+
+struct sender {
+	pthread_t thread;
+	unsigned int first, num;
+	unsigned long sent;
+};
+
+static void die(const char *what) {
+	fprintf(stderr, "%s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+static int table_action(const char *action) {
+	char buf[64];
+	int fd, ret;
+
+	fd = open(PREFIX "/control", O_WRONLY | O_TRUNC);
+	if (fd == -1)
+		die("failed to open " PREFIX "/control");
+	snprintf(buf, sizeof(buf), "%s %u\n", action, table_id);
+	ret = write(fd, buf, strlen(buf));
+	close(fd);
+	return ret < 0 ? -1 : 0;
+}
+
+static void addr_parse(struct re_address *a, const char *s, unsigned int port) {
+	memset(a, 0, sizeof(*a));
+	a->family = AF_INET;
+	a->port = port;
+	if (inet_pton(AF_INET, s, &a->u.ipv4) != 1) {
+		fprintf(stderr, "invalid address %s\n", s);
+		exit(1);
+	}
+}
+
+static void add_targets(int fd) {
+	struct rtpengine_message msg;
+	struct rtpengine_target_info *ti = &msg.u.target;
+	unsigned int i;
+
+	for (i = 0; i < num_targets; i++) {
+		memset(&msg, 0, sizeof(msg));
+		msg.cmd = REMG_ADD;
+
+		addr_parse(&ti->local, local_addr, base_port + i);
+		ti->decrypt.cipher = REC_NULL;
+		ti->decrypt.hmac = REH_NULL;
+		ti->num_outputs = 1;
+		addr_parse(&ti->outputs[0].src_addr, dest_addr, base_port + i);
+		addr_parse(&ti->outputs[0].dst_addr, dest_addr, base_port - 1);
+		ti->outputs[0].encrypt.cipher = REC_NULL;
+		ti->outputs[0].encrypt.hmac = REH_NULL;
+
+		if (write(fd, &msg, sizeof(msg)) <= 0)
+			die("failed to add target");
+	}
+}
+
+static unsigned long forwarded_packets(void) {
+	struct rtpengine_list_entry e;
+	char path[64];
+	unsigned long ret = 0;
+	int fd;
+
+	snprintf(path, sizeof(path), PREFIX "/%u/blist", table_id);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		die("failed to open target list");
+	while (read(fd, &e, sizeof(e)) == sizeof(e))
+		ret += e.stats.packets;
+	close(fd);
+
+	return ret;
+}
+
+static void *sender_loop(void *p) {
+	struct sender *s = p;
+	struct sockaddr_in sin[BATCH];
+	struct mmsghdr mm[BATCH];
+	struct iovec iov;
+	unsigned char pkt[12 + payload_len];
+	unsigned int i, next = 0;
+	int fd, ret;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd == -1)
+		die("failed to create socket");
+
+	memset(pkt, 0xd5, sizeof(pkt));
+	pkt[0] = 0x80; /* V=2 */
+	pkt[1] = 0x00; /* PT=0 */
+	iov.iov_base = pkt;
+	iov.iov_len = sizeof(pkt);
+
+	memset(mm, 0, sizeof(mm));
+	for (i = 0; i < BATCH; i++) {
+		memset(&sin[i], 0, sizeof(sin[i]));
+		sin[i].sin_family = AF_INET;
+		inet_pton(AF_INET, local_addr, &sin[i].sin_addr);
+		mm[i].msg_hdr.msg_name = &sin[i];
+		mm[i].msg_hdr.msg_namelen = sizeof(sin[i]);
+		mm[i].msg_hdr.msg_iov = &iov;
+		mm[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (!stop) {
+		// spread each batch over this thread's targets
+		for (i = 0; i < BATCH; i++) {
+			sin[i].sin_port = htons(base_port + s->first + next);
+			if (++next >= s->num)
+				next = 0;
+		}
+		ret = sendmmsg(fd, mm, BATCH, 0);
+		if (ret > 0)
+			s->sent += ret;
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static unsigned int opt_uint(const char *s) {
+	char *end;
+	unsigned long ret = strtoul(s, &end, 10);
+	if (!*s || *end || !ret) {
+		fprintf(stderr, "invalid number %s\n", s);
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv) {
+	struct sender *senders;
+	unsigned long sent = 0, forwarded;
+	unsigned int i, per_thread;
+	char path[64];
+	double start, elapsed;
+	int c, fd, sink;
+	struct sockaddr_in sin;
+
+	while ((c = getopt(argc, argv, "t:n:T:s:l:a:d:p:")) != -1) {
+		switch (c) {
+			case 't': table_id = strtoul(optarg, NULL, 10); break;
+			case 'n': num_targets = opt_uint(optarg); break;
+			case 'T': num_threads = opt_uint(optarg); break;
+			case 's': seconds = opt_uint(optarg); break;
+			case 'l': payload_len = opt_uint(optarg); break;
+			case 'a': local_addr = optarg; break;
+			case 'd': dest_addr = optarg; break;
+			case 'p': base_port = opt_uint(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-t table] [-n targets] [-T threads] [-s seconds] "
+						"[-l payload len] [-a local address] [-d destination address] "
+						"[-p port]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (!dest_addr)
+		dest_addr = local_addr;
+	if (num_threads > num_targets)
+		num_threads = num_targets;
+	if (base_port < 2 || base_port + num_targets > 65536) {
+		fprintf(stderr, "invalid port range\n");
+		exit(1);
+	}
+
+	if (table_action("add"))
+		die("failed to create table (already in use?)");
+
+	snprintf(path, sizeof(path), PREFIX "/%u/control", table_id);
+	fd = open(path, O_RDWR | O_TRUNC);
+	if (fd == -1)
+		die("failed to open table control file");
+	add_targets(fd);
+
+	// forwarded packets land here and are discarded once the socket buffer is full
+	sink = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(base_port - 1);
+	inet_pton(AF_INET, dest_addr, &sin.sin_addr);
+	if (sink == -1 || bind(sink, (struct sockaddr *) &sin, sizeof(sin)))
+		fprintf(stderr, "warning: failed to bind sink socket: %s\n", strerror(errno));
+
+	senders = calloc(num_threads, sizeof(*senders));
+	per_thread = num_targets / num_threads;
+
+	start = now();
+	for (i = 0; i < num_threads; i++) {
+		senders[i].first = i * per_thread;
+		senders[i].num = (i == num_threads - 1) ? num_targets - senders[i].first : per_thread;
+		if (pthread_create(&senders[i].thread, NULL, sender_loop, &senders[i]))
+			die("failed to create thread");
+	}
+
+	sleep(seconds);
+	stop = 1;
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(senders[i].thread, NULL);
+		sent += senders[i].sent;
+	}
+	elapsed = now() - start;
+
+	forwarded = forwarded_packets();
+
+	printf("%u targets, %u threads, %u bytes payload, %.1f seconds\n",
+			num_targets, num_threads, payload_len, elapsed);
+	printf("sent      %12lu packets %12.0f pkt/s\n", sent, sent / elapsed);
+	printf("forwarded %12lu packets %12.0f pkt/s\n", forwarded, forwarded / elapsed);
+	if (!forwarded)
+		printf("no packets were forwarded - is the iptables rule for table %u in place?\n", table_id);
+
+	close(sink);
+	close(fd);
+	if (table_action("del"))
+		fprintf(stderr, "failed to delete table %u: %s\n", table_id, strerror(errno));
+
+	return 0;
+}
@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <glib.h>
+#include <json-glib/json-glib.h>
+
+#include "redis_doc.h"
+#include "str.h"
+#include "bench.h"
+
+/* Builds a redis call document shaped like a two-party call with two audio media
+ * (two tags, four streams, four SSRCs), once as JSON and once in the binary format,
+ * and encodes and parses both back repeatedly. It prints the size of each document
+ * and the time per encode and decode, and fails if the two formats don't decode to
+ * the same number of values. The optional argument is the number of rounds. */
+
+#define NUM_TAGS	2
+#define NUM_MEDIAS	2
+#define NUM_STREAMS	4
+#define NUM_SFDS	4
+#define NUM_MAPS	2
+#define NUM_SSRCS	4
+
+static void kv(struct redis_enc *e, const char *k, const char *fmt, ...) {
+	char buf[256];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	redis_enc_member(e, k);
+	redis_enc_string(e, buf, len);
+}
+
+static void list(struct redis_enc *e, const char *pref, unsigned int id, unsigned int num) {
+	char buf[64];
+	unsigned int i;
+	int len;
+
+	snprintf(buf, sizeof(buf), "%s-%u", pref, id);
+	redis_enc_member(e, buf);
+	redis_enc_begin_array(e);
+	for (i = 0; i < num; i++) {
+		len = snprintf(buf, sizeof(buf), "%u", i);
+		redis_enc_string(e, buf, len);
+	}
+	redis_enc_end_array(e);
+}
+
+static void begin(struct redis_enc *e, const char *pref, unsigned int id) {
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "%s-%u", pref, id);
+	redis_enc_member(e, buf);
+	redis_enc_begin_object(e);
+}
+
+static void encode(struct redis_enc *e) {
+	unsigned int i;
+	static const char key[30] = "\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f"
+		"\x10\x11\x12\x13\x14\x15\x16\x17\x18\x19\x1a\x1b\x1c\x1d\x1e";
+
+	redis_enc_begin_object(e);
+
+	redis_enc_member(e, "json");
+	redis_enc_begin_object(e);
+	kv(e, "created", "%lli", 1546300800123456LL);
+	kv(e, "last_signal", "%ld", 1546300812L);
+	kv(e, "tos", "%u", 184);
+	kv(e, "deleted", "%ld", 0L);
+	kv(e, "num_sfds", "%u", NUM_SFDS);
+	kv(e, "num_streams", "%u", NUM_STREAMS);
+	kv(e, "num_medias", "%u", NUM_MEDIAS);
+	kv(e, "num_tags", "%u", NUM_TAGS);
+	kv(e, "num_maps", "%u", NUM_MAPS);
+	kv(e, "ml_deleted", "%ld", 0L);
+	kv(e, "created_from", "%s", "192.168.1.10:5060");
+	kv(e, "created_from_addr", "%s", "192.168.1.10");
+	kv(e, "redis_hosted_db", "%u", 5);
+	redis_enc_end_object(e);
+
+	for (i = 0; i < NUM_SFDS; i++) {
+		begin(e, "sfd", i);
+		kv(e, "pref_family", "%s", "IP4");
+		kv(e, "localport", "%u", 30000 + i);
+		kv(e, "logical_intf", "%s", "default");
+		kv(e, "local_intf_uid", "%u", 0);
+		kv(e, "stream", "%u", i);
+		redis_enc_end_object(e);
+	}
+
+	for (i = 0; i < NUM_STREAMS; i++) {
+		begin(e, "stream", i);
+		kv(e, "media", "%u", i / 2);
+		kv(e, "sfd", "%u", i);
+		kv(e, "rtp_sink", "%u", i ^ 2);
+		kv(e, "rtcp_sink", "%u", (i ^ 2) | 1);
+		kv(e, "rtcp_sibling", "%u", i | 1);
+		kv(e, "last_packet", "%u", 1546300812);
+		kv(e, "ps_flags", "%u", 0x1234);
+		kv(e, "component", "%u", (i & 1) + 1);
+		kv(e, "endpoint", "%s", "10.20.30.40:12345");
+		kv(e, "advertised_endpoint", "%s", "10.20.30.40:12345");
+		kv(e, "stats-packets", "%u", 123456);
+		kv(e, "stats-bytes", "%u", 21234567);
+		kv(e, "stats-errors", "%u", 0);
+		redis_enc_end_object(e);
+	}
+	for (i = 0; i < NUM_STREAMS; i++)
+		list(e, "stream_sfds", i, 1);
+
+	for (i = 0; i < NUM_TAGS; i++) {
+		begin(e, "tag", i);
+		kv(e, "created", "%u", 1546300800);
+		kv(e, "active", "%u", i ^ 1);
+		kv(e, "deleted", "%u", 0);
+		kv(e, "tag", "%s", "as8df7a9s8d7f");
+		kv(e, "via-branch", "%s", "z9hG4bK.a8sd7f9a8s7df");
+		redis_enc_end_object(e);
+	}
+	for (i = 0; i < NUM_TAGS; i++) {
+		list(e, "other_tags", i, 1);
+		list(e, "medias", i, 1);
+	}
+
+	for (i = 0; i < NUM_MEDIAS; i++) {
+		begin(e, "media", i);
+		kv(e, "tag", "%u", i);
+		kv(e, "index", "%u", 1);
+		kv(e, "type", "%s", "audio");
+		kv(e, "protocol", "%s", "RTP/SAVP");
+		kv(e, "desired_family", "%s", "IP4");
+		kv(e, "sdes_in_tag", "%u", 1);
+		kv(e, "sdes_out_tag", "%u", 1);
+		kv(e, "logical_intf", "%s", "default");
+		kv(e, "media_flags", "%u", 0x4321);
+		kv(e, "sdes_in-crypto_suite", "%s", "AES_CM_128_HMAC_SHA1_80");
+		redis_enc_member(e, "sdes_in-master_key");
+		redis_enc_string(e, key, 16);
+		redis_enc_member(e, "sdes_in-master_salt");
+		redis_enc_string(e, key + 16, 14);
+		kv(e, "sdes_in-unenc-srtp", "%i", 0);
+		kv(e, "sdes_in-unenc-srtcp", "%i", 0);
+		kv(e, "sdes_in-unauth-srtp", "%i", 0);
+		redis_enc_end_object(e);
+	}
+	for (i = 0; i < NUM_MEDIAS; i++) {
+		list(e, "streams", i, 2);
+		list(e, "maps", i, 1);
+		list(e, "payload_types", i, 3);
+		list(e, "payload_types_send", i, 3);
+	}
+
+	for (i = 0; i < NUM_MAPS; i++) {
+		begin(e, "map", i);
+		kv(e, "wildcard", "%i", 0);
+		kv(e, "num_ports", "%u", 2);
+		kv(e, "intf_preferred_family", "%s", "IP4");
+		kv(e, "logical_intf", "%s", "default");
+		kv(e, "endpoint", "%s", "10.20.30.40:12345");
+		redis_enc_end_object(e);
+	}
+	for (i = 0; i < NUM_MAPS; i++)
+		list(e, "map_sfds", i, 3);
+
+	redis_enc_member(e, "ssrc_table");
+	redis_enc_begin_array(e);
+	for (i = 0; i < NUM_SSRCS; i++) {
+		redis_enc_begin_object(e);
+		kv(e, "ssrc", "%u", 0x12345678 + i);
+		kv(e, "in_srtp_index", "%u", 65536 + i);
+		kv(e, "in_srtcp_index", "%u", 100 + i);
+		kv(e, "in_payload_type", "%i", 8);
+		kv(e, "out_srtp_index", "%u", 65536 + i);
+		kv(e, "out_srtcp_index", "%u", 100 + i);
+		kv(e, "out_payload_type", "%i", 8);
+		redis_enc_end_object(e);
+	}
+	redis_enc_end_array(e);
+
+	redis_enc_end_object(e);
+}
+
+/* reads every member the way the restore code does: objects into a hash, arrays element by element */
+static unsigned int decode_json(const char *data) {
+	JsonParser *parser = json_parser_new();
+	JsonReader *reader;
+	unsigned int i, j, n, m, num = 0;
+	gchar **members;
+
+	if (!json_parser_load_from_data(parser, data, -1, NULL))
+		abort();
+	reader = json_reader_new(json_parser_get_root(parser));
+
+	members = json_reader_list_members(reader);
+	n = json_reader_count_members(reader);
+	for (i = 0; i < n; i++) {
+		json_reader_read_member(reader, members[i]);
+		if (json_reader_is_object(reader)) {
+			GHashTable *ht = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+			gchar **keys = json_reader_list_members(reader);
+			m = json_reader_count_members(reader);
+			for (j = 0; j < m; j++) {
+				json_reader_read_member(reader, keys[j]);
+				const char *s = json_reader_get_string_value(reader);
+				g_hash_table_insert(ht, strdup(keys[j]), str_uri_decode_len(s, strlen(s)));
+				json_reader_end_member(reader);
+				num++;
+			}
+			g_strfreev(keys);
+			g_hash_table_destroy(ht);
+		}
+		else {
+			m = json_reader_count_elements(reader);
+			for (j = 0; j < m; j++) {
+				json_reader_read_element(reader, j);
+				if (!json_reader_is_object(reader)) {
+					const char *s = json_reader_get_string_value(reader);
+					free(str_uri_decode_len(s, strlen(s)));
+				}
+				json_reader_end_element(reader);
+				num++;
+			}
+		}
+		json_reader_end_member(reader);
+	}
+	g_strfreev(members);
+
+	g_object_unref(reader);
+	g_object_unref(parser);
+	return num;
+}
+
+static unsigned int decode_bin(char *data, size_t len) {
+	struct redis_bin_doc doc;
+	GHashTableIter hi;
+	gpointer name, val;
+	struct redis_bin_iter it;
+	struct redis_bin_node *node, v;
+	unsigned int num = 0, i;
+	str k, *strs;
+
+	if (redis_bin_doc_init(&doc, data, len))
+		abort();
+
+	g_hash_table_iter_init(&hi, doc.members);
+	while (g_hash_table_iter_next(&hi, &name, &val)) {
+		node = val;
+		redis_bin_iter_init(&it, node);
+		if (node->type == 'o') {
+			GHashTable *ht = g_hash_table_new(g_str_hash, g_str_equal);
+			strs = malloc(sizeof(*strs) * node->count);
+			for (i = 0; redis_bin_iter_next(&it, &k, &v) == 1; i++) {
+				strs[i] = v.s;
+				g_hash_table_insert(ht, k.s, &strs[i]);
+				num++;
+			}
+			g_hash_table_destroy(ht);
+			free(strs);
+		}
+		else {
+			while (redis_bin_iter_next(&it, NULL, &v) == 1)
+				num++;
+		}
+	}
+
+	redis_bin_doc_free(&doc);
+	return num;
+}
+
+int main(int argc, char **argv) {
+	unsigned long iterations = 100000, i;
+	struct redis_enc e;
+	double start, t_json_enc, t_json_dec, t_bin_enc, t_bin_dec;
+	char *json;
+	str bin;
+	char *bin_copy;
+	size_t json_len;
+	unsigned int n_json, n_bin;
+
+	if (argc > 1)
+		iterations = strtoul(argv[1], NULL, 10);
+	if (!iterations)
+		iterations = 1;
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		redis_enc_init_json(&e);
+		encode(&e);
+		free(redis_enc_finish_json(&e));
+	}
+	t_json_enc = now() - start;
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		redis_enc_init_bin(&e);
+		encode(&e);
+		redis_enc_finish_bin(&e, &bin);
+	}
+	t_bin_enc = now() - start;
+
+	redis_enc_init_json(&e);
+	encode(&e);
+	json = redis_enc_finish_json(&e);
+	json_len = strlen(json);
+
+	redis_enc_init_bin(&e);
+	encode(&e);
+	redis_enc_finish_bin(&e, &bin);
+	bin_copy = malloc(bin.len);
+	memcpy(bin_copy, bin.s, bin.len);
+
+	n_json = decode_json(json);
+	n_bin = decode_bin(bin_copy, bin.len);
+	if (n_json != n_bin) {
+		fprintf(stderr, "decoded %u JSON values but %u binary values\n", n_json, n_bin);
+		return 1;
+	}
+
+	start = now();
+	for (i = 0; i < iterations; i++)
+		decode_json(json);
+	t_json_dec = now() - start;
+
+	start = now();
+	for (i = 0; i < iterations; i++)
+		decode_bin(bin_copy, bin.len);
+	t_bin_dec = now() - start;
+
+	printf("%u values per call\n", n_json);
+	printf("json   %6zu bytes   encode %8.1f ns/call   decode %8.1f ns/call\n",
+			json_len, t_json_enc * 1e9 / iterations, t_json_dec * 1e9 / iterations);
+	printf("bin    %6i bytes   encode %8.1f ns/call   decode %8.1f ns/call\n",
+			bin.len, t_bin_enc * 1e9 / iterations, t_bin_dec * 1e9 / iterations);
+
+	free(json);
+	free(bin_copy);
+
+	return 0;
+}
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crypto.h"
+#include "rtp.h"
+#include "rtplib.h"
+#include "ssrc.h"
+#include "log.h"
+#include "bench.h"
+
+/* Encrypts and then decrypts the same 172 byte RTP packet (20 ms of G.711) over and
+ * over with each SRTP crypto suite, through rtp_avp2savp() and rtp_savp2avp(), and
+ * prints the packet rate of each direction. This is the cost of SRTP<>RTP bridging
+ * in userspace. The optional argument is the number of packets per suite and
+ * direction. */
+
+#define PAYLOAD_LEN 160
+#define PACKET_LEN (12 + PAYLOAD_LEN)
+
+static const char *suites[] = {
+	"AES_CM_128_HMAC_SHA1_80",
+	"AES_CM_128_HMAC_SHA1_32",
+	"AES_CM_256_HMAC_SHA1_80",
+	"F8_128_HMAC_SHA1_80",
+	NULL,
+};
+
+static void ctx_init(struct crypto_context *c, const struct crypto_suite *cs) {
+	int i;
+
+	memset(c, 0, sizeof(*c));
+	c->params.crypto_suite = cs;
+	for (i = 0; i < cs->master_key_len; i++)
+		c->params.master_key[i] = i * 7 + 1;
+	for (i = 0; i < cs->master_salt_len; i++)
+		c->params.master_salt[i] = i * 13 + 3;
+}
+
+static void bench(const char *name, unsigned long iterations) {
+	str suite;
+	const struct crypto_suite *cs;
+	struct crypto_context enc, dec;
+	struct ssrc_ctx ssrc_enc, ssrc_dec;
+	char plain[PACKET_LEN];
+	char cipher[PACKET_LEN + 64];
+	char buf[PACKET_LEN + 64];
+	unsigned int cipher_len;
+	unsigned long i;
+	double start, t_enc, t_dec;
+	str s;
+
+	str_init(&suite, (char *) name);
+	cs = crypto_find_suite(&suite);
+	if (!cs) {
+		fprintf(stderr, "suite %s not found\n", name);
+		exit(1);
+	}
+
+	ctx_init(&enc, cs);
+	ctx_init(&dec, cs);
+	memset(&ssrc_enc, 0, sizeof(ssrc_enc));
+	memset(&ssrc_dec, 0, sizeof(ssrc_dec));
+
+	memset(plain, 0xd5, sizeof(plain));
+	plain[0] = 0x80; /* V=2 */
+	plain[1] = 0x00; /* PT=0 */
+	plain[2] = 0x12;
+	plain[3] = 0x34;
+
+	/* reference packet for the decryption run */
+	memcpy(cipher, plain, PACKET_LEN);
+	str_init_len(&s, cipher, PACKET_LEN);
+	if (rtp_avp2savp(&s, &enc, &ssrc_enc)) {
+		fprintf(stderr, "%s: rtp_avp2savp failed\n", name);
+		exit(1);
+	}
+	cipher_len = s.len;
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		memcpy(buf, plain, PACKET_LEN);
+		str_init_len(&s, buf, PACKET_LEN);
+		rtp_avp2savp(&s, &enc, &ssrc_enc);
+	}
+	t_enc = now() - start;
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		memcpy(buf, cipher, cipher_len);
+		str_init_len(&s, buf, cipher_len);
+		if (rtp_savp2avp(&s, &dec, &ssrc_dec)) {
+			fprintf(stderr, "%s: rtp_savp2avp failed\n", name);
+			exit(1);
+		}
+	}
+	t_dec = now() - start;
+
+	if (memcmp(buf, plain, PACKET_LEN)) {
+		fprintf(stderr, "%s: decrypted packet doesn't match\n", name);
+		exit(1);
+	}
+
+	printf("%-24s avp2savp %10.0f pkt/s %7.1f ns/pkt   savp2avp %10.0f pkt/s %7.1f ns/pkt\n",
+			name,
+			iterations / t_enc, t_enc * 1e9 / iterations,
+			iterations / t_dec, t_dec * 1e9 / iterations);
+}
+
+int main(int argc, char **argv) {
+	unsigned long iterations = 1000000;
+	int i;
+
+	if (argc > 1)
+		iterations = strtoul(argv[1], NULL, 10);
+	if (!iterations)
+		iterations = 1;
+
+	crypto_init_main();
+
+	for (i = 0; suites[i]; i++)
+		bench(suites[i], iterations);
+
+	return 0;
+}
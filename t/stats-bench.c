@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "aux.h"
+#include "thread_stats.h"
+#include "bench.h"
+
+/* Replays the counter updates that stream_packet() does for each forwarded packet
+ * from 1, 2, 4, ... threads up to the given maximum (default: number of CPUs). Each
+ * thread count runs twice: once with the global packet and byte counters as shared
+ * atomics, and once with thread_stats slabs. The gap between the two rates shows
+ * the cache line contention on the global counters. The first argument is the
+ * number of packets per thread. */
+
+#define PACKET_LEN 172
+
+struct stream_stats {
+	atomic64 packets;
+	atomic64 bytes;
+	atomic64 last_packet;
+};
+
+struct worker {
+	pthread_t thread;
+	int shared;
+	struct stream_stats *stream;
+};
+
+static struct {
+	atomic64 packets;
+	atomic64 bytes;
+} global_stats;
+
+static unsigned long iterations = 10000000;
+static volatile int go;
+
+static void *worker_loop(void *p) {
+	struct worker *w = p;
+	struct stream_stats *s = w->stream;
+	unsigned long i;
+
+	while (!go)
+		;
+
+	// the per-stream counters are the same in both modes
+	if (w->shared) {
+		for (i = 0; i < iterations; i++) {
+			atomic64_inc(&s->packets);
+			atomic64_add(&s->bytes, PACKET_LEN);
+			atomic64_set(&s->last_packet, i);
+			atomic64_inc(&global_stats.packets);
+			atomic64_add(&global_stats.bytes, PACKET_LEN);
+		}
+	}
+	else {
+		for (i = 0; i < iterations; i++) {
+			atomic64_inc(&s->packets);
+			atomic64_add(&s->bytes, PACKET_LEN);
+			atomic64_set(&s->last_packet, i);
+			thread_stats_inc(packets);
+			thread_stats_add(bytes, PACKET_LEN);
+		}
+	}
+
+	return NULL;
+}
+
+static double run(unsigned int num_threads, int shared) {
+	struct worker w[num_threads];
+	unsigned int i;
+	double start;
+
+	go = 0;
+	for (i = 0; i < num_threads; i++) {
+		w[i].shared = shared;
+		// separate allocations, as streams handled by different threads would be
+		w[i].stream = g_slice_alloc0(sizeof(*w[i].stream));
+		if (pthread_create(&w[i].thread, NULL, worker_loop, &w[i])) {
+			fprintf(stderr, "failed to create thread\n");
+			exit(1);
+		}
+	}
+
+	start = now();
+	go = 1;
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(w[i].thread, NULL);
+		g_slice_free1(sizeof(*w[i].stream), w[i].stream);
+	}
+
+	return now() - start;
+}
+
+int main(int argc, char **argv) {
+	unsigned int threads, max_threads;
+	struct thread_stats sum;
+	u_int64_t expected = 0;
+	double t_shared, t_thread, total;
+
+	if (argc > 1)
+		iterations = strtoul(argv[1], NULL, 10);
+	if (!iterations)
+		iterations = 1;
+	max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (argc > 2)
+		max_threads = strtoul(argv[2], NULL, 10);
+	if (!max_threads)
+		max_threads = 1;
+
+	for (threads = 1; ; threads *= 2) {
+		if (threads > max_threads)
+			threads = max_threads;
+
+		t_shared = run(threads, 1);
+		t_thread = run(threads, 0);
+		expected += (u_int64_t) threads * iterations;
+
+		total = (double) threads * iterations;
+		printf("%3u threads   shared atomics %8.2f Mpkt/s   per-thread %8.2f Mpkt/s\n",
+				threads, total / t_shared / 1e6, total / t_thread / 1e6);
+
+		if (threads >= max_threads)
+			break;
+	}
+
+	thread_stats_sum(&sum);
+	if (atomic64_get_na(&sum.packets) != expected
+			|| atomic64_get_na(&sum.packets) != atomic64_get(&global_stats.packets)
+			|| atomic64_get_na(&sum.bytes) != expected * PACKET_LEN)
+	{
+		fprintf(stderr, "packet counts don't match\n");
+		exit(1);
+	}
+
+	return 0;
+}